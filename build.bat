@@ -13,7 +13,7 @@ if errorlevel 1 (
 
 REM Compile server
 echo Compiling server...
-gcc -Wall -Wextra -std=c99 -pthread -o server.exe src/server/server.c src/print_functions.c -Iinclude -lws2_32
+gcc -Wall -Wextra -std=c99 -pthread -o server.exe src/server/server.c src/server/shm_bus.c src/server/roster.c src/server/presence.c src/server/history.c src/server/session.c src/server/stats.c src/server/sanitize.c src/server/search.c src/server/transfer.c src/server/capture.c src/server/workers.c src/server/outbox.c src/server/multicast.c src/server/handoff.c src/server/admission.c src/capture_codec.c src/filter.c src/protocol.c src/compress.c src/print_functions.c -Iinclude -lws2_32
 if errorlevel 1 (
     echo Error: Failed to compile server!
     pause
@@ -22,13 +22,22 @@ if errorlevel 1 (
 
 REM Compile client
 echo Compiling client...
-gcc -Wall -Wextra -std=c99 -pthread -o client.exe src/client/client.c src/print_functions.c -Iinclude -lws2_32
+gcc -Wall -Wextra -std=c99 -pthread -o client.exe src/client/client.c src/client/scrollback.c src/client/multicast.c src/capture_codec.c src/filter.c src/protocol.c src/compress.c src/print_functions.c -Iinclude -lws2_32
 if errorlevel 1 (
     echo Error: Failed to compile client!
     pause
     exit /b 1
 )
 
+REM Compile capture replay tool
+echo Compiling replay...
+gcc -Wall -Wextra -std=c99 -pthread -o replay.exe src/tools/replay.c src/capture_codec.c src/compress.c src/print_functions.c -Iinclude -lws2_32
+if errorlevel 1 (
+    echo Error: Failed to compile replay!
+    pause
+    exit /b 1
+)
+
 echo.
 echo Build completed successfully!
 echo.
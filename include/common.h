@@ -1,6 +1,10 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+#endif
+
 #ifdef _WIN32
     #include <winsock2.h>
     #include <ws2tcpip.h>
@@ -9,18 +13,24 @@
     #endif
     #define CLOSE_SOCKET closesocket
     #define SOCKET_ERROR_CODE WSAGetLastError()
+    #define SHUTDOWN_BOTH SD_BOTH
+    #define SHUTDOWN_SEND SD_SEND
 #else
     #include <sys/socket.h>
+    #include <sys/un.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
     #include <netdb.h>
     #include <errno.h>
+    #include <signal.h>
     #define SOCKET int
     #define INVALID_SOCKET -1
     #define SOCKET_ERROR -1
     #define CLOSE_SOCKET close
     #define SOCKET_ERROR_CODE errno
+    #define SHUTDOWN_BOTH SHUT_RDWR
+    #define SHUTDOWN_SEND SHUT_WR
 #endif
 
 #include <stdio.h>
@@ -29,6 +39,7 @@
 #include <pthread.h>
 #include <ctype.h>
 #include <time.h>
+#include <stdint.h>
 
 #define RESET   "\033[0m"
 #define GRAY    "\033[90m"
@@ -49,25 +60,151 @@
 #define MAX_NICK_LEN 32
 #define DEFAULT_PORT 8888
 #define SERVER_IP "127.0.0.1"
+#define NICK_ALLOWED_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-"
+#define SHM_BUS_SLOTS 1024
+#define WHO_PAGE_DEFAULT 20
+#define WHO_PAGE_MAX 30
+#define PRESENCE_WINDOW_MS 500
+#define PRESENCE_MAX_PENDING (2 * MAX_CLIENTS)
+#define HISTORY_LEN 256
+#define SESSION_TOKEN_LEN 32
+#define SESSION_GRACE_SECONDS 60
+#define SESSION_MAX (2 * MAX_CLIENTS)
+#define RESUME_MAX_ATTEMPTS 10
+#define ROSTER_MAX SESSION_MAX
+#define LATENCY_BUCKETS 48
+#define LATENCY_PROBES_MAX 200
+#define LATENCY_PROBES_DEFAULT 20
+/* one inbound chat frame in this many is traced by the server */
+#define TRACE_SAMPLE_CHAT 64
+#define SEARCH_QUEUE_LEN 512
+#define SEARCH_SEGMENT_SPAN 64
+#define SEARCH_MAX_SEGMENTS (HISTORY_LEN / SEARCH_SEGMENT_SPAN + 2)
+#define SEARCH_MAX_TERMS 8
+#define SEARCH_TERM_MAX 32
+#define SEARCH_MAX_RESULTS 20
+#define FILE_CHUNK_SIZE (32 * 1024)
+#define FILE_WINDOW_CHUNKS 4
+#define FILE_MAX_BYTES (4ULL << 30)
+#define FILE_MAX_TRANSFERS 16
+#define FILE_SPOOL_MAX_BYTES (8ULL << 30)
+#define FILE_SEND_TIMEOUT_MS 5000
+#define FILE_RETRY_MS 50
+#define FILE_MAX_INCOMING 4
+#define FILE_NAME_MAX 256
+#define FILE_DOWNLOAD_DIR "downloads"
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER_SIZE (256 * 1024)
+#define CAPTURE_FLUSH_MS 100
+#define WORKER_POOL_MAX 8
+#define WORKER_STRAND_DEPTH 64
+#define WORKER_STRAND_BATCH 16
+#define OUTBOX_FLUSH_FRAMES 8
+#define SCROLLBACK_MAGIC "CHATSCRL"
+#define SCROLLBACK_VERSION 1
+#define SCROLLBACK_INDEX_SLOTS 4096
+#define SCROLLBACK_DATA_SIZE (1024 * 1024)
+#define SCROLLBACK_PAGE 20
+#define SCROLLBACK_GREP_MAX 50
+#define FILTER_IGNORE_MAX 32
+#define FILTER_BLOOM_BITS 256
+#define MULTICAST_REORDER_SLOTS 512
+#define MULTICAST_NACK_MS 100
+#define MULTICAST_NACK_MAX HISTORY_LEN
+#define LOCAL_ADDRESS_PREFIX "unix:"
+#define LOCAL_PATH_MAX 108
+#define COMPRESS_DICT_VERSION 1
+#define COMPRESS_MIN_TEXT 24
+#define HANDOFF_POLL_MS 100
+#define HANDOFF_PARK_MS 3000
+#define HANDOFF_ACK_MS 10000
+#define HANDOFF_PAUSE_MS 1000
+#define SHUTDOWN_DRAIN_MS 2000
+#define ADMISSION_BATCH 16
+#define ADMISSION_DEFER_SECS 2
+#define ADMISSION_SAMPLE_MS 100
+#define ADMISSION_PER_IP 4
+#define ADMISSION_MAX_QUEUED 4096
+#define ADMISSION_MAX_LAG_MS 250
+#define ADMISSION_MAX_RSS_MB 1024
 
 
-static inline int is_allowed_nick_char(int c) {
-    return isalnum(c) || c=='.' || c=='_' || c=='-';
+static inline uint64_t monotonic_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
 }
 
+/* Who may send a frame type; the receiving side's decoder rejects the rest. */
+#define MSG_FROM_CLIENT 0x1
+#define MSG_FROM_SERVER 0x2
+#define MSG_FROM_BOTH (MSG_FROM_CLIENT | MSG_FROM_SERVER)
+
+/*
+ * The protocol schema, one row per frame type: name, the outbox lane the
+ * server queues it on, and who may send it. Wire values follow the row
+ * order starting at 1, so new types go at the end. The type enum, type
+ * names, lanes and the decoder's checks are all generated from this list
+ * (see protocol.c); each side dispatches through a table indexed by type.
+ */
+#define MSG_TYPES(X) \
+    X(CHAT,               OUTBOX_CHAT,    MSG_FROM_BOTH)   \
+    X(JOIN,               OUTBOX_CONTROL, MSG_FROM_CLIENT) \
+    X(LEAVE,              OUTBOX_CONTROL, MSG_FROM_CLIENT) \
+    X(SYSTEM,             OUTBOX_CONTROL, MSG_FROM_SERVER) \
+    X(PRIVATE,            OUTBOX_PRIVATE, MSG_FROM_BOTH)   \
+    X(NICKNAME_TAKEN,     OUTBOX_CONTROL, MSG_FROM_SERVER) \
+    X(NICKNAME_AVAILABLE, OUTBOX_CONTROL, MSG_FROM_SERVER) \
+    X(RENAME,             OUTBOX_CONTROL, MSG_FROM_CLIENT) \
+    X(WHO,                OUTBOX_CONTROL, MSG_FROM_CLIENT) \
+    X(WHO_RESPONSE,       OUTBOX_CONTROL, MSG_FROM_SERVER) \
+    X(PRESENCE,           OUTBOX_CHAT,    MSG_FROM_SERVER) \
+    X(SESSION,            OUTBOX_CONTROL, MSG_FROM_SERVER) \
+    X(RESUME,             OUTBOX_CONTROL, MSG_FROM_CLIENT) \
+    X(RESUME_FAILED,      OUTBOX_CONTROL, MSG_FROM_SERVER) \
+    X(PING,               OUTBOX_CONTROL, MSG_FROM_CLIENT) \
+    X(PONG,               OUTBOX_CONTROL, MSG_FROM_SERVER) \
+    X(SEARCH,             OUTBOX_CONTROL, MSG_FROM_CLIENT) \
+    X(SEARCH_RESULT,      OUTBOX_PRIVATE, MSG_FROM_SERVER) \
+    X(FILE_OFFER,         OUTBOX_CONTROL, MSG_FROM_BOTH)   \
+    X(FILE_DATA,          OUTBOX_CONTROL, MSG_FROM_BOTH)   \
+    X(FILE_ACK,           OUTBOX_CONTROL, MSG_FROM_BOTH)   \
+    X(FILE_END,           OUTBOX_CONTROL, MSG_FROM_BOTH)   \
+    X(FILTER,             OUTBOX_CONTROL, MSG_FROM_CLIENT) \
+    X(MULTICAST,          OUTBOX_CONTROL, MSG_FROM_BOTH)
+
 typedef enum {
-    MSG_TYPE_CHAT = 1,
-    MSG_TYPE_JOIN,
-    MSG_TYPE_LEAVE,
-    MSG_TYPE_SYSTEM,
-    MSG_TYPE_PRIVATE,
-    MSG_TYPE_NICKNAME_TAKEN,
-    MSG_TYPE_NICKNAME_AVAILABLE,
-    MSG_TYPE_RENAME,
-    MSG_TYPE_WHO,
-    MSG_TYPE_WHO_RESPONSE
+    MSG_TYPE_INVALID = 0,
+#define MSG_TYPE_ENUM(name, lane, from) MSG_TYPE_##name,
+    MSG_TYPES(MSG_TYPE_ENUM)
+#undef MSG_TYPE_ENUM
+    MSG_TYPE_COUNT
 } msg_type_t;
 
+#define MSG_FLAG_TRACE 0x1
+/* On JOIN or RESUME, with the dictionary version in cursor: the client
+ * reads packed frames. */
+#define MSG_FLAG_COMPRESS 0x2
+/* On a SYSTEM frame turning a connection away: count is the number of
+ * seconds to wait before trying again. */
+#define MSG_FLAG_RETRY 0x4
+
+typedef enum {
+    TRACE_CLIENT_SEND,
+    TRACE_SERVER_RECV,
+    TRACE_SERVER_ENQUEUE,
+    TRACE_SERVER_FLUSH,
+    TRACE_STAMPS
+} trace_stamp_t;
+
 typedef struct {
     int type;
     char nickname[MAX_NICK_LEN];
@@ -75,8 +212,126 @@ typedef struct {
     char message[MAX_MSG_LEN];
     time_t timestamp;
     int client_id;
+    int cursor;
+    int count;
+    uint64_t seq;
+    uint64_t length;
+    uint32_t flags;
+    uint64_t trace[TRACE_STAMPS];
 } MessageInfo;
 
+typedef struct {
+    const char* name;
+    int lane;
+    int from;
+} MessageSchema;
+
+typedef enum {
+    CAPTURE_OPEN = 1,
+    CAPTURE_FRAME,
+    CAPTURE_CLOSE
+} capture_kind_t;
+
+/*
+ * Capture file: a CaptureFileHeader, then one CaptureRecord per event.
+ * FRAME records are followed by len bytes of the frame, zero-run encoded:
+ * repeated (zero count, literal count, literals) triples with one-byte
+ * counts, until frame_size bytes have been produced.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t frame_size;
+} CaptureFileHeader;
+
+typedef struct {
+    uint64_t ts_ns;
+    uint32_t conn_id;
+    uint16_t kind;
+    uint16_t len;
+} CaptureRecord;
+
+/*
+ * A packed frame is a 4-byte header (kind, zero, body length little endian)
+ * and a body that unpacks to one MessageInfo. A plain frame starts with the
+ * low byte of its type, never a packed kind, so a connection that asked for
+ * packed frames can still be sent plain ones in between.
+ */
+#define WIRE_HEADER_SIZE 4
+
+typedef enum {
+    WIRE_ZERO_RUN = 0xC1,
+    WIRE_LZ = 0xC2
+} wire_kind_t;
+
+typedef struct {
+    int done;
+    size_t len;
+    unsigned char bytes[sizeof(MessageInfo)];
+} PackedFrame;
+
+typedef enum {
+    OUTBOX_CONTROL = 0,
+    OUTBOX_PRIVATE,
+    OUTBOX_CHAT,
+    OUTBOX_HISTORY,
+    OUTBOX_LANES
+} outbox_lane_t;
+
+typedef struct Outbox Outbox;
+
+/* A frame still queued for a client, as a hot restart carries it over:
+ * packed is the length of the packed bytes at the start of frame, 0 if
+ * the frame is plain. */
+typedef struct {
+    uint16_t lane;
+    uint16_t packed;
+    MessageInfo frame;
+} QueuedFrame;
+
+/* MSG_TYPE_FILTER carries the op in count and, for FILTER_OP_MODE, the
+ * delivery mode in cursor; ignore ops name the sender in target_nickname. */
+typedef enum {
+    FILTER_OP_IGNORE = 1,
+    FILTER_OP_UNIGNORE,
+    FILTER_OP_MODE
+} filter_op_t;
+
+/* MSG_TYPE_MULTICAST carries the op in cursor. An offer names the group
+ * in message and the port in count; SUBSCRIBED and LOST carry a seq, and
+ * a NACK asks for count frames starting at seq. */
+typedef enum {
+    MCAST_OFFER = 1,
+    MCAST_SUBSCRIBE,
+    MCAST_SUBSCRIBED,
+    MCAST_NACK,
+    MCAST_LOST
+} multicast_op_t;
+
+typedef enum {
+    DELIVER_ALL = 0,
+    DELIVER_MENTIONS,
+    DELIVER_MUTED
+} deliver_mode_t;
+
+typedef enum {
+    FILTER_PASS = 0,
+    FILTER_IGNORED,
+    FILTER_MUTED,
+    FILTER_UNMENTIONED,
+    FILTER_REASONS
+} filter_reason_t;
+
+typedef struct {
+    uint64_t bloom[FILTER_BLOOM_BITS / 64];
+    char ignored[FILTER_IGNORE_MAX][MAX_NICK_LEN];
+    int ignored_count;
+    int mode;
+    char nick[MAX_NICK_LEN];
+    size_t nick_len;
+    unsigned char skip[256];
+} DeliveryFilter;
+
 typedef struct {
     SOCKET socket;
     char nickname[MAX_NICK_LEN];
@@ -84,22 +339,215 @@ typedef struct {
     int client_id;
     struct sockaddr_in address;
     pthread_t thread_id;
+    int leaving;
+    int detached;
+    pthread_mutex_t send_mutex;
+    Outbox* outbox;
+    DeliveryFilter filter;
+    int multicast;
+    int local;
+    int peer_uid;
+    int peer_pid;
+    int trusted;
+    int adopted;
 } Client;
 
+typedef struct {
+    int ids[ROSTER_MAX];
+    int offsets[ROSTER_MAX + 1];
+    char text[ROSTER_MAX * MAX_NICK_LEN];
+    int count;
+    pthread_mutex_t mutex;
+} Roster;
+
+typedef enum {
+    PRESENCE_JOINED = 1,
+    PRESENCE_LEFT,
+    PRESENCE_RENAMED
+} presence_kind_t;
+
+typedef struct {
+    int client_id;
+    int kind;
+    char old_nick[MAX_NICK_LEN];
+    char nick[MAX_NICK_LEN];
+} PresenceEvent;
+
+typedef struct {
+    PresenceEvent pending[PRESENCE_MAX_PENDING];
+    int count;
+    int collecting;
+    int closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} PresenceBatch;
+
+typedef struct {
+    MessageInfo* frames;
+    uint64_t next_seq;
+    uint64_t epoch;
+    pthread_mutex_t mutex;
+} History;
+
+typedef struct {
+    char token[SESSION_TOKEN_LEN + 1];
+    char nickname[MAX_NICK_LEN];
+    int client_id;
+    int in_use;
+    int held;
+    time_t expires;
+} Session;
+
+typedef struct {
+    Session sessions[SESSION_MAX];
+    pthread_mutex_t mutex;
+} SessionTable;
+
+typedef enum {
+    STAGE_PROCESS,
+    STAGE_FANOUT,
+    STAGE_RESIDENCE,
+    STAGE_COUNT
+} latency_stage_t;
+
+typedef struct {
+    unsigned long long buckets[LATENCY_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+} LatencyHistogram;
+
+typedef struct {
+    LatencyHistogram stages[STAGE_COUNT];
+    unsigned long long sanitize_frames;
+    unsigned long long sanitize_rewritten;
+    unsigned long long sanitize_bytes;
+    unsigned long long sanitize_ns;
+    unsigned long long filtered[FILTER_REASONS];
+    unsigned long long frames_in[MSG_TYPE_COUNT];
+    unsigned long long frames_rejected;
+    unsigned long long packed_lz;
+    unsigned long long packed_zero_run;
+    unsigned long long packed_plain;
+    unsigned long long packed_bytes;
+    unsigned long long packed_ns;
+    unsigned long long packed_sends;
+} ServerStats;
+
+typedef struct ShmBus ShmBus;
+typedef struct SearchIndex SearchIndex;
+typedef struct FileTransfers FileTransfers;
+typedef struct Capture Capture;
+typedef struct WorkerPool WorkerPool;
+typedef struct Multicast Multicast;
+typedef struct Handoff Handoff;
+typedef struct Takeover Takeover;
+typedef struct Admission Admission;
+
+typedef enum {
+    ADMIT_OK = 0,
+    REFUSE_FULL,
+    REFUSE_PER_IP,
+    REFUSE_QUEUE,
+    REFUSE_LAG,
+    REFUSE_MEMORY,
+    REFUSE_DESCRIPTORS,
+    REFUSE_REASONS
+} admission_reason_t;
+
+typedef struct {
+    int per_ip;
+    int max_queued;
+    int max_lag_ms;
+    int max_rss_mb;
+} AdmissionLimits;
+
+typedef struct {
+    SOCKET socket;
+    struct sockaddr_in address;
+} AdmittedConn;
+
 typedef struct {
     Client clients[MAX_CLIENTS];
     int client_count;
     int next_client_id;
     pthread_mutex_t clients_mutex;
     SOCKET server_socket;
+    SOCKET local_socket;
+    char local_path[LOCAL_PATH_MAX];
+    int trusted_uid;
+    int compress;
+    ShmBus* bus;
+    pthread_t bus_tid;
+    int bus_running;
+    Roster roster;
+    PresenceBatch presence;
+    pthread_t presence_tid;
+    int presence_running;
+    pthread_t sweeper_tid;
+    int sweeper_running;
+    History history;
+    SessionTable sessions;
+    ServerStats stats;
+    SearchIndex* search;
+    FileTransfers* transfers;
+    Capture* capture;
+    WorkerPool* workers;
+    Multicast* multicast;
+    Handoff* handoff;
+    Admission* admission;
+    int stopping;
 } ServerState;
 
+typedef struct {
+    int id;
+    FILE* fp;
+    char path[sizeof(FILE_DOWNLOAD_DIR) + FILE_NAME_MAX + 8];
+    char from[MAX_NICK_LEN];
+    uint64_t size;
+    uint64_t received;
+} IncomingFile;
+
+typedef struct Scrollback Scrollback;
+typedef struct MulticastFeed MulticastFeed;
+
 typedef struct {
     SOCKET socket;
     char nickname[MAX_NICK_LEN];
     int connected;
     int client_id;
     pthread_t receive_thread;
+    int receiving;
+    char (*roster)[MAX_NICK_LEN];
+    int roster_count;
+    int roster_capacity;
+    int who_listing;
+    int search_listing;
+    pthread_mutex_t roster_mutex;
+    char server_ip[LOCAL_PATH_MAX + 8];
+    int port;
+    char session_token[SESSION_TOKEN_LEN + 1];
+    uint64_t last_seq;
+    pthread_mutex_t latency_mutex;
+    int probes_received;
+    uint64_t probe_rtt[LATENCY_PROBES_MAX];
+    uint64_t probe_process[LATENCY_PROBES_MAX];
+    uint64_t probe_fanout[LATENCY_PROBES_MAX];
+    uint64_t probe_residence[LATENCY_PROBES_MAX];
+    unsigned long long render_frames;
+    uint64_t render_ns_total;
+    uint64_t render_ns_max;
+    pthread_mutex_t file_mutex;
+    pthread_cond_t file_cond;
+    int outgoing_id;
+    int outgoing_credit;
+    int outgoing_failed;
+    int retry_after_ms;
+    int accept_files;
+    IncomingFile incoming[FILE_MAX_INCOMING];
+    Scrollback* scrollback;
+    DeliveryFilter filter;
+    MulticastFeed* feed;
 } ClientState;
 
 int initialize_network(void);
@@ -113,11 +561,18 @@ int send_message(SOCKET sock, const MessageInfo* msg);
 int receive_message(SOCKET sock, MessageInfo* msg);
 
 
-int server_init(ServerState* server, int port);
+int server_init(ServerState* server, int port, const char* local_path);
+int server_adopt(ServerState* server, Takeover* takeover);
+SOCKET open_local_listener(const char* path);
+int local_peer_uid(SOCKET sock, int* pid);
 void server_cleanup(ServerState* server);
+void server_pause_background(ServerState* server);
+void server_resume_background(ServerState* server);
 int add_client(ServerState* server, SOCKET client_socket, struct sockaddr_in client_addr);
 void remove_client(ServerState* server, int client_index);
 void broadcast_message(ServerState* server, const MessageInfo* msg, int exclude_index);
+int send_to_client(ServerState* server, int client_index, const MessageInfo* msg);
+int send_to_client_lane(ServerState* server, int client_index, int lane, const MessageInfo* msg);
 int server_send_private_message(ServerState* server, const MessageInfo* msg);
 int find_client_by_nickname(ServerState* server, const char* nickname);
 int is_nickname_available(ServerState* server, const char* nickname);
@@ -126,6 +581,164 @@ int set_client_nickname(ServerState* server, int client_index, const char* new_n
 void* handle_client(void* arg);
 
 
+int roster_init(Roster* roster);
+void roster_destroy(Roster* roster);
+void roster_upsert(Roster* roster, int client_id, const char* nickname);
+void roster_remove(Roster* roster, int client_id);
+int roster_page(Roster* roster, int cursor, int page_size, char* out, size_t cap, int* total);
+
+
+int presence_init(PresenceBatch* batch);
+void presence_close(PresenceBatch* batch);
+void presence_reopen(PresenceBatch* batch);
+void presence_destroy(PresenceBatch* batch);
+void presence_joined(PresenceBatch* batch, int client_id, const char* nick);
+void presence_left(PresenceBatch* batch, int client_id, const char* nick);
+void presence_renamed(PresenceBatch* batch, int client_id, const char* old_nick, const char* new_nick);
+int presence_collect(PresenceBatch* batch, PresenceEvent* out, int cap, int window_ms);
+int presence_format(const PresenceEvent* events, int count, char* out, size_t cap, int* consumed);
+
+
+int history_init(History* history);
+void history_destroy(History* history);
+uint64_t history_append(History* history, MessageInfo* msg);
+int history_get(History* history, uint64_t seq, MessageInfo* out);
+void history_bounds(History* history, uint64_t* oldest, uint64_t* latest);
+
+
+int session_table_init(SessionTable* table);
+void session_table_destroy(SessionTable* table);
+int session_issue(SessionTable* table, int client_id, const char* nickname, char* token_out);
+void session_rename(SessionTable* table, int client_id, const char* nickname);
+int session_hold(SessionTable* table, int client_id, time_t now);
+void session_drop(SessionTable* table, int client_id);
+int session_resume(SessionTable* table, const char* token, Session* out);
+int session_nick_held(SessionTable* table, const char* nickname, int except_client_id);
+int session_expire(SessionTable* table, time_t now, Session* out, int cap);
+
+
+void stats_record_latency(ServerStats* stats, int stage, uint64_t ns);
+void stats_record_trace(ServerStats* stats, const MessageInfo* msg);
+void stats_record_flush(ServerStats* stats, const uint64_t* trace, uint64_t flushed);
+uint64_t stats_percentile(const LatencyHistogram* hist, double p);
+void stats_record_sanitize(ServerStats* stats, size_t bytes, uint64_t ns, int rewritten);
+void stats_record_filtered(ServerStats* stats, int reason);
+unsigned long long stats_record_frame(ServerStats* stats, int type, int accepted);
+void stats_record_pack(ServerStats* stats, int kind, size_t len, uint64_t ns);
+void stats_print(const ServerStats* stats);
+
+
+size_t sanitize_text(char* text, size_t cap, int* rewritten);
+int sanitize_frame(MessageInfo* msg, size_t* bytes_scanned);
+const char* sanitize_kernel_name(void);
+
+
+extern const MessageSchema message_schema[MSG_TYPE_COUNT];
+const char* msg_type_name(int type);
+void msg_encode(MessageInfo* msg, int type, const char* nickname, const char* target, const char* text);
+int msg_decode(MessageInfo* msg, int from);
+size_t wire_pack(const MessageInfo* msg, unsigned char* out);
+int wire_packed_length(const unsigned char* header);
+int wire_unpack(const unsigned char* header, const unsigned char* body, size_t len, MessageInfo* out);
+
+
+uint64_t filter_key(const char* nickname);
+void filter_reset(DeliveryFilter* f, const char* nickname);
+void filter_set_nickname(DeliveryFilter* f, const char* nickname);
+int filter_ignore(DeliveryFilter* f, const char* nickname);
+int filter_unignore(DeliveryFilter* f, const char* nickname);
+void filter_renamed(DeliveryFilter* f, const char* old_nick, const char* new_nick);
+int filter_check(const DeliveryFilter* f, const MessageInfo* msg, uint64_t sender_key);
+
+
+SearchIndex* search_start(ServerState* server);
+void search_index_message(SearchIndex* index, const MessageInfo* msg);
+int search_submit_query(SearchIndex* index, int client_index, int client_id, const char* query);
+void search_pause(SearchIndex* index);
+void search_resume(SearchIndex* index);
+void search_print_stats(SearchIndex* index);
+
+
+FileTransfers* transfer_start(ServerState* server);
+void transfer_offer(FileTransfers* ft, int client_index, const MessageInfo* msg);
+int transfer_receive_chunk(FileTransfers* ft, int client_index, const MessageInfo* msg);
+void transfer_ack(FileTransfers* ft, int client_index, const MessageInfo* msg);
+void transfer_finish(FileTransfers* ft, int client_index, const MessageInfo* msg);
+void transfer_pause(FileTransfers* ft);
+void transfer_resume(FileTransfers* ft);
+void transfer_print_stats(FileTransfers* ft);
+
+
+Capture* capture_open(const char* path);
+void capture_close(Capture* capture);
+void capture_event(Capture* capture, int conn_id, int kind);
+void capture_frame(Capture* capture, int conn_id, const MessageInfo* msg);
+size_t capture_encode(const unsigned char* in, size_t len, unsigned char* out);
+size_t capture_decode(const unsigned char* in, size_t len, unsigned char* out, size_t out_cap);
+void capture_print_stats(Capture* capture);
+
+
+typedef void (*worker_task_fn)(ServerState* server, int client_index, MessageInfo* msg);
+WorkerPool* worker_pool_start(ServerState* server, int workers, worker_task_fn task);
+void worker_pool_submit(WorkerPool* pool, int client_index, const MessageInfo* msg);
+void worker_pool_drain(WorkerPool* pool, int client_index);
+void worker_pool_stop(WorkerPool* pool);
+int worker_pool_backlog(WorkerPool* pool);
+void worker_pool_print_stats(WorkerPool* pool);
+
+
+Outbox* outbox_create(ServerState* server, int client_index);
+void outbox_destroy(Outbox* box);
+int outbox_attach(Outbox* box, SOCKET sock);
+void outbox_detach(Outbox* box);
+int outbox_lane_for(int type);
+int outbox_push(Outbox* box, int lane, const MessageInfo* msg);
+int outbox_push_packed(Outbox* box, int lane, const MessageInfo* msg, PackedFrame* packed);
+void outbox_set_compression(Outbox* box, int on);
+int outbox_compressing(Outbox* box);
+int outbox_pause(Outbox* box, int timeout_ms);
+int outbox_resume(Outbox* box);
+int outbox_queued(Outbox* box);
+int outbox_export(Outbox* box, QueuedFrame* out, int cap, uint64_t* held_from);
+void outbox_import(Outbox* box, const QueuedFrame* frames, int count, uint64_t held_from);
+uint64_t outbox_take_gap(Outbox* box);
+int outbox_sync(Outbox* box, int timeout_ms);
+void outbox_print_stats(ServerState* server);
+
+
+Multicast* multicast_open(const char* spec, const char* iface);
+void multicast_close(Multicast* m);
+void multicast_offer(const Multicast* m, MessageInfo* offer);
+int multicast_publish(Multicast* m, const MessageInfo* msg);
+void multicast_note_repair(Multicast* m, int repaired, int lost);
+void multicast_print_stats(Multicast* m);
+
+
+Handoff* handoff_listen(ServerState* server, const char* path);
+int handoff_pending(Handoff* h);
+void handoff_park(Handoff* h);
+int handoff_request(const char* path, Takeover** out);
+int handoff_restore(ServerState* server, Takeover* t);
+void handoff_complete(Takeover* t);
+void handoff_abandon(Takeover* t);
+
+Admission* admission_open(ServerState* server, const AdmissionLimits* limits);
+void admission_close(Admission* a);
+void admission_pause(Admission* a);
+void admission_resume(Admission* a);
+int admission_accept(Admission* a, SOCKET listener, int local, AdmittedConn* out, int cap);
+void admission_refuse(Admission* a, SOCKET sock, int reason);
+void admission_print_stats(Admission* a);
+
+
+ShmBus* shm_bus_open(const char* name);
+void shm_bus_stop(ShmBus* bus);
+void shm_bus_close(ShmBus* bus);
+int shm_bus_publish(ShmBus* bus, const MessageInfo* msg);
+int shm_bus_next(ShmBus* bus, MessageInfo* out, int timeout_ms);
+void shm_bus_stats(const ShmBus* bus, unsigned long long* overruns, unsigned long long* dropped);
+
+
 int client_init(ClientState* client);
 void client_cleanup(ClientState* client);
 int client_connect(ClientState* client, const char* ip, int port);
@@ -138,6 +751,34 @@ void* receive_messages(void* arg);
 int parse_private_message(const char* input, char* target, char* message);
 int parse_nick_command(const char* input, char* new_nick, size_t capacity);
 void request_nickname_change(ClientState* client, const char* new_nick);
+void request_who(ClientState* client);
+int client_resume(ClientState* client);
+void run_latency_probe(ClientState* client, int count);
+void request_search(ClientState* client, const char* query);
+int send_file(ClientState* client, const char* target, const char* path);
+void client_ignore(ClientState* client, const char* nick, int ignore);
+void client_set_delivery(ClientState* client, int mode);
+void client_show_room_frame(ClientState* client, const MessageInfo* msg);
+int send_multicast_request(ClientState* client, int op, uint64_t seq, int count);
+
+
+MulticastFeed* feed_open(ClientState* client, const MessageInfo* offer);
+void feed_close(MulticastFeed* feed);
+void feed_resubscribe(MulticastFeed* feed);
+void feed_subscribed(MulticastFeed* feed, uint64_t base);
+int feed_frame(MulticastFeed* feed, const MessageInfo* msg, int from_group);
+void feed_lost(MulticastFeed* feed, uint64_t through, int count);
+void feed_print_stats(MulticastFeed* feed);
+
+
+Scrollback* scrollback_open(const char* server_ip, int port);
+void scrollback_close(Scrollback* sb);
+void scrollback_position(Scrollback* sb, uint64_t* epoch, uint64_t* last_seq);
+void scrollback_set_epoch(Scrollback* sb, uint64_t epoch);
+void scrollback_seen(Scrollback* sb, const MessageInfo* msg);
+void scrollback_append(Scrollback* sb, const MessageInfo* msg);
+void scrollback_scroll(Scrollback* sb, int count);
+void scrollback_grep(Scrollback* sb, const char* pattern);
 
 
 void print_timestamp();
@@ -0,0 +1,47 @@
+#include "../include/common.h"
+
+/*
+ * Zero-run coding for captured frames. A frame is mostly unused padding in
+ * its fixed-size text fields, so runs of zero bytes are stored as a count
+ * and everything else is copied verbatim. A chat line typically shrinks
+ * from sizeof(MessageInfo) to well under a hundred bytes.
+ */
+
+size_t capture_encode(const unsigned char* in, size_t len, unsigned char* out) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        size_t zeros = 0;
+        while (i < len && in[i] == 0 && zeros < 255) {
+            zeros++;
+            i++;
+        }
+        size_t start = i;
+        size_t literals = 0;
+        while (i < len && literals < 255) {
+            /* a pair of zeros is cheaper as a new run than as literals */
+            if (in[i] == 0 && (i + 1 == len || in[i + 1] == 0)) break;
+            literals++;
+            i++;
+        }
+        out[o++] = (unsigned char)zeros;
+        out[o++] = (unsigned char)literals;
+        memcpy(out + o, in + start, literals);
+        o += literals;
+    }
+    return o;
+}
+
+size_t capture_decode(const unsigned char* in, size_t len, unsigned char* out, size_t out_cap) {
+    size_t i = 0, o = 0;
+    while (i + 2 <= len) {
+        size_t zeros = in[i++];
+        size_t literals = in[i++];
+        if (o + zeros + literals > out_cap || i + literals > len) return 0;
+        memset(out + o, 0, zeros);
+        o += zeros;
+        memcpy(out + o, in + i, literals);
+        o += literals;
+        i += literals;
+    }
+    return o;
+}
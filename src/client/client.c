@@ -1,5 +1,16 @@
 #include "../../include/common.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 
 static void safe_strcpy(char* dst, const char* src, size_t cap) {
     if (!dst || !cap) return;
@@ -14,6 +25,8 @@ int initialize_network(void) {
     WSADATA wsa_data;
     return WSAStartup(MAKEWORD(2, 2), &wsa_data);
 #else
+    /* a peer that vanishes mid-send must surface as EPIPE, not kill us */
+    signal(SIGPIPE, SIG_IGN);
     return 0;
 #endif
 }
@@ -33,7 +46,43 @@ int create_socket(void) {
     return sock;
 }
 
+/* "unix:/path" reaches a server on this host through its local socket. */
+static int is_local_address(const char* address) {
+    return strncmp(address, LOCAL_ADDRESS_PREFIX, strlen(LOCAL_ADDRESS_PREFIX)) == 0;
+}
+
+static SOCKET create_socket_for(const char* address) {
+    if (!is_local_address(address)) return create_socket();
+#ifdef _WIN32
+    print_error("Unix domain sockets are not supported on this platform");
+    return INVALID_SOCKET;
+#else
+    SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) print_error("Failed to create socket");
+    return sock;
+#endif
+}
+
 int connect_to_server(SOCKET sock, const char* ip, int port) {
+    if (is_local_address(ip)) {
+#ifndef _WIN32
+        struct sockaddr_un local_addr;
+        const char* path = ip + strlen(LOCAL_ADDRESS_PREFIX);
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sun_family = AF_UNIX;
+        if (path[0] == '\0' || strlen(path) >= sizeof(local_addr.sun_path)) {
+            print_error("Invalid unix socket path");
+            return -1;
+        }
+        safe_strcpy(local_addr.sun_path, path, sizeof(local_addr.sun_path));
+        if (connect(sock, (struct sockaddr*)&local_addr, sizeof(local_addr)) == SOCKET_ERROR) {
+            print_error("Failed to connect to server");
+            return -1;
+        }
+#endif
+        return 0;
+    }
+
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -52,12 +101,54 @@ int connect_to_server(SOCKET sock, const char* ip, int port) {
     return 0;
 }
 
+/* Serializes writers so a file chunk (header plus raw payload) is never
+ * split by a chat frame sent from another thread. */
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int send_all(SOCKET sock, const char* buf, size_t len) {
+    while (len > 0) {
+        int n = send(sock, buf, (int)len, 0);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int recv_all(SOCKET sock, char* buf, size_t len) {
+    while (len > 0) {
+        int n = recv(sock, buf, (int)len, 0);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
 int send_message(SOCKET sock, const MessageInfo* msg) {
-    return send(sock, (const char*)msg, sizeof(MessageInfo), 0);
+    pthread_mutex_lock(&send_lock);
+    int rc = send_all(sock, (const char*)msg, sizeof(MessageInfo));
+    pthread_mutex_unlock(&send_lock);
+    return rc == 0 ? (int)sizeof(MessageInfo) : SOCKET_ERROR;
 }
 
+/* Reads one frame, plain or packed (see common.h). */
 int receive_message(SOCKET sock, MessageInfo* msg) {
-    return recv(sock, (char*)msg, sizeof(MessageInfo), 0);
+    unsigned char header[WIRE_HEADER_SIZE];
+    unsigned char body[sizeof(MessageInfo)];
+    if (recv_all(sock, (char*)header, sizeof(header)) != 0) return 0;
+    int packed = wire_packed_length(header);
+    if (packed < 0) {
+        memcpy(msg, header, sizeof(header));
+        if (recv_all(sock, (char*)msg + sizeof(header), sizeof(MessageInfo) - sizeof(header)) != 0) return 0;
+        return (int)sizeof(MessageInfo);
+    }
+    if (recv_all(sock, (char*)body, (size_t)packed) != 0) return 0;
+    if (wire_unpack(header, body, (size_t)packed, msg) != 0) {
+        print_error("Corrupt compressed frame from server");
+        return 0;
+    }
+    return (int)sizeof(MessageInfo);
 }
 
 
@@ -65,39 +156,152 @@ int client_init(ClientState* client) {
     memset(client, 0, sizeof(ClientState));
     client->connected = 0;
     client->client_id = -1;
+    filter_reset(&client->filter, "");
 
-    if (initialize_network() != 0) {
-        print_error("Failed to initialize network");
+    if (pthread_mutex_init(&client->roster_mutex, NULL) != 0) {
+        print_error("Failed to initialize roster mutex");
+        return -1;
+    }
+    if (pthread_mutex_init(&client->latency_mutex, NULL) != 0) {
+        print_error("Failed to initialize latency mutex");
+        pthread_mutex_destroy(&client->roster_mutex);
         return -1;
     }
+    if (pthread_mutex_init(&client->file_mutex, NULL) != 0 || pthread_cond_init(&client->file_cond, NULL) != 0) {
+        print_error("Failed to initialize file transfer state");
+        pthread_mutex_destroy(&client->latency_mutex);
+        pthread_mutex_destroy(&client->roster_mutex);
+        return -1;
+    }
+    client->outgoing_id = -1;
 
-    client->socket = create_socket();
-    if (client->socket == INVALID_SOCKET) {
-        cleanup_network();
+    if (initialize_network() != 0) {
+        print_error("Failed to initialize network");
+        pthread_cond_destroy(&client->file_cond);
+        pthread_mutex_destroy(&client->file_mutex);
+        pthread_mutex_destroy(&client->latency_mutex);
+        pthread_mutex_destroy(&client->roster_mutex);
         return -1;
     }
 
+    /* created in client_connect, once the kind of address is known */
+    client->socket = INVALID_SOCKET;
     return 0;
 }
 
 void client_cleanup(ClientState* client) {
-    if (client->connected) {
-        client->connected = 0;
+    client->connected = 0;
+    if (client->receiving) {
+        /* wake the receiver so nothing touches the scrollback after it closes */
+        shutdown(client->socket, SHUTDOWN_BOTH);
         pthread_join(client->receive_thread, NULL);
+        client->receiving = 0;
     }
+    feed_close(client->feed);
+    client->feed = NULL;
 
-    CLOSE_SOCKET(client->socket);
+    if (client->socket != INVALID_SOCKET) CLOSE_SOCKET(client->socket);
     cleanup_network();
+    free(client->roster);
+    client->roster = NULL;
+    for (int i = 0; i < FILE_MAX_INCOMING; i++) {
+        if (client->incoming[i].fp) fclose(client->incoming[i].fp);
+    }
+    pthread_cond_destroy(&client->file_cond);
+    pthread_mutex_destroy(&client->file_mutex);
+    pthread_mutex_destroy(&client->latency_mutex);
+    pthread_mutex_destroy(&client->roster_mutex);
+    scrollback_close(client->scrollback);
+    client->scrollback = NULL;
 }
 
 int client_connect(ClientState* client, const char* ip, int port) {
+    client->socket = create_socket_for(ip);
+    if (client->socket == INVALID_SOCKET) return -1;
     if (connect_to_server(client->socket, ip, port) != 0) {
         return -1;
     }
+    safe_strcpy(client->server_ip, ip, sizeof(client->server_ip));
+    client->port = port;
     client->connected = 1;
     return 0;
 }
 
+static void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep((useconds_t)ms * 1000);
+#endif
+}
+
+/* Every frame the client sends carries its own nickname and id. */
+static void client_frame(ClientState* client, MessageInfo* msg, int type, const char* target, const char* text) {
+    msg_encode(msg, type, client->nickname, target, text);
+    msg->client_id = client->client_id;
+}
+
+static int send_filter(ClientState* client, SOCKET sock, int op, const char* nick, int mode) {
+    MessageInfo request;
+    client_frame(client, &request, MSG_TYPE_FILTER, nick, NULL);
+    request.count = op;
+    request.cursor = mode;
+    return send_message(sock, &request) == SOCKET_ERROR ? -1 : 0;
+}
+
+/* Filters live on the server connection, so a new one gets them again
+ * before it resumes and the history replay is filtered too. */
+static int resend_filters(ClientState* client, SOCKET sock) {
+    for (int i = 0; i < client->filter.ignored_count; i++) {
+        if (send_filter(client, sock, FILTER_OP_IGNORE, client->filter.ignored[i], 0) != 0) return -1;
+    }
+    if (client->filter.mode == DELIVER_ALL) return 0;
+    return send_filter(client, sock, FILTER_OP_MODE, NULL, client->filter.mode);
+}
+
+int client_resume(ClientState* client) {
+    int delay_ms = 250;
+    for (int attempt = 1; attempt <= RESUME_MAX_ATTEMPTS && client->connected; attempt++) {
+        int wait_ms = delay_ms / 2 + rand() % (delay_ms / 2 + 1);
+        /* a server that refused us said how long to stay away */
+        if (client->retry_after_ms > wait_ms) wait_ms = client->retry_after_ms + rand() % 1000;
+        client->retry_after_ms = 0;
+        sleep_ms(wait_ms);
+        delay_ms = delay_ms < 8000 ? delay_ms * 2 : 8000;
+        printf(GRAY "(reconnecting, attempt %d/%d)\n" RESET, attempt, RESUME_MAX_ATTEMPTS);
+
+        SOCKET sock = create_socket_for(client->server_ip);
+        if (sock == INVALID_SOCKET) continue;
+        if (connect_to_server(sock, client->server_ip, client->port) != 0) {
+            CLOSE_SOCKET(sock);
+            continue;
+        }
+
+        if (resend_filters(client, sock) != 0) {
+            CLOSE_SOCKET(sock);
+            continue;
+        }
+
+        MessageInfo resume;
+        client_frame(client, &resume, MSG_TYPE_RESUME, NULL, client->session_token);
+        resume.seq = client->last_seq;
+        resume.flags |= MSG_FLAG_COMPRESS;
+        resume.cursor = COMPRESS_DICT_VERSION;
+        if (send_message(sock, &resume) == SOCKET_ERROR) {
+            CLOSE_SOCKET(sock);
+            continue;
+        }
+
+        pthread_mutex_lock(&send_lock);
+        SOCKET old = client->socket;
+        client->socket = sock;
+        CLOSE_SOCKET(old);
+        pthread_mutex_unlock(&send_lock);
+        return 0;
+    }
+    return -1;
+}
+
 
 void get_nickname(ClientState* client) {
     printf("Enter your nickname: ");
@@ -113,11 +317,11 @@ void get_nickname(ClientState* client) {
 
 void send_join_message(ClientState* client) {
     MessageInfo join_msg;
-    memset(&join_msg, 0, sizeof(join_msg));
-    join_msg.type = MSG_TYPE_JOIN;
-    safe_strcpy(join_msg.nickname, client->nickname, sizeof(join_msg.nickname));
-    join_msg.timestamp = time(NULL);
-    join_msg.client_id = client->client_id;
+    client_frame(client, &join_msg, MSG_TYPE_JOIN, NULL, NULL);
+    scrollback_position(client->scrollback, &join_msg.length, &join_msg.seq);
+    /* the server packs frames for us only if it runs with --compress */
+    join_msg.flags |= MSG_FLAG_COMPRESS;
+    join_msg.cursor = COMPRESS_DICT_VERSION;
 
     if (send_message(client->socket, &join_msg) == SOCKET_ERROR) {
         print_error("Failed to send join message");
@@ -131,16 +335,22 @@ void send_chat_message(ClientState* client, const char* message) {
     }
 
     MessageInfo chat_msg;
-    memset(&chat_msg, 0, sizeof(chat_msg));
-    chat_msg.type = MSG_TYPE_CHAT;
-    safe_strcpy(chat_msg.nickname, client->nickname, sizeof(chat_msg.nickname));
-    safe_strcpy(chat_msg.message, message, sizeof(chat_msg.message));
-    chat_msg.timestamp = time(NULL);
-    chat_msg.client_id = client->client_id;
+    client_frame(client, &chat_msg, MSG_TYPE_CHAT, NULL, message);
 
     if (send_message(client->socket, &chat_msg) == SOCKET_ERROR) {
         print_error("Failed to send message");
+        return;
     }
+    scrollback_append(client->scrollback, &chat_msg);
+}
+
+/* Private lines are cached as "from x" / "to x" so /scroll shows which
+ * way they went. */
+static void remember_private(ClientState* client, const MessageInfo* msg, int outgoing) {
+    MessageInfo line = *msg;
+    snprintf(line.nickname, sizeof(line.nickname), "%s %.*s", outgoing ? "to" : "from", MAX_NICK_LEN - 6,
+             outgoing ? msg->target_nickname : msg->nickname);
+    scrollback_append(client->scrollback, &line);
 }
 
 void client_send_private_message(ClientState* client, const char* target, const char* message) {
@@ -150,13 +360,7 @@ void client_send_private_message(ClientState* client, const char* target, const
     }
 
     MessageInfo private_msg;
-    memset(&private_msg, 0, sizeof(private_msg));
-    private_msg.type = MSG_TYPE_PRIVATE;
-    safe_strcpy(private_msg.nickname, client->nickname, sizeof(private_msg.nickname));
-    safe_strcpy(private_msg.target_nickname, target, sizeof(private_msg.target_nickname));
-    safe_strcpy(private_msg.message, message, sizeof(private_msg.message));
-    private_msg.timestamp = time(NULL);
-    private_msg.client_id = client->client_id;
+    client_frame(client, &private_msg, MSG_TYPE_PRIVATE, target, message);
 
     if (send_message(client->socket, &private_msg) == SOCKET_ERROR) {
         print_error("Failed to send private message");
@@ -164,15 +368,12 @@ void client_send_private_message(ClientState* client, const char* target, const
     }
 
     printf(MAGENTA "[PRIVATE to %s]" RESET " %s\n", target, message);
+    remember_private(client, &private_msg, 1);
 }
 
 void send_leave_message(ClientState* client) {
     MessageInfo leave_msg;
-    memset(&leave_msg, 0, sizeof(leave_msg));
-    leave_msg.type = MSG_TYPE_LEAVE;
-    safe_strcpy(leave_msg.nickname, client->nickname, sizeof(leave_msg.nickname));
-    leave_msg.timestamp = time(NULL);
-    leave_msg.client_id = client->client_id;
+    client_frame(client, &leave_msg, MSG_TYPE_LEAVE, NULL, NULL);
 
     if (send_message(client->socket, &leave_msg) == SOCKET_ERROR) {
         print_error("Failed to send leave message");
@@ -204,18 +405,728 @@ int parse_nick_command(const char* input, char* new_nick, size_t capacity) {
 
 void request_nickname_change(ClientState* client, const char* new_nick) {
     MessageInfo request;
-    memset(&request, 0, sizeof(request));
-    request.type = MSG_TYPE_RENAME;
-    safe_strcpy(request.nickname, client->nickname, sizeof(request.nickname));
-    safe_strcpy(request.target_nickname, new_nick, sizeof(request.target_nickname));
-    request.timestamp = time(NULL);
-    request.client_id = client->client_id;
+    client_frame(client, &request, MSG_TYPE_RENAME, new_nick, NULL);
 
     if (send_message(client->socket, &request) == SOCKET_ERROR) {
         print_error("Failed to send rename request");
     }
 }
 
+void request_who(ClientState* client) {
+    MessageInfo request;
+    client_frame(client, &request, MSG_TYPE_WHO, NULL, NULL);
+    request.cursor = 0;
+    request.count = WHO_PAGE_DEFAULT;
+
+    if (send_message(client->socket, &request) == SOCKET_ERROR) {
+        print_error("Failed to send who request");
+    }
+}
+
+void request_search(ClientState* client, const char* query) {
+    MessageInfo request;
+    client_frame(client, &request, MSG_TYPE_SEARCH, NULL, query);
+
+    if (send_message(client->socket, &request) == SOCKET_ERROR) {
+        print_error("Failed to send search request");
+    }
+}
+
+/* The client keeps the same filter as the server: it is sent again after
+ * a reconnect, and applied here to room frames that come by multicast. */
+void client_ignore(ClientState* client, const char* nick, int ignore) {
+    if (ignore && filter_ignore(&client->filter, nick) < 0) {
+        print_error("Ignore list is full");
+        return;
+    }
+    if (!ignore) (void)filter_unignore(&client->filter, nick);
+    if (send_filter(client, client->socket, ignore ? FILTER_OP_IGNORE : FILTER_OP_UNIGNORE, nick, 0) != 0) {
+        print_error("Failed to send filter request");
+        return;
+    }
+    printf(GRAY "(%s '%s')\n" RESET, ignore ? "ignoring" : "no longer ignoring", nick);
+}
+
+void client_set_delivery(ClientState* client, int mode) {
+    static const char* const described[] = {"all room messages", "only messages that mention you", "no room messages"};
+    if (send_filter(client, client->socket, FILTER_OP_MODE, NULL, mode) != 0) {
+        print_error("Failed to send filter request");
+        return;
+    }
+    client->filter.mode = mode;
+    printf(GRAY "(receiving %s)\n" RESET, described[mode]);
+}
+
+static void print_ignored(const ClientState* client) {
+    if (client->filter.ignored_count == 0) {
+        print_system_message("You are not ignoring anyone");
+        return;
+    }
+    printf(CYAN "=== Ignored (%d) ===" RESET "\n", client->filter.ignored_count);
+    for (int i = 0; i < client->filter.ignored_count; i++) printf("%s\n", client->filter.ignored[i]);
+}
+
+static void print_search_result(const MessageInfo* msg, int* listing) {
+    if (msg->count == 0) {
+        print_system_message("No matching messages");
+        return;
+    }
+    if (!*listing) {
+        printf(CYAN "=== %d matching message%s ===" RESET "\n", msg->count, msg->count == 1 ? "" : "s");
+        *listing = 1;
+    }
+    char time_str[16];
+    struct tm* tm_info = localtime(&msg->timestamp);
+    strftime(time_str, sizeof(time_str), "%H:%M:%S", tm_info);
+    printf(GRAY "[%s]" RESET " " CYAN "%s" RESET ": %s\n", time_str, msg->nickname, msg->message);
+    if (msg->cursor < 0) *listing = 0;
+}
+
+static int local_roster_find(ClientState* client, const char* nick) {
+    for (int i = 0; i < client->roster_count; i++) {
+        if (strcmp(client->roster[i], nick) == 0) return i;
+    }
+    return -1;
+}
+
+static void local_roster_add(ClientState* client, const char* nick) {
+    if (local_roster_find(client, nick) >= 0) return;
+    if (client->roster_count == client->roster_capacity) {
+        int capacity = client->roster_capacity ? client->roster_capacity * 2 : 16;
+        char (*grown)[MAX_NICK_LEN] = realloc(client->roster, (size_t)capacity * sizeof(*grown));
+        if (!grown) return;
+        client->roster = grown;
+        client->roster_capacity = capacity;
+    }
+    safe_strcpy(client->roster[client->roster_count++], nick, MAX_NICK_LEN);
+}
+
+static void local_roster_remove(ClientState* client, const char* nick) {
+    int i = local_roster_find(client, nick);
+    if (i < 0) return;
+    client->roster_count--;
+    if (i != client->roster_count) memcpy(client->roster[i], client->roster[client->roster_count], MAX_NICK_LEN);
+}
+
+static void append_name(char* list, size_t cap, const char* text) {
+    size_t used = strlen(list);
+    snprintf(list + used, cap - used, "%s%s", used ? ", " : "", text);
+}
+
+static void apply_presence_delta(ClientState* client, const char* delta) {
+    char joined[MAX_MSG_LEN] = {0};
+    char left[MAX_MSG_LEN] = {0};
+    char renamed[MAX_MSG_LEN] = {0};
+    char line[2 * MAX_NICK_LEN + 4];
+
+    pthread_mutex_lock(&client->roster_mutex);
+    while (*delta) {
+        size_t len = strcspn(delta, "\n");
+        size_t copy = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+        memcpy(line, delta, copy);
+        line[copy] = '\0';
+        delta += len;
+        if (*delta == '\n') delta++;
+
+        if (line[0] == '+') {
+            local_roster_add(client, line + 1);
+            append_name(joined, sizeof(joined), line + 1);
+        } else if (line[0] == '-') {
+            local_roster_remove(client, line + 1);
+            append_name(left, sizeof(left), line + 1);
+        } else if (line[0] == '~') {
+            char* new_nick = strchr(line, ' ');
+            if (!new_nick) continue;
+            *new_nick++ = '\0';
+            local_roster_remove(client, line + 1);
+            local_roster_add(client, new_nick);
+            char pair[2 * MAX_NICK_LEN + 16];
+            snprintf(pair, sizeof(pair), "%s is now %s", line + 1, new_nick);
+            append_name(renamed, sizeof(renamed), pair);
+        }
+    }
+    pthread_mutex_unlock(&client->roster_mutex);
+
+    char summary[MAX_MSG_LEN] = {0};
+    if (joined[0]) snprintf(summary + strlen(summary), sizeof(summary) - strlen(summary), "%s joined", joined);
+    if (left[0]) snprintf(summary + strlen(summary), sizeof(summary) - strlen(summary), "%s%s left", summary[0] ? "; " : "", left);
+    if (renamed[0]) snprintf(summary + strlen(summary), sizeof(summary) - strlen(summary), "%s%s", summary[0] ? "; " : "", renamed);
+    if (summary[0]) print_system_message(summary);
+}
+
+static void print_local_roster(ClientState* client) {
+    pthread_mutex_lock(&client->roster_mutex);
+    printf(CYAN "=== Online users ===" RESET "\n");
+    for (int i = 0; i < client->roster_count; i++) {
+        printf("%s\n", client->roster[i]);
+    }
+    printf(GRAY "(%d online)" RESET "\n", client->roster_count);
+    pthread_mutex_unlock(&client->roster_mutex);
+}
+
+static void record_pong(ClientState* client, const MessageInfo* msg) {
+    uint64_t now = monotonic_ns();
+    pthread_mutex_lock(&client->latency_mutex);
+    int i = client->probes_received;
+    if (i < LATENCY_PROBES_MAX) {
+        client->probe_rtt[i] = now - msg->trace[TRACE_CLIENT_SEND];
+        client->probe_process[i] = msg->trace[TRACE_SERVER_ENQUEUE] - msg->trace[TRACE_SERVER_RECV];
+        client->probe_fanout[i] = msg->trace[TRACE_SERVER_FLUSH] - msg->trace[TRACE_SERVER_ENQUEUE];
+        client->probe_residence[i] = msg->trace[TRACE_SERVER_FLUSH] - msg->trace[TRACE_SERVER_RECV];
+        client->probes_received++;
+    }
+    pthread_mutex_unlock(&client->latency_mutex);
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t* samples, int n, double p) {
+    if (n == 0) return 0.0;
+    qsort(samples, (size_t)n, sizeof(uint64_t), compare_u64);
+    int rank = (int)(p * n);
+    if (rank >= n) rank = n - 1;
+    return samples[rank] / 1000.0;
+}
+
+static double mean_us(const uint64_t* samples, int n) {
+    if (n == 0) return 0.0;
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += (double)samples[i];
+    return sum / n / 1000.0;
+}
+
+/* Sends count pings and reports round trip percentiles plus the mean time
+ * spent in each hop. Server stamps come from the server's monotonic clock,
+ * so only differences between them are meaningful. */
+void run_latency_probe(ClientState* client, int count) {
+    if (count <= 0) count = LATENCY_PROBES_DEFAULT;
+    if (count > LATENCY_PROBES_MAX) count = LATENCY_PROBES_MAX;
+
+    pthread_mutex_lock(&client->latency_mutex);
+    client->probes_received = 0;
+    pthread_mutex_unlock(&client->latency_mutex);
+
+    for (int i = 0; i < count; i++) {
+        MessageInfo ping;
+        client_frame(client, &ping, MSG_TYPE_PING, NULL, NULL);
+        ping.cursor = i;
+        ping.flags = MSG_FLAG_TRACE;
+        ping.trace[TRACE_CLIENT_SEND] = monotonic_ns();
+        if (send_message(client->socket, &ping) == SOCKET_ERROR) {
+            print_error("Failed to send ping");
+            return;
+        }
+        sleep_ms(10);
+    }
+
+    int received = 0;
+    for (int waited = 0; waited < 2000; waited += 10) {
+        pthread_mutex_lock(&client->latency_mutex);
+        received = client->probes_received;
+        pthread_mutex_unlock(&client->latency_mutex);
+        if (received >= count) break;
+        sleep_ms(10);
+    }
+
+    pthread_mutex_lock(&client->latency_mutex);
+    int n = client->probes_received;
+    uint64_t network[LATENCY_PROBES_MAX];
+    for (int i = 0; i < n; i++) network[i] = client->probe_rtt[i] - client->probe_residence[i];
+    printf(CYAN "=== Latency (%d/%d replies, us) ===" RESET "\n", n, count);
+    printf("mean: network+client %.1f | server process %.1f | server fan-out %.1f | server total %.1f\n",
+           mean_us(network, n), mean_us(client->probe_process, n),
+           mean_us(client->probe_fanout, n), mean_us(client->probe_residence, n));
+    printf("rtt:  p50 %.1f | p90 %.1f | p99 %.1f | max %.1f\n",
+           percentile_us(client->probe_rtt, n, 0.50), percentile_us(client->probe_rtt, n, 0.90),
+           percentile_us(client->probe_rtt, n, 0.99), percentile_us(client->probe_rtt, n, 1.0));
+    if (client->render_frames) {
+        printf("render: %llu frames, mean %.1f, max %.1f\n", client->render_frames,
+               client->render_ns_total / 1000.0 / (double)client->render_frames, client->render_ns_max / 1000.0);
+    }
+    pthread_mutex_unlock(&client->latency_mutex);
+}
+
+
+typedef struct {
+    ClientState* client;
+    FILE* fp;
+    uint64_t size;
+    char name[FILE_NAME_MAX];
+} OutgoingFile;
+
+static const char* base_name(const char* path) {
+    const char* base = path;
+    for (const char* p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') base = p + 1;
+    }
+    return base;
+}
+
+static void finish_outgoing(ClientState* client) {
+    pthread_mutex_lock(&client->file_mutex);
+    client->outgoing_id = -1;
+    client->outgoing_credit = 0;
+    client->outgoing_failed = 0;
+    pthread_mutex_unlock(&client->file_mutex);
+}
+
+static int send_file_chunk(ClientState* client, int id, FILE* fp, uint64_t offset, uint32_t len) {
+    MessageInfo header;
+    client_frame(client, &header, MSG_TYPE_FILE_DATA, NULL, NULL);
+    header.cursor = id;
+    header.count = (int)len;
+    header.length = offset;
+
+    pthread_mutex_lock(&send_lock);
+    SOCKET sock = client->socket;
+#ifdef __linux__
+    off_t off = (off_t)offset;
+    int rc = send_all(sock, (const char*)&header, sizeof(header));
+    while (rc == 0 && len > 0) {
+        ssize_t n = sendfile(sock, fileno(fp), &off, len);
+        if (n <= 0) {
+            /* the header promised len bytes, the stream cannot recover */
+            shutdown(sock, SHUTDOWN_BOTH);
+            rc = -1;
+        } else {
+            len -= (uint32_t)n;
+        }
+    }
+#else
+    static char buf[FILE_CHUNK_SIZE];
+    int rc = (fseek(fp, (long)offset, SEEK_SET) == 0 && fread(buf, 1, len, fp) == len) ? 0 : -1;
+    if (rc == 0) rc = send_all(sock, (const char*)&header, sizeof(header));
+    if (rc == 0) rc = send_all(sock, buf, len);
+#endif
+    pthread_mutex_unlock(&send_lock);
+    return rc;
+}
+
+/* Streams the file as credit arrives: the server grants FILE_WINDOW_CHUNKS
+ * up front and one more for every chunk it has stored. */
+static void* file_sender_thread(void* arg) {
+    OutgoingFile* out = arg;
+    ClientState* client = out->client;
+    uint64_t offset = 0;
+    uint64_t started = monotonic_ns();
+    int id = 0;
+    int ok = 1;
+    int accepted = 0;
+    while (ok && offset < out->size) {
+        pthread_mutex_lock(&client->file_mutex);
+        while (client->connected && !client->outgoing_failed && (client->outgoing_id <= 0 || client->outgoing_credit == 0)) {
+            pthread_cond_wait(&client->file_cond, &client->file_mutex);
+        }
+        ok = client->connected && !client->outgoing_failed;
+        accepted = client->outgoing_id > 0;
+        if (ok) {
+            client->outgoing_credit--;
+            id = client->outgoing_id;
+        }
+        pthread_mutex_unlock(&client->file_mutex);
+        if (!ok) break;
+
+        uint64_t left = out->size - offset;
+        uint32_t len = left < FILE_CHUNK_SIZE ? (uint32_t)left : FILE_CHUNK_SIZE;
+        if (send_file_chunk(client, id, out->fp, offset, len) != 0) ok = 0;
+        else offset += len;
+    }
+
+    if (ok) {
+        MessageInfo end;
+        client_frame(client, &end, MSG_TYPE_FILE_END, NULL, NULL);
+        end.cursor = id;
+        end.length = out->size;
+        ok = send_message(client->socket, &end) != SOCKET_ERROR;
+    }
+    if (ok) {
+        double seconds = (monotonic_ns() - started) / 1e9;
+        printf(GREEN "Sent %s (%llu bytes) in %.2f s" RESET "\n", out->name, (unsigned long long)out->size, seconds);
+    } else if (accepted) {
+        print_error("File transfer stopped");
+    }
+    fclose(out->fp);
+    free(out);
+    finish_outgoing(client);
+    return NULL;
+}
+
+int send_file(ClientState* client, const char* target, const char* path) {
+    pthread_mutex_lock(&client->file_mutex);
+    int busy = client->outgoing_id != -1;
+    if (!busy) {
+        client->outgoing_id = 0;
+        client->outgoing_credit = 0;
+        client->outgoing_failed = 0;
+    }
+    pthread_mutex_unlock(&client->file_mutex);
+    if (busy) {
+        print_error("A file transfer is already in progress");
+        return -1;
+    }
+
+    FILE* fp = fopen(path, "rb");
+    long size = -1;
+    if (fp && fseek(fp, 0, SEEK_END) == 0) size = ftell(fp);
+    if (!fp || size <= 0 || (uint64_t)size > FILE_MAX_BYTES) {
+        print_error(fp ? "File is empty, unreadable or too large" : "Cannot open file");
+        if (fp) fclose(fp);
+        finish_outgoing(client);
+        return -1;
+    }
+    rewind(fp);
+
+    OutgoingFile* out = calloc(1, sizeof(OutgoingFile));
+    if (!out) {
+        fclose(fp);
+        finish_outgoing(client);
+        return -1;
+    }
+    out->client = client;
+    out->fp = fp;
+    out->size = (uint64_t)size;
+    safe_strcpy(out->name, base_name(path), sizeof(out->name));
+
+    MessageInfo offer;
+    client_frame(client, &offer, MSG_TYPE_FILE_OFFER, strcmp(target, "room") != 0 ? target : NULL, out->name);
+    offer.length = out->size;
+
+    pthread_t tid;
+    if (send_message(client->socket, &offer) == SOCKET_ERROR || pthread_create(&tid, NULL, file_sender_thread, out) != 0) {
+        print_error("Failed to start file transfer");
+        fclose(fp);
+        free(out);
+        finish_outgoing(client);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+static void handle_file_ack(ClientState* client, const MessageInfo* msg) {
+    pthread_mutex_lock(&client->file_mutex);
+    if (msg->cursor < 0 && client->outgoing_id == 0) {
+        print_error(msg->message);
+        client->outgoing_failed = 1;
+    } else if (msg->cursor > 0 && client->outgoing_id == 0 && msg->length == 0) {
+        client->outgoing_id = msg->cursor;
+        client->outgoing_credit += msg->count;
+        printf(GRAY "(sending %s)\n" RESET, msg->message);
+    } else if (msg->cursor > 0 && msg->cursor == client->outgoing_id && msg->count < 0) {
+        if (!client->outgoing_failed) print_error(msg->message); /* once, not per chunk in flight */
+        client->outgoing_failed = 1;
+    } else if (msg->cursor > 0 && msg->cursor == client->outgoing_id) {
+        client->outgoing_credit += msg->count;
+    }
+    pthread_cond_broadcast(&client->file_cond);
+    pthread_mutex_unlock(&client->file_mutex);
+}
+
+static IncomingFile* find_incoming(ClientState* client, int id) {
+    for (int i = 0; i < FILE_MAX_INCOMING; i++) {
+        if (client->incoming[i].fp && client->incoming[i].id == id) return &client->incoming[i];
+    }
+    return NULL;
+}
+
+/* Received files only ever land in FILE_DOWNLOAD_DIR, which must be a
+ * real directory, never a link somewhere else. */
+static int ensure_download_dir(void) {
+#ifdef _WIN32
+    if (_mkdir(FILE_DOWNLOAD_DIR) != 0 && errno != EEXIST) return -1;
+    struct _stat st;
+    return _stat(FILE_DOWNLOAD_DIR, &st) == 0 && (st.st_mode & _S_IFDIR) ? 0 : -1;
+#else
+    if (mkdir(FILE_DOWNLOAD_DIR, 0700) != 0 && errno != EEXIST) return -1;
+    struct stat st;
+    return lstat(FILE_DOWNLOAD_DIR, &st) == 0 && S_ISDIR(st.st_mode) ? 0 : -1;
+#endif
+}
+
+/* Creates a new file readable only by us; never opens, truncates or
+ * follows anything that is already there. */
+static FILE* create_download(const char* path) {
+#ifdef _WIN32
+    int fd = _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+    if (fd < 0) return NULL;
+    FILE* fp = _fdopen(fd, "wb");
+    if (!fp) _close(fd);
+#else
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) return NULL;
+    FILE* fp = fdopen(fd, "wb");
+    if (!fp) close(fd);
+#endif
+    return fp;
+}
+
+/* Offers are only saved after /receive; otherwise their chunks are drained
+ * like those of any skipped file. */
+static void handle_file_offer(ClientState* client, const MessageInfo* msg) {
+    IncomingFile* in = NULL;
+    for (int i = 0; i < FILE_MAX_INCOMING && !in; i++) {
+        if (!client->incoming[i].fp) in = &client->incoming[i];
+    }
+    printf(MAGENTA "%s is sending %s%s (%llu bytes)" RESET "\n", msg->nickname, msg->message,
+           msg->target_nickname[0] ? " to you" : "", (unsigned long long)msg->length);
+    if (!client->accept_files) {
+        printf(GRAY "(not saved; type /receive to accept incoming files)\n" RESET);
+        return;
+    }
+    if (!in) {
+        print_error("Too many incoming files, this one will be skipped");
+        return;
+    }
+    const char* name = base_name(msg->message);
+    if (!name[0] || name[0] == '.') {
+        print_error("Refusing a file name that is empty or starts with '.', it will be skipped");
+        return;
+    }
+    if (ensure_download_dir() != 0) {
+        print_error("Cannot create the " FILE_DOWNLOAD_DIR " directory, the file will be skipped");
+        return;
+    }
+    for (int n = 0; n < 100 && !in->fp; n++) {
+        if (n == 0) snprintf(in->path, sizeof(in->path), FILE_DOWNLOAD_DIR "/%s", name);
+        else snprintf(in->path, sizeof(in->path), FILE_DOWNLOAD_DIR "/%s.%d", name, n);
+        in->fp = create_download(in->path);
+        if (!in->fp && errno != EEXIST) break;
+    }
+    if (!in->fp) {
+        print_error("Cannot create file for incoming transfer, it will be skipped");
+        return;
+    }
+    in->id = msg->cursor;
+    in->size = msg->length;
+    in->received = 0;
+    safe_strcpy(in->from, msg->nickname, sizeof(in->from));
+}
+
+/* Reads the raw payload that follows a FILE_DATA header and grants the
+ * server credit for one more chunk. Chunks for skipped files are drained
+ * and acknowledged all the same so the sender is never held up. */
+static int handle_file_data(ClientState* client, const MessageInfo* msg) {
+    static char buf[FILE_CHUNK_SIZE];
+    if (msg->count <= 0 || msg->count > FILE_CHUNK_SIZE) return -1;
+    if (recv_all(client->socket, buf, (size_t)msg->count) != 0) return -1;
+    IncomingFile* in = find_incoming(client, msg->cursor);
+    if (in && fwrite(buf, 1, (size_t)msg->count, in->fp) == (size_t)msg->count) in->received += (uint64_t)msg->count;
+
+    MessageInfo ack;
+    client_frame(client, &ack, MSG_TYPE_FILE_ACK, NULL, NULL);
+    ack.cursor = msg->cursor;
+    ack.count = 1;
+    (void)send_message(client->socket, &ack);
+    return 0;
+}
+
+static void handle_file_end(ClientState* client, const MessageInfo* msg) {
+    IncomingFile* in = find_incoming(client, msg->cursor);
+    if (!in) return;
+    fclose(in->fp);
+    in->fp = NULL;
+    if (msg->count == 0 && in->received == in->size) {
+        printf(GREEN "Received %llu bytes from %s, saved as %s" RESET "\n", (unsigned long long)in->size, in->from, in->path);
+    } else {
+        remove(in->path);
+        printf(RED "Transfer of %s from %s was interrupted" RESET "\n", in->path, in->from);
+    }
+}
+
+/* After a reconnect the server has forgotten our transfers on the old
+ * connection, so partial downloads are dropped and the upload stops. */
+static void abort_file_transfers(ClientState* client) {
+    for (int i = 0; i < FILE_MAX_INCOMING; i++) {
+        IncomingFile* in = &client->incoming[i];
+        if (!in->fp) continue;
+        fclose(in->fp);
+        in->fp = NULL;
+        remove(in->path);
+        printf(RED "Transfer of %s from %s was interrupted" RESET "\n", in->path, in->from);
+    }
+    pthread_mutex_lock(&client->file_mutex);
+    if (client->outgoing_id != -1) client->outgoing_failed = 1;
+    pthread_cond_broadcast(&client->file_cond);
+    pthread_mutex_unlock(&client->file_mutex);
+}
+
+
+/* Shows a chat, system or presence frame and records it locally. With
+ * multicast the feed calls this, in seq order. */
+void client_show_room_frame(ClientState* client, const MessageInfo* msg) {
+    /* the resume position, like the cached one, moves only on room frames */
+    if (msg->seq > client->last_seq) client->last_seq = msg->seq;
+    scrollback_seen(client->scrollback, msg);
+    if (msg->type == MSG_TYPE_PRESENCE) {
+        apply_presence_delta(client, msg->message);
+        return;
+    }
+    /* our own chat was shown when sent; the group sends it back */
+    if (msg->type == MSG_TYPE_CHAT && msg->client_id == client->client_id) return;
+    /* the server filters unicast; multicast frames are filtered here */
+    if (filter_check(&client->filter, msg, filter_key(msg->nickname)) != FILTER_PASS) return;
+    if (msg->type != MSG_TYPE_CHAT || strcmp(msg->nickname, client->nickname) != 0) {
+        /* a replay of our own chat from an earlier connection is already stored */
+        scrollback_append(client->scrollback, msg);
+    }
+    if (msg->type == MSG_TYPE_CHAT) print_message(msg->nickname, msg->message);
+    else print_system_message(msg->message);
+}
+
+int send_multicast_request(ClientState* client, int op, uint64_t seq, int count) {
+    MessageInfo request;
+    client_frame(client, &request, MSG_TYPE_MULTICAST, NULL, NULL);
+    request.cursor = op;
+    request.seq = seq;
+    request.count = count;
+    return send_message(client->socket, &request) == SOCKET_ERROR ? -1 : 0;
+}
+
+static void handle_multicast(ClientState* client, const MessageInfo* msg) {
+    switch (msg->cursor) {
+        case MCAST_OFFER:
+            if (client->feed) {
+                feed_resubscribe(client->feed);
+                break;
+            }
+            client->feed = feed_open(client, msg);
+            if (client->feed) printf(GRAY "(room messages now arrive from multicast group %s:%d)\n" RESET, msg->message, msg->count);
+            else print_error("Could not join the multicast group, room messages stay on TCP");
+            break;
+        case MCAST_SUBSCRIBED:
+            if (client->feed) feed_subscribed(client->feed, msg->seq);
+            break;
+        case MCAST_LOST:
+            if (client->feed) feed_lost(client->feed, msg->seq, msg->count);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Frame handlers return 1 when they put something on screen, so the render
+ * time is counted, and 0 for frames that only feed protocol state. */
+typedef int (*frame_handler_t)(ClientState* client, MessageInfo* msg);
+
+static int on_room_frame(ClientState* client, MessageInfo* msg) {
+    if (msg->type == MSG_TYPE_SYSTEM && (msg->flags & MSG_FLAG_RETRY)) {
+        /* turned away; the server closes the connection next */
+        print_error(msg->message);
+        client->retry_after_ms = msg->count > 0 && msg->count <= 300 ? msg->count * 1000 : 0;
+        return 1;
+    }
+    client_show_room_frame(client, msg);
+    return 1;
+}
+
+static int on_private(ClientState* client, MessageInfo* msg) {
+    (void)client;
+    printf(MAGENTA "[PRIVATE from %s]" RESET " %s\n", msg->nickname, msg->message);
+    return 1;
+}
+
+static int on_nickname_taken(ClientState* client, MessageInfo* msg) {
+    (void)client;
+    print_error(msg->message);
+    printf("Try a different nickname using " BOLD_CYAN "/nick <new_nick>" RESET "\n");
+    return 1;
+}
+
+static int on_nickname_available(ClientState* client, MessageInfo* msg) {
+    (void)client;
+    print_success(msg->message);
+    return 1;
+}
+
+static int on_who_response(ClientState* client, MessageInfo* msg) {
+    pthread_mutex_lock(&client->roster_mutex);
+    if (!client->who_listing) {
+        client->roster_count = 0;
+        client->who_listing = 1;
+    }
+    for (char* name = strtok(msg->message, "\n"); name; name = strtok(NULL, "\n")) {
+        local_roster_add(client, name);
+    }
+    if (msg->cursor < 0) client->who_listing = 0;
+    pthread_mutex_unlock(&client->roster_mutex);
+    return 1;
+}
+
+static int on_search_result(ClientState* client, MessageInfo* msg) {
+    print_search_result(msg, &client->search_listing);
+    return 1;
+}
+
+static int on_session(ClientState* client, MessageInfo* msg) {
+    if (client->session_token[0]) print_success("Session resumed");
+    safe_strcpy(client->session_token, msg->message, sizeof(client->session_token));
+    scrollback_set_epoch(client->scrollback, msg->length);
+    safe_strcpy(client->nickname, msg->target_nickname, sizeof(client->nickname));
+    filter_set_nickname(&client->filter, client->nickname);
+    client->client_id = msg->client_id;
+    return 1;
+}
+
+static int on_multicast(ClientState* client, MessageInfo* msg) {
+    handle_multicast(client, msg);
+    return 1;
+}
+
+static int on_resume_failed(ClientState* client, MessageInfo* msg) {
+    print_error(msg->message);
+    client->session_token[0] = '\0';
+    send_join_message(client);
+    request_who(client);
+    return 1;
+}
+
+static int on_pong(ClientState* client, MessageInfo* msg) {
+    record_pong(client, msg);
+    return 0;
+}
+
+static int on_file_offer(ClientState* client, MessageInfo* msg) {
+    handle_file_offer(client, msg);
+    return 1;
+}
+
+static int on_file_data(ClientState* client, MessageInfo* msg) {
+    if (handle_file_data(client, msg) != 0) shutdown(client->socket, SHUTDOWN_BOTH);
+    return 0;
+}
+
+static int on_file_ack(ClientState* client, MessageInfo* msg) {
+    handle_file_ack(client, msg);
+    return 0;
+}
+
+static int on_file_end(ClientState* client, MessageInfo* msg) {
+    handle_file_end(client, msg);
+    return 1;
+}
+
+/* One entry per type the server may send (see MSG_TYPES). */
+static const frame_handler_t frame_handlers[MSG_TYPE_COUNT] = {
+    [MSG_TYPE_CHAT] = on_room_frame,
+    [MSG_TYPE_SYSTEM] = on_room_frame,
+    [MSG_TYPE_PRESENCE] = on_room_frame,
+    [MSG_TYPE_PRIVATE] = on_private,
+    [MSG_TYPE_NICKNAME_TAKEN] = on_nickname_taken,
+    [MSG_TYPE_NICKNAME_AVAILABLE] = on_nickname_available,
+    [MSG_TYPE_WHO_RESPONSE] = on_who_response,
+    [MSG_TYPE_SEARCH_RESULT] = on_search_result,
+    [MSG_TYPE_SESSION] = on_session,
+    [MSG_TYPE_MULTICAST] = on_multicast,
+    [MSG_TYPE_RESUME_FAILED] = on_resume_failed,
+    [MSG_TYPE_PONG] = on_pong,
+    [MSG_TYPE_FILE_OFFER] = on_file_offer,
+    [MSG_TYPE_FILE_DATA] = on_file_data,
+    [MSG_TYPE_FILE_ACK] = on_file_ack,
+    [MSG_TYPE_FILE_END] = on_file_end,
+};
 
 void* receive_messages(void* arg) {
     ClientState* client = arg;
@@ -224,39 +1135,37 @@ void* receive_messages(void* arg) {
     while (client->connected) {
         int bytes_received = receive_message(client->socket, &msg);
         if (bytes_received <= 0) {
+            if (client->connected && client->session_token[0]) {
+                print_error("Connection lost, trying to resume session");
+                if (client_resume(client) == 0) {
+                    abort_file_transfers(client);
+                    continue;
+                }
+            }
             if (client->connected) {
                 print_error("Connection lost");
                 client->connected = 0;
             }
+            abort_file_transfers(client);
             break;
         }
-
-        switch (msg.type) {
-            case MSG_TYPE_CHAT:
-                print_message(msg.nickname, msg.message);
-                break;
-
-            case MSG_TYPE_SYSTEM:
-                print_system_message(msg.message);
-                break;
-
-            case MSG_TYPE_PRIVATE:
-                printf(MAGENTA "[PRIVATE from %s]" RESET " %s\n", msg.nickname, msg.message);
-                break;
-
-            case MSG_TYPE_NICKNAME_TAKEN:
-                print_error(msg.message);
-                printf("Try a different nickname using " BOLD_CYAN "/nick <new_nick>" RESET "\n");
-                break;
-
-            case MSG_TYPE_NICKNAME_AVAILABLE:
-                print_success(msg.message);
-                break;
-
-            default:
-                print_error("Unknown message type received");
-                break;
+        frame_handler_t handler = msg_decode(&msg, MSG_FROM_SERVER) == 0 ? frame_handlers[msg.type] : NULL;
+        if (!handler) {
+            print_error("Unknown message type received");
+            continue;
         }
+        /* with multicast, the feed shows room frames in seq order */
+        if (feed_frame(client->feed, &msg, 0)) continue;
+        if (msg.type == MSG_TYPE_PRIVATE) remember_private(client, &msg, 0);
+        uint64_t render_start = monotonic_ns();
+        if (!handler(client, &msg)) continue;
+
+        uint64_t render_ns = monotonic_ns() - render_start;
+        pthread_mutex_lock(&client->latency_mutex);
+        client->render_frames++;
+        client->render_ns_total += render_ns;
+        if (render_ns > client->render_ns_max) client->render_ns_max = render_ns;
+        pthread_mutex_unlock(&client->latency_mutex);
     }
 
     pthread_exit(NULL);
@@ -286,7 +1195,7 @@ int parse_private_message(const char* input, char* target, char* message) {
 
 
 int main(int argc, char* argv[]) {
-    char server_ip[16] = SERVER_IP;
+    char server_ip[LOCAL_PATH_MAX + 8] = SERVER_IP;
     int port = DEFAULT_PORT;
     ClientState client;
 
@@ -294,23 +1203,32 @@ int main(int argc, char* argv[]) {
     if (argc > 2) { port = atoi(argv[2]); }
 
     print_system_message("Starting chat client...");
-    printf("Server: " BOLD_CYAN "%s:%d" RESET "\n", server_ip, port);
+    if (is_local_address(server_ip)) {
+        printf("Server: " BOLD_CYAN "%s" RESET "\n", server_ip);
+    } else {
+        printf("Server: " BOLD_CYAN "%s:%d" RESET "\n", server_ip, port);
+    }
 
     if (client_init(&client) != 0) return 1;
+    srand((unsigned)time(NULL) ^ (unsigned)clock());
 
     if (client_connect(&client, server_ip, port) != 0) {
         client_cleanup(&client);
         return 1;
     }
+    client.scrollback = scrollback_open(server_ip, port);
+    if (!client.scrollback) print_error("Local history is unavailable (is another client for this server running?)");
 
     get_nickname(&client);
     send_join_message(&client);
+    request_who(&client);
 
     if (pthread_create(&client.receive_thread, NULL, receive_messages, &client) != 0) {
         print_error("Failed to create receive thread");
         client_cleanup(&client);
         return 1;
     }
+    client.receiving = 1;
 
     print_success("Connected to server");
 #ifdef _WIN32
@@ -333,9 +1251,47 @@ int main(int argc, char* argv[]) {
                 print_client_help();
             } else if (strcmp(input, "/quit") == 0) {
                 print_system_message("Leaving chat...");
+                client.connected = 0; /* before the server hangs up, so it is not taken for a drop */
                 send_leave_message(&client);
-                client.connected = 0;
                 break;
+            } else if (strncmp(input, "/latency", 8) == 0 && (input[8] == '\0' || input[8] == ' ')) {
+                run_latency_probe(&client, atoi(input + 8));
+            } else if (strcmp(input, "/who") == 0) {
+                print_local_roster(&client);
+            } else if (strncmp(input, "/scroll", 7) == 0 && (input[7] == '\0' || input[7] == ' ')) {
+                scrollback_scroll(client.scrollback, atoi(input + 7));
+            } else if (strncmp(input, "/grep ", 6) == 0 && input[6] != '\0') {
+                scrollback_grep(client.scrollback, input + 6);
+            } else if (strcmp(input, "/ignore") == 0) {
+                print_ignored(&client);
+            } else if (strncmp(input, "/ignore ", 8) == 0 || strncmp(input, "/unignore ", 10) == 0) {
+                char target[MAX_NICK_LEN];
+                int ignore = input[1] == 'i';
+                if (sscanf(input + (ignore ? 8 : 10), "%31s", target) == 1) {
+                    client_ignore(&client, target, ignore);
+                } else {
+                    print_error(ignore ? "Usage: /ignore <nick>" : "Usage: /unignore <nick>");
+                }
+            } else if (strcmp(input, "/multicast") == 0) {
+                feed_print_stats(client.feed);
+            } else if (strcmp(input, "/mute") == 0) {
+                client_set_delivery(&client, client.filter.mode == DELIVER_MUTED ? DELIVER_ALL : DELIVER_MUTED);
+            } else if (strcmp(input, "/receive") == 0) {
+                client.accept_files = !client.accept_files;
+                print_system_message(client.accept_files ? "Incoming files are saved in " FILE_DOWNLOAD_DIR
+                                                         : "Incoming files are no longer saved");
+            } else if (strcmp(input, "/mentions") == 0) {
+                client_set_delivery(&client, client.filter.mode == DELIVER_MENTIONS ? DELIVER_ALL : DELIVER_MENTIONS);
+            } else if (strncmp(input, "/search ", 8) == 0 && input[8] != '\0') {
+                request_search(&client, input + 8);
+            } else if (strncmp(input, "/send ", 6) == 0) {
+                char target[MAX_NICK_LEN];
+                char path[MAX_MSG_LEN];
+                if (sscanf(input + 6, "%31s %1023[^\n]", target, path) == 2) {
+                    send_file(&client, target, path);
+                } else {
+                    print_error("Usage: /send <nick|room> <file>");
+                }
             } else if (strncmp(input, "/nick", 5) == 0) {
                 char new_nick[MAX_NICK_LEN];
                 if (parse_nick_command(input, new_nick, sizeof(new_nick)) == 0) {
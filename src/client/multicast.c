@@ -0,0 +1,266 @@
+#include "../../include/common.h"
+
+/*
+ * Receiving side of multicast room fan-out. Room frames reach the client
+ * from two places: datagrams from the group, read by the feed thread, and
+ * TCP (history replay and NACK repairs). Both go through feed_frame, which
+ * shows them strictly in seq order. Frames ahead of a gap wait in a
+ * reorder ring of MULTICAST_REORDER_SLOTS; the gap is asked for with a
+ * NACK at once, and again every MULTICAST_NACK_MS while it stays open.
+ *
+ * Until the server confirms the subscription, TCP frames are shown as they
+ * arrive and datagrams are only parked: the confirmation's seq says which
+ * of them TCP already covered.
+ *
+ * Anyone on the LAN can send to the group, so datagrams are only taken
+ * from the host the TCP connection goes to.
+ */
+
+struct MulticastFeed {
+    ClientState* client;
+    SOCKET sock;
+    struct in_addr server;
+    struct in_addr local_source;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int running;
+    int subscribed;
+    uint64_t next;
+    uint64_t highest;
+    uint64_t nack_upto;
+    uint64_t nack_ns;
+    MessageInfo* slots;
+    uint64_t* slot_seq;
+    unsigned long long datagrams;
+    unsigned long long duplicates;
+    unsigned long long reordered;
+    unsigned long long nacks;
+    unsigned long long lost;
+    unsigned long long foreign;
+};
+
+static int is_room_frame(const MessageInfo* msg) {
+    return msg->seq > 0 && (msg->type == MSG_TYPE_CHAT || msg->type == MSG_TYPE_SYSTEM || msg->type == MSG_TYPE_PRESENCE);
+}
+
+/* Called with feed->mutex held. */
+static void deliver_ready(MulticastFeed* feed) {
+    for (;;) {
+        int slot = (int)(feed->next % MULTICAST_REORDER_SLOTS);
+        if (feed->slot_seq[slot] != feed->next) break;
+        feed->slot_seq[slot] = 0;
+        client_show_room_frame(feed->client, &feed->slots[slot]);
+        feed->next++;
+    }
+}
+
+/* Called with feed->mutex held. Asks for the frames between the next one
+ * due and the first one already parked, unless the last request still
+ * covers the next one and has not timed out. */
+static void request_gap(MulticastFeed* feed) {
+    if (!feed->subscribed || feed->highest < feed->next) return;
+    uint64_t now = monotonic_ns();
+    if (feed->next < feed->nack_upto && now - feed->nack_ns < (uint64_t)MULTICAST_NACK_MS * 1000000ULL) return;
+    uint64_t end = feed->next + 1;
+    while (end <= feed->highest && end - feed->next < MULTICAST_NACK_MAX &&
+           feed->slot_seq[end % MULTICAST_REORDER_SLOTS] != end) {
+        end++;
+    }
+    feed->nack_upto = end;
+    feed->nack_ns = now;
+    feed->nacks++;
+    (void)send_multicast_request(feed->client, MCAST_NACK, feed->next, (int)(end - feed->next));
+}
+
+/* Called with feed->mutex held. */
+static void park(MulticastFeed* feed, const MessageInfo* msg) {
+    int slot = (int)(msg->seq % MULTICAST_REORDER_SLOTS);
+    uint64_t held = feed->slot_seq[slot];
+    /* two live seqs in one slot: the later one is past the window and will
+     * come back through a NACK */
+    if (held >= feed->next && held < msg->seq) return;
+    feed->slots[slot] = *msg;
+    feed->slot_seq[slot] = msg->seq;
+    if (msg->seq > feed->highest) feed->highest = msg->seq;
+}
+
+/* A server reached over loopback sends from whichever of this host's
+ * addresses the group is routed through; any address that binds here is
+ * then the server's. */
+static int from_server(MulticastFeed* feed, const struct sockaddr_in* from) {
+    if (from->sin_family != AF_INET) return 0;
+    if (from->sin_addr.s_addr == feed->server.s_addr) return 1;
+    if ((ntohl(feed->server.s_addr) >> 24) != 127) return 0;
+    if (from->sin_addr.s_addr == feed->local_source.s_addr) return 1;
+    struct sockaddr_in probe_addr = *from;
+    probe_addr.sin_port = 0;
+    SOCKET probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe == INVALID_SOCKET) return 0;
+    int local = bind(probe, (struct sockaddr*)&probe_addr, sizeof(probe_addr)) == 0;
+    CLOSE_SOCKET(probe);
+    if (local) feed->local_source = from->sin_addr;
+    return local;
+}
+
+static void* feed_thread(void* arg) {
+    MulticastFeed* feed = arg;
+    MessageInfo msg;
+    while (feed->running) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(feed->sock, &readable);
+        struct timeval tv = {0, MULTICAST_NACK_MS * 1000};
+        int ready = select((int)feed->sock + 1, &readable, NULL, NULL, &tv);
+        if (ready < 0) break;
+        if (ready > 0) {
+            struct sockaddr_in from;
+            socklen_t from_len = (socklen_t)sizeof(from);
+            int n = recvfrom(feed->sock, (char*)&msg, sizeof(msg), 0, (struct sockaddr*)&from, &from_len);
+            if (n <= 0) break;
+            int ours = from_server(feed, &from);
+            pthread_mutex_lock(&feed->mutex);
+            if (ours) feed->datagrams++;
+            else feed->foreign++;
+            pthread_mutex_unlock(&feed->mutex);
+            if (!ours) continue;
+            if (n == (int)sizeof(msg) && msg_decode(&msg, MSG_FROM_SERVER) == 0 && is_room_frame(&msg)) (void)feed_frame(feed, &msg, 1);
+            continue;
+        }
+        pthread_mutex_lock(&feed->mutex);
+        request_gap(feed);
+        pthread_mutex_unlock(&feed->mutex);
+    }
+    return NULL;
+}
+
+/* Joins the group from an MCAST_OFFER on the interface the TCP connection
+ * uses, then subscribes. Returns NULL if the group can't be joined; the
+ * client then stays on unicast. */
+MulticastFeed* feed_open(ClientState* client, const MessageInfo* offer) {
+    struct ip_mreq mreq;
+    struct sockaddr_in local, peer;
+    socklen_t local_len = (socklen_t)sizeof(local), peer_len = (socklen_t)sizeof(peer);
+    memset(&mreq, 0, sizeof(mreq));
+    if (inet_pton(AF_INET, offer->message, &mreq.imr_multiaddr) <= 0 || offer->count <= 0 || offer->count > 65535) return NULL;
+    if (getsockname(client->socket, (struct sockaddr*)&local, &local_len) != 0 || local.sin_family != AF_INET) return NULL;
+    if (getpeername(client->socket, (struct sockaddr*)&peer, &peer_len) != 0 || peer.sin_family != AF_INET) return NULL;
+    mreq.imr_interface = local.sin_addr;
+
+    MulticastFeed* feed = calloc(1, sizeof(MulticastFeed));
+    if (!feed) return NULL;
+    feed->client = client;
+    feed->server = peer.sin_addr;
+    feed->slots = malloc(MULTICAST_REORDER_SLOTS * sizeof(MessageInfo));
+    feed->slot_seq = calloc(MULTICAST_REORDER_SLOTS, sizeof(uint64_t));
+    if (!feed->slots || !feed->slot_seq) goto fail_alloc;
+    feed->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (feed->sock == INVALID_SOCKET) goto fail_alloc;
+    int opt = 1;
+    (void)setsockopt(feed->sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+    struct sockaddr_in bind_addr;
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    bind_addr.sin_family = AF_INET;
+    bind_addr.sin_addr.s_addr = INADDR_ANY;
+    bind_addr.sin_port = htons((unsigned short)offer->count);
+    if (bind(feed->sock, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) != 0) goto fail_socket;
+    if (setsockopt(feed->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(mreq)) != 0) goto fail_socket;
+    if (pthread_mutex_init(&feed->mutex, NULL) != 0) goto fail_socket;
+    feed->running = 1;
+    if (pthread_create(&feed->thread, NULL, feed_thread, feed) != 0) goto fail_mutex;
+    feed_resubscribe(feed);
+    return feed;
+fail_mutex:
+    pthread_mutex_destroy(&feed->mutex);
+fail_socket:
+    CLOSE_SOCKET(feed->sock);
+fail_alloc:
+    free(feed->slot_seq);
+    free(feed->slots);
+    free(feed);
+    return NULL;
+}
+
+void feed_close(MulticastFeed* feed) {
+    if (!feed) return;
+    feed->running = 0;
+    pthread_join(feed->thread, NULL);
+    CLOSE_SOCKET(feed->sock);
+    pthread_mutex_destroy(&feed->mutex);
+    free(feed->slot_seq);
+    free(feed->slots);
+    free(feed);
+}
+
+/* A new connection starts on unicast; parked datagrams are kept, since
+ * the next confirmation tells which of them are still needed. */
+void feed_resubscribe(MulticastFeed* feed) {
+    pthread_mutex_lock(&feed->mutex);
+    feed->subscribed = 0;
+    pthread_mutex_unlock(&feed->mutex);
+    (void)send_multicast_request(feed->client, MCAST_SUBSCRIBE, 0, 0);
+}
+
+void feed_subscribed(MulticastFeed* feed, uint64_t base) {
+    pthread_mutex_lock(&feed->mutex);
+    feed->subscribed = 1;
+    feed->next = base + 1;
+    if (feed->highest < base) feed->highest = base;
+    feed->nack_upto = 0;
+    deliver_ready(feed);
+    request_gap(feed);
+    pthread_mutex_unlock(&feed->mutex);
+}
+
+/* Returns 1 if the frame was taken into the sequence (shown now, parked
+ * or dropped as a duplicate), 0 if the caller should show it directly. */
+int feed_frame(MulticastFeed* feed, const MessageInfo* msg, int from_group) {
+    if (!feed || !is_room_frame(msg)) return 0;
+    pthread_mutex_lock(&feed->mutex);
+    if (!feed->subscribed) {
+        if (from_group) park(feed, msg);
+        pthread_mutex_unlock(&feed->mutex);
+        return from_group;
+    }
+    if (msg->seq < feed->next) {
+        feed->duplicates++;
+    } else if (msg->seq == feed->next) {
+        client_show_room_frame(feed->client, msg);
+        feed->next++;
+        deliver_ready(feed);
+        request_gap(feed);
+    } else {
+        feed->reordered++;
+        park(feed, msg);
+        request_gap(feed);
+    }
+    pthread_mutex_unlock(&feed->mutex);
+    return 1;
+}
+
+/* The server no longer has frames up to through; skip past them. */
+void feed_lost(MulticastFeed* feed, uint64_t through, int count) {
+    pthread_mutex_lock(&feed->mutex);
+    if (feed->subscribed && through >= feed->next) {
+        printf(GRAY "(%d room messages were lost)\n" RESET, count);
+        feed->lost += through - feed->next + 1;
+        feed->next = through + 1;
+        deliver_ready(feed);
+        request_gap(feed);
+    }
+    pthread_mutex_unlock(&feed->mutex);
+}
+
+void feed_print_stats(MulticastFeed* feed) {
+    if (!feed) {
+        print_system_message("Room messages arrive over TCP");
+        return;
+    }
+    pthread_mutex_lock(&feed->mutex);
+    printf(CYAN "=== Multicast feed ===" RESET "\n");
+    printf("%s, next seq %llu\n", feed->subscribed ? "subscribed" : "waiting for the server",
+           (unsigned long long)feed->next);
+    printf("datagrams %llu, duplicates %llu, out of order %llu, NACKs sent %llu, lost %llu\n", feed->datagrams,
+           feed->duplicates, feed->reordered, feed->nacks, feed->lost);
+    if (feed->foreign) printf("ignored %llu datagrams from other hosts\n", feed->foreign);
+    pthread_mutex_unlock(&feed->mutex);
+}
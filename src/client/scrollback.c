@@ -0,0 +1,301 @@
+#include "../../include/common.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+ * Local scrollback. Every line the client shows is appended to a
+ * memory-mapped ring file, one per server, so /scroll and /grep work after
+ * text has left the terminal and across restarts. The file is a header, a
+ * fixed index of SCROLLBACK_INDEX_SLOTS entries (sequence, timestamp, kind
+ * and where the text lives) and a SCROLLBACK_DATA_SIZE byte ring holding
+ * nickname and text. Entries are dropped oldest first when either fills.
+ *
+ * The header also remembers the newest room sequence number stored and the
+ * history epoch of the server it came from, so a fresh start can ask the
+ * server for just the frames it missed.
+ */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t index_slots;
+    uint64_t data_size;
+    uint64_t epoch;
+    uint64_t last_seq;
+    uint64_t first;     /* number of the oldest entry still stored */
+    uint64_t next;      /* number the next entry gets */
+    uint64_t data_head; /* ring position of the next record, never wraps */
+} ScrollbackHeader;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t pos;
+    int64_t timestamp;
+    uint16_t nick_len;
+    uint16_t text_len;
+    int32_t type;
+} ScrollbackEntry;
+
+#define SCROLLBACK_FILE_SIZE (sizeof(ScrollbackHeader) + SCROLLBACK_INDEX_SLOTS * sizeof(ScrollbackEntry) + SCROLLBACK_DATA_SIZE)
+
+struct Scrollback {
+    pthread_mutex_t mutex;
+    unsigned char* map;
+    ScrollbackHeader* header;
+    ScrollbackEntry* index;
+    unsigned char* data;
+    uint64_t scroll_from; /* entry number /scroll continues back from */
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+static void reset_file(Scrollback* sb) {
+    memset(sb->header, 0, sizeof(*sb->header));
+    memcpy(sb->header->magic, SCROLLBACK_MAGIC, sizeof(sb->header->magic));
+    sb->header->version = SCROLLBACK_VERSION;
+    sb->header->index_slots = SCROLLBACK_INDEX_SLOTS;
+    sb->header->data_size = SCROLLBACK_DATA_SIZE;
+}
+
+static int header_valid(const ScrollbackHeader* h) {
+    return memcmp(h->magic, SCROLLBACK_MAGIC, sizeof(h->magic)) == 0 && h->version == SCROLLBACK_VERSION &&
+           h->index_slots == SCROLLBACK_INDEX_SLOTS && h->data_size == SCROLLBACK_DATA_SIZE && h->first <= h->next &&
+           h->next - h->first <= SCROLLBACK_INDEX_SLOTS;
+}
+
+static void cache_path(char* out, size_t cap, const char* server_ip, int port) {
+#ifdef _WIN32
+    const char* home = getenv("USERPROFILE");
+    const char sep = '\\';
+#else
+    const char* home = getenv("HOME");
+    const char sep = '/';
+#endif
+    if (!home || !home[0]) home = ".";
+    /* a unix:/path address must not turn into directories */
+    char server[LOCAL_PATH_MAX + 8];
+    snprintf(server, sizeof(server), "%s", server_ip);
+    for (char* p = server; *p; p++) {
+        if (*p == '/' || *p == '\\' || *p == ':') *p = '_';
+    }
+    snprintf(out, cap, "%s%c.chat_scrollback_%s_%d", home, sep, server, port);
+}
+
+static int map_file(Scrollback* sb, const char* path) {
+#ifdef _WIN32
+    /* no sharing: a second client for the same server runs without a cache */
+    sb->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (sb->file == INVALID_HANDLE_VALUE) return -1;
+    sb->mapping = CreateFileMappingA(sb->file, NULL, PAGE_READWRITE, 0, (DWORD)SCROLLBACK_FILE_SIZE, NULL);
+    if (!sb->mapping) {
+        CloseHandle(sb->file);
+        return -1;
+    }
+    sb->map = MapViewOfFile(sb->mapping, FILE_MAP_ALL_ACCESS, 0, 0, SCROLLBACK_FILE_SIZE);
+    if (!sb->map) {
+        CloseHandle(sb->mapping);
+        CloseHandle(sb->file);
+        return -1;
+    }
+    return 0;
+#else
+    sb->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (sb->fd < 0) return -1;
+    if (flock(sb->fd, LOCK_EX | LOCK_NB) != 0) goto fail;
+    struct stat st;
+    if (fstat(sb->fd, &st) != 0) goto fail;
+    if ((size_t)st.st_size != SCROLLBACK_FILE_SIZE && ftruncate(sb->fd, (off_t)SCROLLBACK_FILE_SIZE) != 0) goto fail;
+    void* map = mmap(NULL, SCROLLBACK_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, sb->fd, 0);
+    if (map == MAP_FAILED) goto fail;
+    sb->map = map;
+    return 0;
+fail:
+    close(sb->fd);
+    return -1;
+#endif
+}
+
+Scrollback* scrollback_open(const char* server_ip, int port) {
+    Scrollback* sb = calloc(1, sizeof(Scrollback));
+    if (!sb) return NULL;
+    char path[512];
+    cache_path(path, sizeof(path), server_ip, port);
+    if (map_file(sb, path) != 0) {
+        free(sb);
+        return NULL;
+    }
+    if (pthread_mutex_init(&sb->mutex, NULL) != 0) {
+        scrollback_close(sb);
+        return NULL;
+    }
+    sb->header = (ScrollbackHeader*)sb->map;
+    sb->index = (ScrollbackEntry*)(sb->map + sizeof(ScrollbackHeader));
+    sb->data = sb->map + sizeof(ScrollbackHeader) + SCROLLBACK_INDEX_SLOTS * sizeof(ScrollbackEntry);
+    if (!header_valid(sb->header)) reset_file(sb);
+    sb->scroll_from = sb->header->next;
+    return sb;
+}
+
+void scrollback_close(Scrollback* sb) {
+    if (!sb) return;
+    if (sb->header) pthread_mutex_destroy(&sb->mutex);
+#ifdef _WIN32
+    UnmapViewOfFile(sb->map);
+    CloseHandle(sb->mapping);
+    CloseHandle(sb->file);
+#else
+    munmap(sb->map, SCROLLBACK_FILE_SIZE);
+    close(sb->fd);
+#endif
+    free(sb);
+}
+
+void scrollback_position(Scrollback* sb, uint64_t* epoch, uint64_t* last_seq) {
+    *epoch = 0;
+    *last_seq = 0;
+    if (!sb) return;
+    pthread_mutex_lock(&sb->mutex);
+    *epoch = sb->header->epoch;
+    *last_seq = sb->header->last_seq;
+    pthread_mutex_unlock(&sb->mutex);
+}
+
+/* Sequence numbers from another server run (or another server) mean
+ * nothing here, so the text is kept but the position starts over. */
+void scrollback_set_epoch(Scrollback* sb, uint64_t epoch) {
+    if (!sb) return;
+    pthread_mutex_lock(&sb->mutex);
+    if (sb->header->epoch != epoch) {
+        sb->header->epoch = epoch;
+        sb->header->last_seq = 0;
+    }
+    pthread_mutex_unlock(&sb->mutex);
+}
+
+/* Advances the cached sequence number past a room frame (presence deltas
+ * too), so the next join only asks for what came after it. */
+void scrollback_seen(Scrollback* sb, const MessageInfo* msg) {
+    if (!sb || msg->seq == 0) return;
+    if (msg->type != MSG_TYPE_CHAT && msg->type != MSG_TYPE_SYSTEM && msg->type != MSG_TYPE_PRESENCE) return;
+    pthread_mutex_lock(&sb->mutex);
+    if (msg->seq > sb->header->last_seq) sb->header->last_seq = msg->seq;
+    pthread_mutex_unlock(&sb->mutex);
+}
+
+/* Stores chat and private lines, and system lines sent to the whole room.
+ * Notices to this connection alone (seq 0) are not kept. */
+void scrollback_append(Scrollback* sb, const MessageInfo* msg) {
+    if (!sb) return;
+    if (msg->type == MSG_TYPE_SYSTEM && msg->seq == 0) return;
+    if (msg->type != MSG_TYPE_CHAT && msg->type != MSG_TYPE_SYSTEM && msg->type != MSG_TYPE_PRIVATE) return;
+    size_t nick_len = strnlen(msg->nickname, sizeof(msg->nickname));
+    size_t text_len = strnlen(msg->message, sizeof(msg->message));
+    uint64_t len = nick_len + text_len;
+    pthread_mutex_lock(&sb->mutex);
+    ScrollbackHeader* h = sb->header;
+    uint64_t pos = h->data_head;
+    uint64_t off = pos % SCROLLBACK_DATA_SIZE;
+    if (off + len > SCROLLBACK_DATA_SIZE) pos += SCROLLBACK_DATA_SIZE - off; /* records never straddle the end */
+    uint64_t head = pos + len;
+    while (h->first < h->next) {
+        const ScrollbackEntry* oldest = &sb->index[h->first % SCROLLBACK_INDEX_SLOTS];
+        if (h->next - h->first < SCROLLBACK_INDEX_SLOTS && oldest->pos + SCROLLBACK_DATA_SIZE >= head) break;
+        h->first++;
+    }
+    memcpy(sb->data + pos % SCROLLBACK_DATA_SIZE, msg->nickname, nick_len);
+    memcpy(sb->data + pos % SCROLLBACK_DATA_SIZE + nick_len, msg->message, text_len);
+    ScrollbackEntry* e = &sb->index[h->next % SCROLLBACK_INDEX_SLOTS];
+    e->seq = msg->seq;
+    e->pos = pos;
+    e->timestamp = (int64_t)msg->timestamp;
+    e->nick_len = (uint16_t)nick_len;
+    e->text_len = (uint16_t)text_len;
+    e->type = msg->type;
+    h->data_head = head;
+    if (sb->scroll_from == h->next) sb->scroll_from++;
+    h->next++;
+    pthread_mutex_unlock(&sb->mutex);
+}
+
+/* Called with sb->mutex held. */
+static void print_entry(const Scrollback* sb, const ScrollbackEntry* e) {
+    const char* nick = (const char*)sb->data + e->pos % SCROLLBACK_DATA_SIZE;
+    const char* text = nick + e->nick_len;
+    time_t ts = (time_t)e->timestamp;
+    char when[26] = "";
+    struct tm* tm_info = localtime(&ts);
+    if (tm_info) strftime(when, sizeof(when), "%Y/%m/%d %H:%M:%S", tm_info);
+    printf(GRAY "[%s] " RESET, when);
+    if (e->type == MSG_TYPE_SYSTEM) {
+        printf(CYAN "[SYSTEM] %.*s" RESET "\n", e->text_len, text);
+    } else if (e->type == MSG_TYPE_PRIVATE) {
+        printf(MAGENTA "[PRIVATE %.*s]" RESET " %.*s\n", e->nick_len, nick, e->text_len, text);
+    } else {
+        printf(CYAN "%.*s" RESET ": %.*s\n", e->nick_len, nick, e->text_len, text);
+    }
+}
+
+/* Shows the count lines before the last ones shown, so repeated calls page
+ * further back. Once the oldest line is shown, paging starts over. */
+void scrollback_scroll(Scrollback* sb, int count) {
+    if (!sb) {
+        print_error("Local history is unavailable");
+        return;
+    }
+    if (count <= 0) count = SCROLLBACK_PAGE;
+    pthread_mutex_lock(&sb->mutex);
+    ScrollbackHeader* h = sb->header;
+    if (sb->scroll_from <= h->first || sb->scroll_from > h->next) sb->scroll_from = h->next;
+    uint64_t end = sb->scroll_from;
+    uint64_t start = end - h->first > (uint64_t)count ? end - (uint64_t)count : h->first;
+    printf(CYAN "=== Local history (%llu of %llu) ===" RESET "\n", (unsigned long long)(end - start),
+           (unsigned long long)(h->next - h->first));
+    for (uint64_t n = start; n < end; n++) print_entry(sb, &sb->index[n % SCROLLBACK_INDEX_SLOTS]);
+    if (start == h->first) printf(GRAY "(start of local history)" RESET "\n");
+    sb->scroll_from = start;
+    pthread_mutex_unlock(&sb->mutex);
+}
+
+static int contains_nocase(const char* hay, size_t len, const char* needle, size_t nlen) {
+    if (nlen == 0) return 1;
+    for (size_t i = 0; i + nlen <= len; i++) {
+        size_t k = 0;
+        while (k < nlen && tolower((unsigned char)hay[i + k]) == tolower((unsigned char)needle[k])) k++;
+        if (k == nlen) return 1;
+    }
+    return 0;
+}
+
+/* Prints the newest SCROLLBACK_GREP_MAX lines whose nickname or text
+ * contains pattern, ignoring case, oldest first. */
+void scrollback_grep(Scrollback* sb, const char* pattern) {
+    if (!sb) {
+        print_error("Local history is unavailable");
+        return;
+    }
+    size_t plen = strlen(pattern);
+    uint64_t hits[SCROLLBACK_GREP_MAX];
+    int n = 0;
+    pthread_mutex_lock(&sb->mutex);
+    ScrollbackHeader* h = sb->header;
+    for (uint64_t i = h->next; i > h->first && n < SCROLLBACK_GREP_MAX; i--) {
+        const ScrollbackEntry* e = &sb->index[(i - 1) % SCROLLBACK_INDEX_SLOTS];
+        const char* nick = (const char*)sb->data + e->pos % SCROLLBACK_DATA_SIZE;
+        if (contains_nocase(nick, e->nick_len, pattern, plen) ||
+            contains_nocase(nick + e->nick_len, e->text_len, pattern, plen)) {
+            hits[n++] = i - 1;
+        }
+    }
+    printf(CYAN "=== %d local match%s for \"%s\" ===" RESET "\n", n, n == 1 ? "" : "es", pattern);
+    while (n-- > 0) print_entry(sb, &sb->index[hits[n] % SCROLLBACK_INDEX_SLOTS]);
+    pthread_mutex_unlock(&sb->mutex);
+}
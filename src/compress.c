@@ -0,0 +1,182 @@
+#include "../include/common.h"
+
+/*
+ * Packed frames for connections that asked for them (see common.h). Frames
+ * with little text are only zero-run coded, as in captures. Longer ones go
+ * through a small LZ77 coder whose matches may also point into a built-in
+ * dictionary of what the room says most: server notices, the frame's own
+ * layout, common words. Each frame is coded on its own, so one packed copy
+ * of a broadcast serves every recipient, whatever else they were sent.
+ *
+ * LZ sequences: a token byte (literal count high nibble, match length - 4
+ * low nibble, 15 meaning more count bytes follow, 255 at a time), the
+ * literals, a two-byte little-endian distance back into dictionary + output
+ * and the match's count bytes. Decoding stops once the frame is complete.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 11
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/* Bump COMPRESS_DICT_VERSION in common.h whenever this changes. */
+static const char dictionary[] =
+    "\x01\0\0\0Server\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+    "Welcome to the chat room! Nickname ' is registered!' is already taken. Please choose another. "
+    "Nickname changed to 'User ' not found or offline. Session expired, joining again. "
+    "messages were lost while you were away joined the chat left the chat renamed to "
+    "https://www. http:// .com/ .org/ github thanks thank you please sorry "
+    "what when where which would could should there their they them this that with have "
+    "from just about know think going really right yeah okay sure lol :) :D ";
+
+static uint16_t dictionary_table[LZ_HASH_SIZE];
+static pthread_once_t dictionary_once = PTHREAD_ONCE_INIT;
+
+#define DICT_SIZE (sizeof(dictionary) - 1)
+
+static uint32_t hash4(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Table entries are positions + 1, so zero means empty. */
+static void index_dictionary(void) {
+    const unsigned char* d = (const unsigned char*)dictionary;
+    for (size_t i = 0; i + LZ_MIN_MATCH <= DICT_SIZE; i++) dictionary_table[hash4(d + i)] = (uint16_t)(i + 1);
+}
+
+static int put_count(unsigned char* out, size_t* o, size_t cap, size_t n) {
+    while (n >= 255) {
+        if (*o >= cap) return -1;
+        out[(*o)++] = 255;
+        n -= 255;
+    }
+    if (*o >= cap) return -1;
+    out[(*o)++] = (unsigned char)n;
+    return 0;
+}
+
+/* Emits literals [start, start + literals) and, if match_len > 0, a match.
+ * Returns -1 if cap would be exceeded. */
+static int put_sequence(unsigned char* out, size_t* o, size_t cap, const unsigned char* start, size_t literals,
+                        size_t distance, size_t match_len) {
+    size_t extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (*o >= cap) return -1;
+    out[(*o)++] = (unsigned char)((literals < 15 ? literals : 15) << 4 | (extra < 15 ? extra : 15));
+    if (literals >= 15 && put_count(out, o, cap, literals - 15) != 0) return -1;
+    if (*o + literals > cap) return -1;
+    memcpy(out + *o, start, literals);
+    *o += literals;
+    if (!match_len) return 0;
+    if (*o + 2 > cap) return -1;
+    out[(*o)++] = (unsigned char)(distance & 0xFF);
+    out[(*o)++] = (unsigned char)(distance >> 8);
+    if (extra >= 15 && put_count(out, o, cap, extra - 15) != 0) return -1;
+    return 0;
+}
+
+/* Returns the coded size, or 0 if it would not fit in cap. */
+static size_t lz_encode(const unsigned char* in, size_t len, unsigned char* out, size_t cap) {
+    unsigned char window[DICT_SIZE + sizeof(MessageInfo)];
+    uint16_t table[LZ_HASH_SIZE];
+    if (len > sizeof(MessageInfo)) return 0;
+    pthread_once(&dictionary_once, index_dictionary);
+    memcpy(window, dictionary, DICT_SIZE);
+    memcpy(window + DICT_SIZE, in, len);
+    memcpy(table, dictionary_table, sizeof(table));
+    size_t end = DICT_SIZE + len;
+    size_t i = DICT_SIZE, anchor = DICT_SIZE, o = 0;
+    while (i + LZ_MIN_MATCH <= end) {
+        uint32_t h = hash4(window + i);
+        size_t candidate = table[h];
+        table[h] = (uint16_t)(i + 1);
+        if (!candidate || memcmp(window + candidate - 1, window + i, LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        size_t from = candidate - 1;
+        size_t match_len = LZ_MIN_MATCH;
+        while (i + match_len < end && window[from + match_len] == window[i + match_len]) match_len++;
+        if (put_sequence(out, &o, cap, window + anchor, i - anchor, i - from, match_len) != 0) return 0;
+        i += match_len;
+        anchor = i;
+        /* keep the tail of the match findable without hashing all of it */
+        if (i + 2 <= end) table[hash4(window + i - 2)] = (uint16_t)(i - 1);
+    }
+    if (anchor < end && put_sequence(out, &o, cap, window + anchor, end - anchor, 0, 0) != 0) return 0;
+    return o;
+}
+
+static int get_count(const unsigned char* in, size_t len, size_t* i, size_t* n) {
+    unsigned char b;
+    do {
+        if (*i >= len) return -1;
+        b = in[(*i)++];
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+static int lz_decode(const unsigned char* in, size_t len, unsigned char* out, size_t out_len) {
+    const unsigned char* d = (const unsigned char*)dictionary;
+    size_t i = 0, o = 0;
+    while (o < out_len) {
+        if (i >= len) return -1;
+        unsigned char token = in[i++];
+        size_t literals = token >> 4;
+        if (literals == 15 && get_count(in, len, &i, &literals) != 0) return -1;
+        if (literals > len - i || literals > out_len - o) return -1;
+        memcpy(out + o, in + i, literals);
+        i += literals;
+        o += literals;
+        if (o == out_len) break;
+        if (i + 2 > len) return -1;
+        size_t distance = (size_t)in[i] | (size_t)in[i + 1] << 8;
+        i += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_count(in, len, &i, &match_len) != 0) return -1;
+        match_len += LZ_MIN_MATCH;
+        if (distance == 0 || distance > DICT_SIZE + o || match_len > out_len - o) return -1;
+        /* byte by byte: a match may overlap the bytes it produces */
+        for (size_t k = 0; k < match_len; k++, o++) {
+            size_t at = DICT_SIZE + o - distance;
+            out[o] = at < DICT_SIZE ? d[at] : out[at - DICT_SIZE];
+        }
+    }
+    return i == len ? 0 : -1;
+}
+
+size_t wire_pack(const MessageInfo* msg, unsigned char* out) {
+    unsigned char body[2 * sizeof(MessageInfo)];
+    size_t cap = sizeof(MessageInfo) - WIRE_HEADER_SIZE;
+    size_t len = 0;
+    int kind = WIRE_ZERO_RUN;
+    /* file payloads follow their header raw; the client reads that plain */
+    if (msg->type == MSG_TYPE_FILE_DATA) return 0;
+    if (strnlen(msg->message, sizeof(msg->message)) >= COMPRESS_MIN_TEXT) {
+        len = lz_encode((const unsigned char*)msg, sizeof(MessageInfo), body, cap);
+        kind = WIRE_LZ;
+    }
+    if (len == 0) {
+        len = capture_encode((const unsigned char*)msg, sizeof(MessageInfo), body);
+        kind = WIRE_ZERO_RUN;
+    }
+    if (len == 0 || len > cap) return 0;
+    out[0] = (unsigned char)kind;
+    out[1] = 0;
+    out[2] = (unsigned char)(len & 0xFF);
+    out[3] = (unsigned char)(len >> 8);
+    memcpy(out + WIRE_HEADER_SIZE, body, len);
+    return WIRE_HEADER_SIZE + len;
+}
+
+int wire_packed_length(const unsigned char* header) {
+    if ((header[0] != WIRE_ZERO_RUN && header[0] != WIRE_LZ) || header[1] != 0) return -1;
+    size_t len = (size_t)header[2] | (size_t)header[3] << 8;
+    return len > 0 && len <= sizeof(MessageInfo) - WIRE_HEADER_SIZE ? (int)len : -1;
+}
+
+int wire_unpack(const unsigned char* header, const unsigned char* body, size_t len, MessageInfo* out) {
+    if (header[0] == WIRE_LZ) return lz_decode(body, len, (unsigned char*)out, sizeof(MessageInfo));
+    return capture_decode(body, len, (unsigned char*)out, sizeof(MessageInfo)) == sizeof(MessageInfo) ? 0 : -1;
+}
@@ -0,0 +1,126 @@
+#include "../include/common.h"
+
+/*
+ * Per-connection delivery filters, checked during fan-out so a suppressed
+ * frame is never queued. Ignored senders are kept by nickname: a
+ * FILTER_BLOOM_BITS bloom filter rules out almost every sender with two bit
+ * tests, and only a hit is confirmed against the exact list. Mention-only
+ * delivery looks for the recipient's nickname as a whole word with a
+ * Horspool skip table, rebuilt whenever that nickname changes.
+ *
+ * On the server the filter belongs to the client slot and is guarded by
+ * clients_mutex, which fan-out already holds. The client keeps the same
+ * filter to apply to room frames that reach it by multicast.
+ */
+
+uint64_t filter_key(const char* nickname) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < MAX_NICK_LEN && nickname[i]; i++) {
+        h ^= (unsigned char)nickname[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void bloom_add(DeliveryFilter* f, uint64_t key) {
+    uint32_t a = (uint32_t)key % FILTER_BLOOM_BITS;
+    uint32_t b = (uint32_t)(key >> 32) % FILTER_BLOOM_BITS;
+    f->bloom[a / 64] |= 1ULL << (a % 64);
+    f->bloom[b / 64] |= 1ULL << (b % 64);
+}
+
+static int bloom_may_contain(const DeliveryFilter* f, uint64_t key) {
+    uint32_t a = (uint32_t)key % FILTER_BLOOM_BITS;
+    uint32_t b = (uint32_t)(key >> 32) % FILTER_BLOOM_BITS;
+    return (f->bloom[a / 64] >> (a % 64) & 1) && (f->bloom[b / 64] >> (b % 64) & 1);
+}
+
+static int find_ignored(const DeliveryFilter* f, const char* nickname) {
+    for (int i = 0; i < f->ignored_count; i++) {
+        if (strncmp(f->ignored[i], nickname, MAX_NICK_LEN) == 0) return i;
+    }
+    return -1;
+}
+
+void filter_reset(DeliveryFilter* f, const char* nickname) {
+    memset(f, 0, sizeof(*f));
+    f->mode = DELIVER_ALL;
+    filter_set_nickname(f, nickname);
+}
+
+/* Case-insensitive: both cases of each byte get the same shift. */
+void filter_set_nickname(DeliveryFilter* f, const char* nickname) {
+    snprintf(f->nick, sizeof(f->nick), "%s", nickname);
+    size_t m = strlen(f->nick);
+    f->nick_len = m;
+    for (int c = 0; c < 256; c++) f->skip[c] = (unsigned char)(m ? m : 1);
+    for (size_t i = 0; i + 1 < m; i++) {
+        unsigned char c = (unsigned char)f->nick[i];
+        f->skip[tolower(c)] = (unsigned char)(m - 1 - i);
+        f->skip[toupper(c)] = (unsigned char)(m - 1 - i);
+    }
+}
+
+/* Returns 0 when added, 1 when already ignored, -1 when the list is full. */
+int filter_ignore(DeliveryFilter* f, const char* nickname) {
+    if (find_ignored(f, nickname) >= 0) return 1;
+    if (f->ignored_count == FILTER_IGNORE_MAX) return -1;
+    snprintf(f->ignored[f->ignored_count++], MAX_NICK_LEN, "%s", nickname);
+    bloom_add(f, filter_key(nickname));
+    return 0;
+}
+
+/* Returns -1 when nickname was not ignored. */
+int filter_unignore(DeliveryFilter* f, const char* nickname) {
+    int i = find_ignored(f, nickname);
+    if (i < 0) return -1;
+    f->ignored_count--;
+    if (i != f->ignored_count) memcpy(f->ignored[i], f->ignored[f->ignored_count], MAX_NICK_LEN);
+    /* bloom bits can't be cleared one name at a time */
+    memset(f->bloom, 0, sizeof(f->bloom));
+    for (int k = 0; k < f->ignored_count; k++) bloom_add(f, filter_key(f->ignored[k]));
+    return 0;
+}
+
+/* Keeps an ignore on someone who renames on this server. */
+void filter_renamed(DeliveryFilter* f, const char* old_nick, const char* new_nick) {
+    int i = find_ignored(f, old_nick);
+    if (i < 0 || find_ignored(f, new_nick) >= 0) return;
+    snprintf(f->ignored[i], MAX_NICK_LEN, "%s", new_nick);
+    bloom_add(f, filter_key(new_nick));
+}
+
+static int is_word_char(int c) {
+    return isalnum(c) || c == '_';
+}
+
+static int mentions(const DeliveryFilter* f, const char* text, size_t len) {
+    size_t m = f->nick_len;
+    if (m == 0) return 0;
+    size_t pos = 0;
+    while (pos + m <= len) {
+        size_t k = m;
+        while (k > 0 && tolower((unsigned char)text[pos + k - 1]) == tolower((unsigned char)f->nick[k - 1])) k--;
+        if (k == 0) {
+            int starts = pos == 0 || !is_word_char((unsigned char)text[pos - 1]);
+            int ends = pos + m == len || !is_word_char((unsigned char)text[pos + m]);
+            if (starts && ends) return 1;
+        }
+        pos += f->skip[(unsigned char)text[pos + m - 1]];
+    }
+    return 0;
+}
+
+/* sender_key is filter_key(msg->nickname), computed once per fan-out. The
+ * caller must have set msg->nickname from the sender's client slot, never
+ * from what the client sent. Returns FILTER_PASS or the reason the frame
+ * is suppressed. */
+int filter_check(const DeliveryFilter* f, const MessageInfo* msg, uint64_t sender_key) {
+    if (msg->type != MSG_TYPE_CHAT && msg->type != MSG_TYPE_PRIVATE) return FILTER_PASS;
+    if (f->ignored_count > 0 && bloom_may_contain(f, sender_key) && find_ignored(f, msg->nickname) >= 0) {
+        return FILTER_IGNORED;
+    }
+    if (msg->type != MSG_TYPE_CHAT || f->mode == DELIVER_ALL) return FILTER_PASS;
+    if (f->mode == DELIVER_MUTED) return FILTER_MUTED;
+    return mentions(f, msg->message, strnlen(msg->message, sizeof(msg->message))) ? FILTER_PASS : FILTER_UNMENTIONED;
+}
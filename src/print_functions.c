@@ -43,6 +43,18 @@ void print_client_help(void) {
         BOLD_CYAN "/help" RESET "        - Show this help message\n"
         BOLD_CYAN "/quit" RESET "        - Leave the chat and disconnect\n"
         BOLD_CYAN "/nick <new_nick>" RESET "        - Change your nickname\n"
+        BOLD_CYAN "/who" RESET "         - List online users\n"
+        BOLD_CYAN "/latency [n]" RESET " - Measure round trip and per-hop latency\n"
+        BOLD_CYAN "/ignore [nick]" RESET " - Ignore a user, or list ignored users\n"
+        BOLD_CYAN "/unignore <nick>" RESET " - Stop ignoring a user\n"
+        BOLD_CYAN "/mute" RESET "        - Toggle receiving room messages\n"
+        BOLD_CYAN "/mentions" RESET "    - Toggle receiving only messages that mention you\n"
+        BOLD_CYAN "/multicast" RESET "   - Show multicast delivery status\n"
+        BOLD_CYAN "/scroll [n]" RESET "  - Page back through local scrollback\n"
+        BOLD_CYAN "/grep <text>" RESET " - Search local scrollback\n"
+        BOLD_CYAN "/search <words> [from:nick]" RESET " - Search recent room history\n"
+        BOLD_CYAN "/send <nick|room> <file>" RESET " - Send a file\n"
+        BOLD_CYAN "/receive" RESET "     - Toggle saving incoming files in " FILE_DOWNLOAD_DIR "\n"
         BOLD_CYAN "/shh <nick> <msg>" RESET " - Send private message\n"
         BOLD_CYAN "<message>" RESET "      - Send a chat message\n"
         CYAN "============================" RESET "\n\n"
@@ -54,6 +66,8 @@ void print_server_help(void) {
         "\n" CYAN "=== Chat Client Commands ===" RESET "\n"
         BOLD_CYAN "/help" RESET "        - Show this help message\n"
         BOLD_CYAN "/quit" RESET "        - Disconnect\n"
+        BOLD_CYAN "/who" RESET "         - List online users\n"
+        BOLD_CYAN "/stats" RESET "       - Show latency histograms and counters\n"
         BOLD_CYAN "/shh <nick> <msg>" RESET " - Send private message\n"
         BOLD_CYAN "<message>" RESET "      - Send a chat message\n"
         CYAN "============================" RESET "\n\n"
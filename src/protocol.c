@@ -0,0 +1,52 @@
+#include "../include/common.h"
+#include <stddef.h>
+
+/*
+ * Frame encoding and decoding, generated from the MSG_TYPES schema in
+ * common.h and shared by the server and the client. msg_encode writes every
+ * byte of a frame once, so callers don't clear a whole frame and then copy
+ * strings over it; msg_decode checks what a peer sent before any handler
+ * looks at it.
+ */
+
+const MessageSchema message_schema[MSG_TYPE_COUNT] = {
+    [MSG_TYPE_INVALID] = {"INVALID", OUTBOX_CONTROL, 0},
+#define MSG_TYPE_SCHEMA(name, lane, from) [MSG_TYPE_##name] = {#name, lane, from},
+    MSG_TYPES(MSG_TYPE_SCHEMA)
+#undef MSG_TYPE_SCHEMA
+};
+
+const char* msg_type_name(int type) {
+    return type > 0 && type < MSG_TYPE_COUNT ? message_schema[type].name : "INVALID";
+}
+
+/* Copies up to cap - 1 bytes of s and zeroes the rest of the field. */
+static void put_field(char* field, size_t cap, const char* s) {
+    size_t n = s ? strnlen(s, cap - 1) : 0;
+    memcpy(field, s ? s : "", n);
+    memset(field + n, 0, cap - n);
+}
+
+/* Fills a frame with the given strings (NULL for none) and the current
+ * time; every other field, padding included, is zero. */
+void msg_encode(MessageInfo* msg, int type, const char* nickname, const char* target, const char* text) {
+    size_t tail = offsetof(MessageInfo, message) + sizeof(msg->message);
+    msg->type = type;
+    put_field(msg->nickname, sizeof(msg->nickname), nickname);
+    put_field(msg->target_nickname, sizeof(msg->target_nickname), target);
+    put_field(msg->message, sizeof(msg->message), text);
+    memset((char*)msg + tail, 0, sizeof(MessageInfo) - tail);
+    msg->timestamp = time(NULL);
+}
+
+/* Returns 0 if the frame is a known type that a peer of kind from
+ * (MSG_FROM_CLIENT or MSG_FROM_SERVER) may send, -1 otherwise. Text
+ * fields are cut at their last byte so they always end in a NUL. */
+int msg_decode(MessageInfo* msg, int from) {
+    if (msg->type <= MSG_TYPE_INVALID || msg->type >= MSG_TYPE_COUNT) return -1;
+    if (!(message_schema[msg->type].from & from)) return -1;
+    msg->nickname[sizeof(msg->nickname) - 1] = '\0';
+    msg->target_nickname[sizeof(msg->target_nickname) - 1] = '\0';
+    msg->message[sizeof(msg->message) - 1] = '\0';
+    return 0;
+}
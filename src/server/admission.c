@@ -0,0 +1,332 @@
+#include "../../include/common.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#endif
+
+/*
+ * Admission control for the accept loop. The listeners are non-blocking,
+ * so each wake-up drains at most ADMISSION_BATCH pending connections and
+ * the loop stays free to park for a hot restart. Every new connection is
+ * checked before it costs a client slot, a writer and a reader thread:
+ *
+ *   - load: a sampler thread keeps a snapshot of the frames waiting in the
+ *     worker strands and outboxes, how late its own timer fires (the
+ *     process is short of CPU), and the resident set size; over any limit,
+ *     new connections are shed until it recovers;
+ *   - seats: the room is full at MAX_CLIENTS;
+ *   - address: at most per_ip connections from one remote IPv4 address.
+ *     Loopback and the unix socket are exempt, as for other same-host
+ *     peers.
+ *
+ * A refused connection gets one SYSTEM frame flagged MSG_FLAG_RETRY that
+ * says when to try again, and is closed. When the process runs out of
+ * descriptors, a reserved one is given up to accept and refuse the
+ * connection, so the backlog does not fill with connections nobody
+ * answers.
+ */
+
+static const char* const reason_name[REFUSE_REASONS] = {"admitted", "room full", "per-IP cap", "queue depth", "scheduling lag", "memory", "descriptors"};
+static const char* const refusal_text[REFUSE_REASONS] = {
+    "", "The room is full", "Too many connections from your address", "The server is busy", "The server is busy",
+    "The server is low on memory", "The server is out of connections"};
+static const int retry_secs[REFUSE_REASONS] = {0, 30, 30, 5, 5, 10, 5};
+
+struct Admission {
+    ServerState* server;
+    AdmissionLimits limits;
+    pthread_t thread;
+    int running;
+    int reserve_fd;
+    int shedding;
+    /* load snapshot, written by the sampler */
+    int queued;
+    int lag_ms;
+    int rss_mb;
+    unsigned long long accepted;
+    unsigned long long batches;
+    int largest_batch;
+    unsigned long long refused[REFUSE_REASONS];
+};
+
+static void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static int set_blocking(SOCKET sock, int blocking) {
+#ifdef _WIN32
+    u_long mode = blocking ? 0 : 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(sock, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#endif
+}
+
+static int resident_mb(void) {
+#ifdef __linux__
+    long size = 0, resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (!fp) return 0;
+    int n = fscanf(fp, "%ld %ld", &size, &resident);
+    fclose(fp);
+    return n == 2 ? (int)(resident * sysconf(_SC_PAGESIZE) / (1024 * 1024)) : 0;
+#else
+    return 0;
+#endif
+}
+
+static int queued_frames(ServerState* server) {
+    int n = worker_pool_backlog(server->workers);
+    for (int i = 0; i < MAX_CLIENTS; i++) n += outbox_queued(server->clients[i].outbox);
+    return n;
+}
+
+static void* sampler_thread(void* arg) {
+    Admission* a = arg;
+    int lag_ms = 0;
+    while (__atomic_load_n(&a->running, __ATOMIC_RELAXED)) {
+        uint64_t due = monotonic_ns() + (uint64_t)ADMISSION_SAMPLE_MS * 1000000ULL;
+        sleep_ms(ADMISSION_SAMPLE_MS);
+        uint64_t now = monotonic_ns();
+        int late = now > due ? (int)((now - due) / 1000000ULL) : 0;
+        /* smoothed, so one slow wake-up does not turn people away */
+        lag_ms = (3 * lag_ms + late) / 4;
+        __atomic_store_n(&a->lag_ms, lag_ms, __ATOMIC_RELAXED);
+        __atomic_store_n(&a->queued, queued_frames(a->server), __ATOMIC_RELAXED);
+        __atomic_store_n(&a->rss_mb, resident_mb(), __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+Admission* admission_open(ServerState* server, const AdmissionLimits* limits) {
+    Admission* a = calloc(1, sizeof(Admission));
+    if (!a) return NULL;
+    a->server = server;
+    a->limits = *limits;
+    a->reserve_fd = -1;
+    if (set_blocking(server->server_socket, 0) != 0 ||
+        (server->local_socket != INVALID_SOCKET && set_blocking(server->local_socket, 0) != 0)) {
+        print_error("Failed to make the listeners non-blocking");
+        goto fail;
+    }
+#ifdef TCP_DEFER_ACCEPT
+    /* a connection that sends nothing is not worth waking up for */
+    int defer = ADMISSION_DEFER_SECS;
+    (void)setsockopt(server->server_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+#endif
+#ifndef _WIN32
+    a->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+#endif
+    a->running = 1;
+    if (pthread_create(&a->thread, NULL, sampler_thread, a) != 0) {
+        print_error("Failed to create admission sampler thread");
+        goto fail_reserve;
+    }
+    return a;
+fail_reserve:
+#ifndef _WIN32
+    if (a->reserve_fd >= 0) close(a->reserve_fd);
+#endif
+fail:
+    free(a);
+    return NULL;
+}
+
+void admission_close(Admission* a) {
+    if (!a) return;
+    admission_pause(a);
+#ifndef _WIN32
+    if (a->reserve_fd >= 0) close(a->reserve_fd);
+#endif
+    free(a);
+}
+
+/* Stops the sampler; the last snapshot stays in force. */
+void admission_pause(Admission* a) {
+    if (!a || !__atomic_exchange_n(&a->running, 0, __ATOMIC_RELAXED)) return;
+    pthread_join(a->thread, NULL);
+}
+
+void admission_resume(Admission* a) {
+    if (!a) return;
+    __atomic_store_n(&a->running, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&a->thread, NULL, sampler_thread, a) != 0) {
+        __atomic_store_n(&a->running, 0, __ATOMIC_RELAXED);
+        print_error("Failed to restart admission sampler thread");
+    }
+}
+
+/* Sends the retry-after notice and closes the connection. */
+void admission_refuse(Admission* a, SOCKET sock, int reason) {
+    MessageInfo notice;
+    char scratch[1024];
+    msg_encode(&notice, MSG_TYPE_SYSTEM, "Server", NULL, NULL);
+    snprintf(notice.message, sizeof(notice.message), "%s, try again in %d seconds.", refusal_text[reason], retry_secs[reason]);
+    notice.flags |= MSG_FLAG_RETRY;
+    notice.count = retry_secs[reason];
+    (void)set_blocking(sock, 0);
+    (void)send(sock, (const char*)&notice, (int)sizeof(notice), 0);
+    /* closing with unread input would reset the connection, and the notice
+     * with it; a connection that keeps sending is not waited for */
+    shutdown(sock, SHUTDOWN_SEND);
+    for (int i = 0; i < 8 && recv(sock, scratch, (int)sizeof(scratch), 0) > 0; i++) {
+    }
+    CLOSE_SOCKET(sock);
+    __atomic_add_fetch(&a->refused[reason], 1, __ATOMIC_RELAXED);
+}
+
+static int load_verdict(Admission* a) {
+    const AdmissionLimits* l = &a->limits;
+    if (l->max_queued > 0 && __atomic_load_n(&a->queued, __ATOMIC_RELAXED) > l->max_queued) return REFUSE_QUEUE;
+    if (l->max_lag_ms > 0 && __atomic_load_n(&a->lag_ms, __ATOMIC_RELAXED) > l->max_lag_ms) return REFUSE_LAG;
+    if (l->max_rss_mb > 0 && __atomic_load_n(&a->rss_mb, __ATOMIC_RELAXED) > l->max_rss_mb) return REFUSE_MEMORY;
+    return ADMIT_OK;
+}
+
+static int capped_address(const struct sockaddr_in* addr) {
+    return addr->sin_family == AF_INET && (ntohl(addr->sin_addr.s_addr) >> 24) != 127;
+}
+
+/* Connections from addr already admitted, including earlier ones in this
+ * batch that have no client slot yet. */
+static int connections_from(ServerState* server, const struct sockaddr_in* addr, const AdmittedConn* batch, int n) {
+    int count = 0;
+    pthread_mutex_lock(&server->clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        const Client* c = &server->clients[i];
+        if (c->active && !c->local && c->address.sin_addr.s_addr == addr->sin_addr.s_addr) count++;
+    }
+    pthread_mutex_unlock(&server->clients_mutex);
+    for (int i = 0; i < n; i++) count += batch[i].address.sin_addr.s_addr == addr->sin_addr.s_addr;
+    return count;
+}
+
+static int free_seats(ServerState* server) {
+    pthread_mutex_lock(&server->clients_mutex);
+    int seats = MAX_CLIENTS - server->client_count;
+    pthread_mutex_unlock(&server->clients_mutex);
+    return seats;
+}
+
+static SOCKET accept_one(SOCKET listener, int local, struct sockaddr_in* addr) {
+    socklen_t len = (socklen_t)sizeof(*addr);
+    struct sockaddr* from = local ? NULL : (struct sockaddr*)addr;
+#ifdef __linux__
+    return accept4(listener, from, local ? NULL : &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    SOCKET sock = accept(listener, from, local ? NULL : &len);
+    if (sock != INVALID_SOCKET && set_blocking(sock, 0) != 0) {
+        CLOSE_SOCKET(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+#endif
+}
+
+/* Out of descriptors: give up the reserved one to take the connection off
+ * the backlog and refuse it. Returns 0 if one was refused. */
+static int refuse_without_descriptor(Admission* a, SOCKET listener) {
+#ifdef _WIN32
+    (void)a; (void)listener;
+    return -1;
+#else
+    if (a->reserve_fd < 0) return -1;
+    close(a->reserve_fd);
+    SOCKET sock = accept(listener, NULL, NULL);
+    if (sock != INVALID_SOCKET) admission_refuse(a, sock, REFUSE_DESCRIPTORS);
+    a->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return sock != INVALID_SOCKET ? 0 : -1;
+#endif
+}
+
+static int out_of_descriptors(void) {
+#ifdef _WIN32
+    return SOCKET_ERROR_CODE == WSAEMFILE;
+#else
+    return errno == EMFILE || errno == ENFILE;
+#endif
+}
+
+static int interrupted(void) {
+#ifdef _WIN32
+    return SOCKET_ERROR_CODE == WSAECONNRESET;
+#else
+    return errno == EINTR || errno == ECONNABORTED;
+#endif
+}
+
+/*
+ * Accepts up to cap pending connections from listener and refuses those
+ * the server cannot take. Returns how many were admitted into out; their
+ * sockets are blocking again, like every other client socket.
+ */
+int admission_accept(Admission* a, SOCKET listener, int local, AdmittedConn* out, int cap) {
+    ServerState* server = a->server;
+    int n = 0, taken = 0;
+    int load = load_verdict(a);
+    if (load != a->shedding) {
+        if (load != ADMIT_OK) printf(YELLOW "Shedding new connections: %s over its limit" RESET "\n", reason_name[load]);
+        else print_system_message("Load is back under its limits, admitting connections again");
+        a->shedding = load;
+    }
+    int seats = load == ADMIT_OK ? free_seats(server) : 0;
+    while (taken < cap) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        SOCKET sock = accept_one(listener, local, &addr);
+        if (sock == INVALID_SOCKET) {
+            if (interrupted()) continue;
+            if (out_of_descriptors() && refuse_without_descriptor(a, listener) == 0) {
+                taken++;
+                continue;
+            }
+            break;
+        }
+        taken++;
+        int verdict = load;
+        if (verdict == ADMIT_OK && n >= seats) verdict = REFUSE_FULL;
+        if (verdict == ADMIT_OK && !local && a->limits.per_ip > 0 && capped_address(&addr) &&
+            connections_from(server, &addr, out, n) >= a->limits.per_ip) {
+            verdict = REFUSE_PER_IP;
+        }
+        if (verdict == ADMIT_OK && set_blocking(sock, 1) != 0) {
+            CLOSE_SOCKET(sock);
+            continue;
+        }
+        if (verdict != ADMIT_OK) {
+            admission_refuse(a, sock, verdict);
+            continue;
+        }
+        out[n].socket = sock;
+        out[n].address = addr;
+        n++;
+    }
+    if (taken > 0) {
+        a->batches++;
+        if (taken > a->largest_batch) a->largest_batch = taken;
+        a->accepted += (unsigned long long)n;
+    }
+    return n;
+}
+
+void admission_print_stats(Admission* a) {
+    if (!a) return;
+    const AdmissionLimits* l = &a->limits;
+    printf(CYAN "=== Admission ===" RESET "\n");
+    printf("admitted %llu in %llu accept batches (largest %d)\n", a->accepted, a->batches, a->largest_batch);
+    printf("refused:");
+    for (int i = REFUSE_FULL; i < REFUSE_REASONS; i++) {
+        printf("%s %s %llu", i == REFUSE_FULL ? "" : ",", reason_name[i], __atomic_load_n(&a->refused[i], __ATOMIC_RELAXED));
+    }
+    printf("\n");
+    printf("load: %d frames queued (limit %d), %d ms lag (limit %d), %d MB resident (limit %d), per-IP cap %d\n",
+           __atomic_load_n(&a->queued, __ATOMIC_RELAXED), l->max_queued, __atomic_load_n(&a->lag_ms, __ATOMIC_RELAXED),
+           l->max_lag_ms, __atomic_load_n(&a->rss_mb, __ATOMIC_RELAXED), l->max_rss_mb, l->per_ip);
+}
@@ -0,0 +1,208 @@
+#include "../../include/common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+/*
+ * Traffic capture. Handler threads append records to the active buffer
+ * under a mutex and never touch the file; a writer thread swaps buffers
+ * and writes the full one out every CAPTURE_FLUSH_MS or when it fills.
+ * If the disk falls so far behind that both buffers are full, records are
+ * dropped and counted rather than stalling message handling.
+ */
+
+/* worst case of the zero-run coding: two count bytes per 255 literals */
+#define CAPTURE_RECORD_MAX (sizeof(CaptureRecord) + sizeof(MessageInfo) + 2 * (sizeof(MessageInfo) / 255 + 2))
+
+struct Capture {
+    FILE* fp;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned char* buffers[2];
+    size_t used[2];
+    int active;
+    int closing;
+    uint64_t started_ns;
+    unsigned long long records;
+    unsigned long long dropped;
+    unsigned long long bytes_written;
+    unsigned long long raw_bytes;
+};
+
+static void* capture_writer(void* arg) {
+    Capture* capture = arg;
+    pthread_mutex_lock(&capture->mutex);
+    for (;;) {
+        int pending = !capture->active;
+        if (capture->used[pending] == 0) {
+            if (!capture->closing) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += (long)CAPTURE_FLUSH_MS * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&capture->cond, &capture->mutex, &deadline);
+                if (capture->used[!capture->active] != 0) continue;
+            }
+            if (capture->used[capture->active] == 0) {
+                if (capture->closing) break;
+                continue;
+            }
+            pending = capture->active;
+            capture->active = !pending;
+        }
+        size_t len = capture->used[pending];
+        pthread_mutex_unlock(&capture->mutex);
+
+        size_t written = fwrite(capture->buffers[pending], 1, len, capture->fp);
+        fflush(capture->fp);
+
+        pthread_mutex_lock(&capture->mutex);
+        capture->bytes_written += written;
+        capture->used[pending] = 0;
+        if (written != len) print_error("Failed to write capture file");
+    }
+    pthread_mutex_unlock(&capture->mutex);
+    return NULL;
+}
+
+/* Called with capture->mutex held. */
+static void capture_append(Capture* capture, const CaptureRecord* rec, const unsigned char* body) {
+    size_t need = sizeof(*rec) + rec->len;
+    int slot = capture->active;
+    if (capture->used[slot] + need > CAPTURE_BUFFER_SIZE) {
+        /* the other buffer is still being written: drop instead of blocking */
+        if (capture->used[!slot] != 0) {
+            capture->dropped++;
+            return;
+        }
+        capture->active = slot = !slot;
+        pthread_cond_signal(&capture->cond);
+    }
+    unsigned char* dst = capture->buffers[slot] + capture->used[slot];
+    memcpy(dst, rec, sizeof(*rec));
+    if (rec->len) memcpy(dst + sizeof(*rec), body, rec->len);
+    capture->used[slot] += need;
+    capture->records++;
+}
+
+/* The capture holds everything clients sent, so it is only ever a new file
+ * readable by the server's user; an existing file is never overwritten. */
+static FILE* create_private(const char* path) {
+#ifdef _WIN32
+    int fd = _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+    if (fd < 0) return NULL;
+    FILE* fp = _fdopen(fd, "wb");
+    if (!fp) _close(fd);
+#else
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return NULL;
+    FILE* fp = fdopen(fd, "wb");
+    if (!fp) close(fd);
+#endif
+    return fp;
+}
+
+Capture* capture_open(const char* path) {
+    Capture* capture = calloc(1, sizeof(Capture));
+    if (!capture) return NULL;
+    capture->fp = create_private(path);
+    if (!capture->fp) {
+        print_error(errno == EEXIST ? "Capture file already exists" : "Failed to open capture file");
+        free(capture);
+        return NULL;
+    }
+    capture->buffers[0] = malloc(CAPTURE_BUFFER_SIZE);
+    capture->buffers[1] = malloc(CAPTURE_BUFFER_SIZE);
+    if (!capture->buffers[0] || !capture->buffers[1]) goto fail_buffers;
+
+    CaptureFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.frame_size = (uint32_t)sizeof(MessageInfo);
+    if (fwrite(&header, sizeof(header), 1, capture->fp) != 1) goto fail_buffers;
+    capture->bytes_written = sizeof(header);
+    capture->started_ns = monotonic_ns();
+
+    if (pthread_mutex_init(&capture->mutex, NULL) != 0) goto fail_buffers;
+    if (pthread_cond_init(&capture->cond, NULL) != 0) goto fail_cond;
+    if (pthread_create(&capture->thread, NULL, capture_writer, capture) != 0) goto fail_thread;
+    return capture;
+fail_thread:
+    pthread_cond_destroy(&capture->cond);
+fail_cond:
+    pthread_mutex_destroy(&capture->mutex);
+fail_buffers:
+    print_error("Failed to start capture");
+    free(capture->buffers[0]);
+    free(capture->buffers[1]);
+    fclose(capture->fp);
+    free(capture);
+    return NULL;
+}
+
+void capture_close(Capture* capture) {
+    if (!capture) return;
+    pthread_mutex_lock(&capture->mutex);
+    capture->closing = 1;
+    pthread_cond_signal(&capture->cond);
+    pthread_mutex_unlock(&capture->mutex);
+    pthread_join(capture->thread, NULL);
+    fclose(capture->fp);
+    pthread_cond_destroy(&capture->cond);
+    pthread_mutex_destroy(&capture->mutex);
+    free(capture->buffers[0]);
+    free(capture->buffers[1]);
+    free(capture);
+}
+
+void capture_event(Capture* capture, int conn_id, int kind) {
+    if (!capture) return;
+    CaptureRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.conn_id = (uint32_t)conn_id;
+    rec.kind = (uint16_t)kind;
+    pthread_mutex_lock(&capture->mutex);
+    rec.ts_ns = monotonic_ns() - capture->started_ns;
+    capture_append(capture, &rec, NULL);
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+void capture_frame(Capture* capture, int conn_id, const MessageInfo* msg) {
+    if (!capture) return;
+    MessageInfo blanked;
+    if (msg->type == MSG_TYPE_RESUME) {
+        /* a token in the file would let its reader take over the session */
+        blanked = *msg;
+        memset(blanked.message, 0, sizeof(blanked.message));
+        msg = &blanked;
+    }
+    unsigned char body[CAPTURE_RECORD_MAX];
+    CaptureRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.conn_id = (uint32_t)conn_id;
+    rec.kind = CAPTURE_FRAME;
+    rec.len = (uint16_t)capture_encode((const unsigned char*)msg, sizeof(*msg), body);
+    pthread_mutex_lock(&capture->mutex);
+    rec.ts_ns = monotonic_ns() - capture->started_ns;
+    capture->raw_bytes += sizeof(*msg);
+    capture_append(capture, &rec, body);
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+void capture_print_stats(Capture* capture) {
+    if (!capture) return;
+    pthread_mutex_lock(&capture->mutex);
+    printf(CYAN "=== Capture ===" RESET "\n");
+    printf("records %llu, dropped %llu, written %llu bytes (frames %llu bytes before coding)\n",
+           capture->records, capture->dropped, capture->bytes_written, capture->raw_bytes);
+    pthread_mutex_unlock(&capture->mutex);
+}
@@ -0,0 +1,544 @@
+#include "../../include/common.h"
+
+#ifndef _WIN32
+
+#include <sys/stat.h>
+
+/*
+ * Hot restart. A server started with --handoff <path> listens there for a
+ * successor. A new process started with the same option asks there first,
+ * and if a server answers, takes over its listening sockets, connections
+ * and room state instead of binding the port itself:
+ *
+ *   1. the old process stops accepting and parks every connection reader
+ *      between two frames, after its queued work has run;
+ *   2. it stops the presence, search, transfer and admission threads and
+ *      pauses the writers, keeping what they still had queued (a writer
+ *      that cannot finish its batch in HANDOFF_PAUSE_MS costs only its own
+ *      connection), and sends a HandoffHeader (the sockets ride on it as SCM_RIGHTS), the
+ *      room history, the session table, and per client a HandoffClient
+ *      followed by its queued frames;
+ *   3. the new process adopts all of it, says it is running and waits for
+ *      the old one to exit, then listens on the handoff path itself.
+ *
+ * Clients see a pause, not a disconnect: what they send meanwhile waits in
+ * the kernel. If anything fails before the new process confirms, the old
+ * one carries on. Both builds must agree on the record layout, which the
+ * header checks. File transfers in progress are not carried over.
+ */
+
+#define HANDOFF_MAGIC "CHATHOFF"
+#define HANDOFF_VERSION 2
+#define HANDOFF_MAX_FDS (MAX_CLIENTS + 2)
+#define HANDOFF_READY 'R'
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t frame_size;
+    uint32_t client_size;
+    int32_t next_client_id;
+    int32_t clients;
+    int32_t has_local;
+    uint64_t next_seq;
+    uint64_t epoch;
+    uint32_t history_frames;
+    char local_path[LOCAL_PATH_MAX];
+} HandoffHeader;
+
+typedef struct {
+    int client_id;
+    char nickname[MAX_NICK_LEN];
+    struct sockaddr_in address;
+    DeliveryFilter filter;
+    int multicast;
+    int local;
+    int peer_uid;
+    int peer_pid;
+    int trusted;
+    int leaving;
+    int compress;
+    int queued;
+    uint64_t held_from;
+} HandoffClient;
+
+struct Handoff {
+    ServerState* server;
+    SOCKET listener;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t resumed;
+    int pending;
+    int parked;
+};
+
+struct Takeover {
+    SOCKET peer;
+    HandoffHeader header;
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count;
+    MessageInfo* history;
+    Session sessions[SESSION_MAX];
+    HandoffClient clients[MAX_CLIENTS];
+    QueuedFrame* queued[MAX_CLIENTS];
+};
+
+static int send_all(SOCKET sock, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, 0);
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int recv_all(SOCKET sock, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+/* Waits up to ms for sock to become readable. */
+static int wait_readable(SOCKET sock, int ms) {
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(sock, &readable);
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    return select(sock + 1, &readable, NULL, NULL, &tv) > 0;
+}
+
+static int send_header(SOCKET sock, const HandoffHeader* header, const int* fds, int count) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = {(void*)header, sizeof(*header)};
+    struct msghdr m;
+    memset(&m, 0, sizeof(m));
+    memset(control, 0, sizeof(control));
+    m.msg_iov = &iov;
+    m.msg_iovlen = 1;
+    m.msg_control = control;
+    m.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)count);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&m);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)count);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * (size_t)count);
+    ssize_t n = sendmsg(sock, &m, 0);
+    if (n <= 0) return -1;
+    return send_all(sock, (const char*)header + n, sizeof(*header) - (size_t)n);
+}
+
+static int recv_header(Takeover* t) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = {&t->header, sizeof(t->header)};
+    struct msghdr m;
+    memset(&m, 0, sizeof(m));
+    m.msg_iov = &iov;
+    m.msg_iovlen = 1;
+    m.msg_control = control;
+    m.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(t->peer, &m, MSG_WAITALL);
+    if (n <= 0) return -1;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&m); c; c = CMSG_NXTHDR(&m, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int count = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        if (count > HANDOFF_MAX_FDS - t->fd_count) count = HANDOFF_MAX_FDS - t->fd_count;
+        memcpy(t->fds + t->fd_count, CMSG_DATA(c), sizeof(int) * (size_t)count);
+        t->fd_count += count;
+    }
+    if (m.msg_flags & MSG_CTRUNC) return -1;
+    return recv_all(t->peer, (char*)&t->header + n, sizeof(t->header) - (size_t)n);
+}
+
+/* The accept loop and every connection reader must be parked. Readers that
+ * are on their way out only need to finish leaving. */
+static int wait_parked(Handoff* h) {
+    ServerState* server = h->server;
+    for (int waited = 0; waited < HANDOFF_PARK_MS; waited += 10) {
+        int active = 0;
+        pthread_mutex_lock(&server->clients_mutex);
+        for (int i = 0; i < MAX_CLIENTS; i++) active += server->clients[i].active;
+        pthread_mutex_unlock(&server->clients_mutex);
+        pthread_mutex_lock(&h->mutex);
+        int parked = h->parked;
+        pthread_mutex_unlock(&h->mutex);
+        if (parked == active + 1) return 0;
+        sleep_ms(10);
+    }
+    return -1;
+}
+
+/* Called with clients_mutex held, once the paused clients' writers and
+ * every other thread that writes to clients have stopped, so nothing
+ * reaches the sockets while they change hands. */
+static int send_state(Handoff* h, SOCKET peer, const int* paused, int count) {
+    ServerState* server = h->server;
+    HandoffHeader header;
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count = 0;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HANDOFF_MAGIC, sizeof(header.magic));
+    header.version = HANDOFF_VERSION;
+    header.frame_size = sizeof(MessageInfo);
+    header.client_size = sizeof(HandoffClient);
+    header.next_client_id = server->next_client_id;
+    header.clients = count;
+    header.has_local = server->local_socket != INVALID_SOCKET;
+    memcpy(header.local_path, server->local_path, sizeof(header.local_path));
+    uint64_t oldest = 0, latest = 0;
+    history_bounds(&server->history, &oldest, &latest);
+    header.next_seq = latest + 1;
+    header.epoch = server->history.epoch;
+    header.history_frames = latest >= oldest ? (uint32_t)(latest - oldest + 1) : 0;
+    fds[fd_count++] = server->server_socket;
+    if (header.has_local) fds[fd_count++] = server->local_socket;
+    for (int i = 0; i < count; i++) fds[fd_count++] = server->clients[paused[i]].socket;
+    if (send_header(peer, &header, fds, fd_count) != 0) return -1;
+
+    for (uint64_t seq = oldest; seq <= latest && header.history_frames; seq++) {
+        MessageInfo frame;
+        if (!history_get(&server->history, seq, &frame)) memset(&frame, 0, sizeof(frame));
+        if (send_all(peer, &frame, sizeof(frame)) != 0) return -1;
+    }
+    pthread_mutex_lock(&server->sessions.mutex);
+    int rc = send_all(peer, server->sessions.sessions, sizeof(server->sessions.sessions));
+    pthread_mutex_unlock(&server->sessions.mutex);
+    if (rc != 0) return -1;
+
+    for (int i = 0; i < count; i++) {
+        Client* c = &server->clients[paused[i]];
+        HandoffClient rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.client_id = c->client_id;
+        memcpy(rec.nickname, c->nickname, sizeof(rec.nickname));
+        rec.address = c->address;
+        rec.filter = c->filter;
+        rec.multicast = c->multicast;
+        rec.local = c->local;
+        rec.peer_uid = c->peer_uid;
+        rec.peer_pid = c->peer_pid;
+        rec.trusted = c->trusted;
+        rec.leaving = c->leaving;
+        rec.compress = outbox_compressing(c->outbox);
+        rec.queued = outbox_queued(c->outbox);
+        QueuedFrame* queued = rec.queued ? malloc((size_t)rec.queued * sizeof(QueuedFrame)) : NULL;
+        if (rec.queued && !queued) return -1;
+        rec.queued = outbox_export(c->outbox, queued, rec.queued, &rec.held_from);
+        rc = send_all(peer, &rec, sizeof(rec));
+        if (rc == 0 && rec.queued) rc = send_all(peer, queued, (size_t)rec.queued * sizeof(QueuedFrame));
+        free(queued);
+        if (rc != 0) return -1;
+    }
+    return 0;
+}
+
+static int hand_over(Handoff* h, SOCKET peer) {
+    ServerState* server = h->server;
+    int paused[MAX_CLIENTS];
+    int count = 0;
+    pthread_mutex_lock(&h->mutex);
+    h->pending = 1;
+    pthread_mutex_unlock(&h->mutex);
+    int rc = wait_parked(h);
+    if (rc != 0) print_error("Connections did not settle in time");
+    if (rc == 0) {
+        server_pause_background(server);
+        /* the readers are parked, so the table holds still without the
+         * lock; a writer may block on a full socket and must not hold it */
+        int candidates[MAX_CLIENTS];
+        int n = 0;
+        pthread_mutex_lock(&server->clients_mutex);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (server->clients[i].active && !server->clients[i].detached) candidates[n++] = i;
+        }
+        pthread_mutex_unlock(&server->clients_mutex);
+        for (int i = 0; i < n; i++) {
+            if (outbox_pause(server->clients[candidates[i]].outbox, HANDOFF_PAUSE_MS) == 0) paused[count++] = candidates[i];
+            else print_error("A client stopped reading, dropping it instead of handing it over");
+        }
+        struct timeval tv = {HANDOFF_ACK_MS / 1000, 0};
+        (void)setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        pthread_mutex_lock(&server->clients_mutex);
+        rc = send_state(h, peer, paused, count);
+        char ready = 0;
+        if (rc == 0 && (!wait_readable(peer, HANDOFF_ACK_MS) || recv(peer, &ready, 1, 0) != 1 || ready != HANDOFF_READY)) rc = -1;
+        if (rc == 0) {
+            printf("Handed " YELLOW "%d" RESET " connections to the new server process\n", count);
+            capture_close(server->capture);
+            fflush(stdout);
+            exit(0);
+        }
+        pthread_mutex_unlock(&server->clients_mutex);
+        for (int i = 0; i < count; i++) {
+            if (outbox_resume(server->clients[paused[i]].outbox) != 0) shutdown(server->clients[paused[i]].socket, SHUTDOWN_BOTH);
+        }
+        server_resume_background(server);
+    }
+    pthread_mutex_lock(&h->mutex);
+    h->pending = 0;
+    pthread_cond_broadcast(&h->resumed);
+    pthread_mutex_unlock(&h->mutex);
+    return -1;
+}
+
+static void* handoff_thread(void* arg) {
+    Handoff* h = arg;
+    for (;;) {
+        SOCKET peer = accept(h->listener, NULL, NULL);
+        if (peer == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        /* whoever connects gets every socket and the room state */
+        if (local_peer_uid(peer, NULL) != (int)geteuid()) {
+            print_error("Refused a handoff from another user");
+            CLOSE_SOCKET(peer);
+            continue;
+        }
+        print_system_message("A new server process is taking over");
+        (void)hand_over(h, peer);
+        print_error("Handoff failed, carrying on");
+        CLOSE_SOCKET(peer);
+    }
+    return NULL;
+}
+
+Handoff* handoff_listen(ServerState* server, const char* path) {
+    Handoff* h = calloc(1, sizeof(Handoff));
+    if (!h) return NULL;
+    h->server = server;
+    h->listener = open_local_listener(path);
+    if (h->listener == INVALID_SOCKET) goto fail;
+    if (chmod(path, 0600) != 0) {
+        print_error("Failed to restrict the handoff path");
+        goto fail_listener;
+    }
+    if (listen_socket(h->listener, 1) != 0) goto fail_listener;
+    if (pthread_mutex_init(&h->mutex, NULL) != 0) goto fail_listener;
+    if (pthread_cond_init(&h->resumed, NULL) != 0) goto fail_mutex;
+    if (pthread_create(&h->thread, NULL, handoff_thread, h) != 0) goto fail_cond;
+    pthread_detach(h->thread);
+    return h;
+fail_cond:
+    pthread_cond_destroy(&h->resumed);
+fail_mutex:
+    pthread_mutex_destroy(&h->mutex);
+fail_listener:
+    CLOSE_SOCKET(h->listener);
+fail:
+    free(h);
+    return NULL;
+}
+
+int handoff_pending(Handoff* h) {
+    return h && __atomic_load_n(&h->pending, __ATOMIC_RELAXED);
+}
+
+/* Holds the calling reader, or the accept loop, while a handoff runs. If
+ * it succeeds the process exits here. */
+void handoff_park(Handoff* h) {
+    if (!h) return;
+    pthread_mutex_lock(&h->mutex);
+    h->parked++;
+    while (h->pending) pthread_cond_wait(&h->resumed, &h->mutex);
+    h->parked--;
+    pthread_mutex_unlock(&h->mutex);
+}
+
+static void free_takeover(Takeover* t) {
+    for (int i = 0; i < MAX_CLIENTS; i++) free(t->queued[i]);
+    free(t->history);
+    free(t);
+}
+
+/* Returns 1 with *out set if a running server handed over, 0 if nobody
+ * answered on path, -1 if one did but the handoff failed. */
+int handoff_request(const char* path, Takeover** out) {
+    struct sockaddr_un addr;
+    *out = NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        print_error("Handoff socket path is too long");
+        return -1;
+    }
+    memcpy(addr.sun_path, path, strlen(path));
+    SOCKET peer = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (peer == INVALID_SOCKET) return -1;
+    if (connect(peer, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        CLOSE_SOCKET(peer);
+        return 0;
+    }
+    struct timeval tv = {(HANDOFF_PARK_MS + HANDOFF_ACK_MS) / 1000, 0};
+    (void)setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    print_system_message("Taking over from the running server...");
+
+    Takeover* t = calloc(1, sizeof(Takeover));
+    if (!t) {
+        CLOSE_SOCKET(peer);
+        return -1;
+    }
+    t->peer = peer;
+    const HandoffHeader* hd = &t->header;
+    if (recv_header(t) != 0) goto fail;
+    if (memcmp(hd->magic, HANDOFF_MAGIC, sizeof(hd->magic)) != 0 || hd->version != HANDOFF_VERSION ||
+        hd->frame_size != sizeof(MessageInfo) || hd->client_size != sizeof(HandoffClient)) {
+        print_error("The running server is an incompatible build");
+        goto fail;
+    }
+    if (hd->clients < 0 || hd->clients > MAX_CLIENTS || hd->history_frames > HISTORY_LEN ||
+        t->fd_count != 1 + (hd->has_local ? 1 : 0) + hd->clients) {
+        print_error("Malformed handoff from the running server");
+        goto fail;
+    }
+    t->history = calloc(hd->history_frames ? hd->history_frames : 1, sizeof(MessageInfo));
+    if (!t->history || recv_all(peer, t->history, hd->history_frames * sizeof(MessageInfo)) != 0) goto fail;
+    if (recv_all(peer, t->sessions, sizeof(t->sessions)) != 0) goto fail;
+    for (int i = 0; i < hd->clients; i++) {
+        HandoffClient* rec = &t->clients[i];
+        if (recv_all(peer, rec, sizeof(*rec)) != 0) goto fail;
+        if (rec->queued < 0 || rec->queued > 4 * (HISTORY_LEN + 512)) goto fail;
+        if (!rec->queued) continue;
+        t->queued[i] = malloc((size_t)rec->queued * sizeof(QueuedFrame));
+        if (!t->queued[i] || recv_all(peer, t->queued[i], (size_t)rec->queued * sizeof(QueuedFrame)) != 0) goto fail;
+    }
+    *out = t;
+    return 1;
+fail:
+    print_error("Handoff from the running server failed");
+    handoff_abandon(t);
+    return -1;
+}
+
+/* Puts the handed-over listeners, room state and connections in place on a
+ * freshly initialized server; the caller starts their readers. */
+int handoff_restore(ServerState* server, Takeover* t) {
+    const HandoffHeader* hd = &t->header;
+    int next_fd = 0;
+    server->server_socket = t->fds[next_fd];
+    t->fds[next_fd++] = -1;
+    if (hd->has_local) {
+        server->local_socket = t->fds[next_fd];
+        t->fds[next_fd++] = -1;
+        memcpy(server->local_path, hd->local_path, sizeof(server->local_path));
+        server->local_path[sizeof(server->local_path) - 1] = '\0';
+    }
+    History* history = &server->history;
+    pthread_mutex_lock(&history->mutex);
+    history->next_seq = hd->next_seq;
+    history->epoch = hd->epoch;
+    for (uint32_t i = 0; i < hd->history_frames; i++) {
+        uint64_t seq = hd->next_seq - hd->history_frames + i;
+        history->frames[seq % HISTORY_LEN] = t->history[i];
+    }
+    pthread_mutex_unlock(&history->mutex);
+
+    pthread_mutex_lock(&server->sessions.mutex);
+    memcpy(server->sessions.sessions, t->sessions, sizeof(t->sessions));
+    pthread_mutex_unlock(&server->sessions.mutex);
+    for (int i = 0; i < SESSION_MAX; i++) {
+        const Session* s = &t->sessions[i];
+        if (s->in_use && s->held) roster_upsert(&server->roster, s->client_id, s->nickname);
+    }
+
+    for (int i = 0; i < hd->clients; i++) {
+        const HandoffClient* rec = &t->clients[i];
+        SOCKET sock = t->fds[next_fd];
+        t->fds[next_fd++] = -1;
+        int index = add_client(server, sock, rec->address);
+        if (index < 0) {
+            CLOSE_SOCKET(sock);
+            continue;
+        }
+        pthread_mutex_lock(&server->clients_mutex);
+        Client* c = &server->clients[index];
+        c->client_id = rec->client_id;
+        memcpy(c->nickname, rec->nickname, sizeof(c->nickname));
+        c->nickname[sizeof(c->nickname) - 1] = '\0';
+        c->filter = rec->filter;
+        c->multicast = rec->multicast;
+        c->local = rec->local;
+        c->peer_uid = rec->peer_uid;
+        c->peer_pid = rec->peer_pid;
+        c->trusted = rec->trusted;
+        c->leaving = rec->leaving;
+        c->adopted = 1;
+        outbox_set_compression(c->outbox, rec->compress);
+        outbox_import(c->outbox, t->queued[i], rec->queued, rec->held_from);
+        pthread_mutex_unlock(&server->clients_mutex);
+        if (strcmp(c->nickname, "Anonymous") != 0) roster_upsert(&server->roster, c->client_id, c->nickname);
+    }
+    server->next_client_id = hd->next_client_id;
+    return 0;
+}
+
+/* Tells the old process this one is running and waits for it to exit,
+ * which frees the handoff path for handoff_listen. */
+void handoff_complete(Takeover* t) {
+    char ready = HANDOFF_READY;
+    char eof;
+    if (send_all(t->peer, &ready, 1) != 0 || !wait_readable(t->peer, HANDOFF_ACK_MS) || recv(t->peer, &eof, 1, 0) != 0) {
+        print_error("The previous server process did not exit");
+    }
+    CLOSE_SOCKET(t->peer);
+    free_takeover(t);
+}
+
+/* Drops a takeover before completing it; the old process carries on. */
+void handoff_abandon(Takeover* t) {
+    if (!t) return;
+    for (int i = 0; i < t->fd_count; i++) {
+        if (t->fds[i] >= 0) CLOSE_SOCKET(t->fds[i]);
+    }
+    CLOSE_SOCKET(t->peer);
+    free_takeover(t);
+}
+
+#else
+
+Handoff* handoff_listen(ServerState* server, const char* path) {
+    (void)server; (void)path;
+    print_error("Hot restart is not supported on this platform");
+    return NULL;
+}
+
+int handoff_pending(Handoff* h) {
+    (void)h;
+    return 0;
+}
+
+void handoff_park(Handoff* h) {
+    (void)h;
+}
+
+int handoff_request(const char* path, Takeover** out) {
+    (void)path;
+    *out = NULL;
+    return 0;
+}
+
+int handoff_restore(ServerState* server, Takeover* t) {
+    (void)server; (void)t;
+    return -1;
+}
+
+void handoff_complete(Takeover* t) {
+    (void)t;
+}
+
+void handoff_abandon(Takeover* t) {
+    (void)t;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#include "../../include/common.h"
+
+/*
+ * Room history: the last HISTORY_LEN broadcast frames, indexed by their
+ * room sequence number. Sequence numbers start at 1 so that 0 can mean
+ * "not a room frame" / "nothing seen yet". The epoch is picked at start-up
+ * so a client can tell whether sequence numbers it cached came from this
+ * server run.
+ */
+
+int history_init(History* history) {
+    memset(history, 0, sizeof(*history));
+    history->frames = calloc(HISTORY_LEN, sizeof(MessageInfo));
+    if (!history->frames) return -1;
+    history->next_seq = 1;
+    history->epoch = ((uint64_t)time(NULL) << 32) ^ monotonic_ns();
+    if (pthread_mutex_init(&history->mutex, NULL) != 0) {
+        free(history->frames);
+        history->frames = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void history_destroy(History* history) {
+    pthread_mutex_destroy(&history->mutex);
+    free(history->frames);
+    history->frames = NULL;
+}
+
+uint64_t history_append(History* history, MessageInfo* msg) {
+    pthread_mutex_lock(&history->mutex);
+    msg->seq = history->next_seq++;
+    history->frames[msg->seq % HISTORY_LEN] = *msg;
+    /* a replayed frame is not timed against stamps taken when it was live */
+    history->frames[msg->seq % HISTORY_LEN].flags &= ~MSG_FLAG_TRACE;
+    pthread_mutex_unlock(&history->mutex);
+    return msg->seq;
+}
+
+int history_get(History* history, uint64_t seq, MessageInfo* out) {
+    int found = 0;
+    pthread_mutex_lock(&history->mutex);
+    if (seq > 0 && seq < history->next_seq && history->next_seq - seq <= HISTORY_LEN) {
+        *out = history->frames[seq % HISTORY_LEN];
+        found = 1;
+    }
+    pthread_mutex_unlock(&history->mutex);
+    return found;
+}
+
+void history_bounds(History* history, uint64_t* oldest, uint64_t* latest) {
+    pthread_mutex_lock(&history->mutex);
+    uint64_t last = history->next_seq - 1;
+    if (latest) *latest = last;
+    if (oldest) *oldest = last >= HISTORY_LEN ? last - HISTORY_LEN + 1 : 1;
+    pthread_mutex_unlock(&history->mutex);
+}
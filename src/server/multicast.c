@@ -0,0 +1,102 @@
+#include "../../include/common.h"
+
+/*
+ * Multicast room fan-out for LAN deployments. Each room frame is sent once
+ * as a datagram to the group, already carrying its history seq, instead of
+ * once per client over TCP. Clients that subscribed get no unicast copy.
+ * They put the datagrams back in seq order themselves and ask for any gap
+ * over their TCP connection (MCAST_NACK); the repair comes from history.
+ *
+ * One group serves one server process: seqs are per process, so servers
+ * sharing a bus must each use their own group or port.
+ */
+
+struct Multicast {
+    SOCKET sock;
+    struct sockaddr_in group;
+    char address[INET_ADDRSTRLEN];
+    unsigned long long datagrams;
+    unsigned long long errors;
+    unsigned long long nacks;
+    unsigned long long repaired;
+    unsigned long long lost;
+};
+
+Multicast* multicast_open(const char* spec, const char* iface) {
+    char address[INET_ADDRSTRLEN] = {0};
+    int port = 0;
+    const char* colon = strrchr(spec, ':');
+    if (!colon || (size_t)(colon - spec) >= sizeof(address) || (port = atoi(colon + 1)) <= 0 || port > 65535) {
+        print_error("Multicast group must be given as address:port");
+        return NULL;
+    }
+    memcpy(address, spec, (size_t)(colon - spec));
+    Multicast* m = calloc(1, sizeof(Multicast));
+    if (!m) return NULL;
+    m->group.sin_family = AF_INET;
+    m->group.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, address, &m->group.sin_addr) <= 0 || (ntohl(m->group.sin_addr.s_addr) >> 28) != 0xE) {
+        print_error("Invalid multicast group address");
+        goto fail;
+    }
+    memcpy(m->address, address, sizeof(m->address));
+    m->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (m->sock == INVALID_SOCKET) {
+        print_error("Failed to create multicast socket");
+        goto fail;
+    }
+    int ttl = 1; /* the room never leaves the local network */
+    int loop = 1;
+    (void)setsockopt(m->sock, IPPROTO_IP, IP_MULTICAST_TTL, (char*)&ttl, sizeof(ttl));
+    (void)setsockopt(m->sock, IPPROTO_IP, IP_MULTICAST_LOOP, (char*)&loop, sizeof(loop));
+    if (iface) {
+        struct in_addr out;
+        if (inet_pton(AF_INET, iface, &out) <= 0 ||
+            setsockopt(m->sock, IPPROTO_IP, IP_MULTICAST_IF, (char*)&out, sizeof(out)) != 0) {
+            print_error("Failed to select the multicast interface");
+            CLOSE_SOCKET(m->sock);
+            goto fail;
+        }
+    }
+    return m;
+fail:
+    free(m);
+    return NULL;
+}
+
+void multicast_close(Multicast* m) {
+    if (!m) return;
+    CLOSE_SOCKET(m->sock);
+    free(m);
+}
+
+/* Fills an MCAST_OFFER frame that tells a client where to listen. */
+void multicast_offer(const Multicast* m, MessageInfo* offer) {
+    snprintf(offer->message, sizeof(offer->message), "%s", m->address);
+    offer->count = ntohs(m->group.sin_port);
+}
+
+/* Called with clients_mutex held, so a subscription can't land between
+ * the datagram and the unicast copies it replaces. */
+int multicast_publish(Multicast* m, const MessageInfo* msg) {
+    int n = sendto(m->sock, (const char*)msg, (int)sizeof(MessageInfo), 0, (struct sockaddr*)&m->group, sizeof(m->group));
+    if (n != (int)sizeof(MessageInfo)) {
+        m->errors++;
+        return -1;
+    }
+    m->datagrams++;
+    return 0;
+}
+
+void multicast_note_repair(Multicast* m, int repaired, int lost) {
+    __atomic_add_fetch(&m->nacks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->repaired, (unsigned long long)repaired, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->lost, (unsigned long long)lost, __ATOMIC_RELAXED);
+}
+
+void multicast_print_stats(Multicast* m) {
+    if (!m) return;
+    printf(CYAN "=== Multicast %s:%d ===" RESET "\n", m->address, ntohs(m->group.sin_port));
+    printf("datagrams %llu, send errors %llu, NACKs %llu, frames repaired %llu, beyond history %llu\n",
+           m->datagrams, m->errors, m->nacks, m->repaired, m->lost);
+}
@@ -0,0 +1,488 @@
+#include "../../include/common.h"
+#include <stddef.h>
+
+/*
+ * Per-connection outbound queues. Every frame to a client is queued on one
+ * of four lanes and written by that connection's writer thread, and a
+ * producer never waits for the socket. The writer always
+ * drains the control lane first; private, chat and history share what is
+ * left 4:2:1 by weighted round robin. A rename result or a pong therefore
+ * waits behind at most one flush batch, however deep the chat backlog is.
+ *
+ * Room frames must keep their sequence order, so while a history replay is
+ * still queued, live chat for that client joins the history lane behind it.
+ *
+ * Producers often hold clients_mutex, so a full lane never blocks them. A
+ * room frame that finds the chat or history lane full is dropped and
+ * counted; the client sees the gap in sequence numbers. A full control or
+ * private lane cannot lose frames silently, so the connection is shut down
+ * and its reader removes the client.
+ *
+ * For a connection that asked for compression, a slot holds the packed
+ * bytes instead of the frame (packed[] gives their length, 0 for plain).
+ * Broadcasts are packed once by the caller and the bytes are shared.
+ */
+
+static const int lane_depth[OUTBOX_LANES] = {32, 64, 256, HISTORY_LEN + 8};
+static const int lane_weight[OUTBOX_LANES] = {0, 4, 2, 1};
+static const char* const lane_name[OUTBOX_LANES] = {"control", "private", "chat", "history"};
+
+typedef struct {
+    MessageInfo* frames;
+    uint16_t* packed;
+    uint64_t* queued_ns;
+    int head;
+    int count;
+    unsigned long long sent;
+    unsigned long long dropped;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+} Lane;
+
+struct Outbox {
+    ServerState* server;
+    int client_index;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t space;
+    Lane lanes[OUTBOX_LANES];
+    int credit[OUTBOX_LANES];
+    int attached;
+    int running;
+    int failed;
+    int inflight;
+    uint64_t held_from;
+    int compress;
+    SOCKET socket;
+};
+
+/* The lane is part of the protocol schema in common.h. */
+int outbox_lane_for(int type) {
+    return type > 0 && type < MSG_TYPE_COUNT ? message_schema[type].lane : OUTBOX_CONTROL;
+}
+
+static void clear_lanes(Outbox* box) {
+    for (int i = 0; i < OUTBOX_LANES; i++) {
+        box->lanes[i].head = 0;
+        box->lanes[i].count = 0;
+        box->credit[i] = lane_weight[i];
+    }
+}
+
+/* Called with box->mutex held and at least one frame queued. */
+static int next_lane(Outbox* box) {
+    if (box->lanes[OUTBOX_CONTROL].count > 0) return OUTBOX_CONTROL;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = OUTBOX_PRIVATE; i < OUTBOX_LANES; i++) {
+            if (box->lanes[i].count > 0 && box->credit[i] > 0) {
+                box->credit[i]--;
+                return i;
+            }
+        }
+        for (int i = OUTBOX_PRIVATE; i < OUTBOX_LANES; i++) box->credit[i] = lane_weight[i];
+    }
+    return -1;
+}
+
+static int frames_queued(const Outbox* box) {
+    int n = 0;
+    for (int i = 0; i < OUTBOX_LANES; i++) n += box->lanes[i].count;
+    return n;
+}
+
+static void deadline_after(struct timespec* deadline, int ms) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static int send_all(SOCKET sock, const char* buf, size_t len) {
+    while (len > 0) {
+        int n = send(sock, buf, (int)len, 0);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void* writer_thread(void* arg) {
+    Outbox* box = arg;
+    Client* c = &box->server->clients[box->client_index];
+    unsigned char batch[OUTBOX_FLUSH_FRAMES * sizeof(MessageInfo)];
+    size_t traced[OUTBOX_FLUSH_FRAMES];
+    size_t trace_at = offsetof(MessageInfo, trace) + TRACE_SERVER_FLUSH * sizeof(uint64_t);
+    pthread_mutex_lock(&box->mutex);
+    for (;;) {
+        while (box->attached && (box->failed || frames_queued(box) == 0)) pthread_cond_wait(&box->work, &box->mutex);
+        if (!box->attached) break;
+        int n = 0, n_traced = 0;
+        size_t bytes = 0;
+        uint64_t now = monotonic_ns();
+        while (n < OUTBOX_FLUSH_FRAMES && frames_queued(box) > 0) {
+            int li = next_lane(box);
+            Lane* lane = &box->lanes[li];
+            uint64_t waited = now - lane->queued_ns[lane->head];
+            const MessageInfo* frame = &lane->frames[lane->head];
+            size_t len = lane->packed[lane->head] ? lane->packed[lane->head] : sizeof(MessageInfo);
+            /* traced frames are never packed */
+            if (!lane->packed[lane->head] && (frame->flags & MSG_FLAG_TRACE)) traced[n_traced++] = bytes;
+            memcpy(batch + bytes, frame, len);
+            bytes += len;
+            n++;
+            lane->head = (lane->head + 1) % lane_depth[li];
+            lane->count--;
+            lane->sent++;
+            lane->wait_ns += waited;
+            if (waited > lane->max_wait_ns) lane->max_wait_ns = waited;
+        }
+        box->inflight = 1;
+        SOCKET sock = box->socket;
+        pthread_cond_broadcast(&box->space);
+        pthread_mutex_unlock(&box->mutex);
+
+        uint64_t flush = monotonic_ns();
+        for (int i = 0; i < n_traced; i++) memcpy(batch + traced[i] + trace_at, &flush, sizeof(flush));
+        pthread_mutex_lock(&c->send_mutex);
+        int rc = send_all(sock, (const char*)batch, bytes);
+        pthread_mutex_unlock(&c->send_mutex);
+        if (rc == 0 && n_traced > 0) {
+            uint64_t sent = monotonic_ns();
+            for (int i = 0; i < n_traced; i++) {
+                uint64_t stamps[TRACE_STAMPS];
+                memcpy(stamps, batch + traced[i] + offsetof(MessageInfo, trace), sizeof(stamps));
+                stats_record_flush(&box->server->stats, stamps, sent);
+            }
+        }
+
+        pthread_mutex_lock(&box->mutex);
+        box->inflight = 0;
+        if (rc != 0 && !box->failed) {
+            /* the reader notices the shutdown and removes the client */
+            box->failed = 1;
+            clear_lanes(box);
+            shutdown(sock, SHUTDOWN_BOTH);
+        }
+        pthread_cond_broadcast(&box->space);
+    }
+    box->running = 0;
+    pthread_cond_broadcast(&box->space);
+    pthread_mutex_unlock(&box->mutex);
+    return NULL;
+}
+
+Outbox* outbox_create(ServerState* server, int client_index) {
+    Outbox* box = calloc(1, sizeof(Outbox));
+    if (!box) return NULL;
+    box->server = server;
+    box->client_index = client_index;
+    int lanes = 0;
+    for (; lanes < OUTBOX_LANES; lanes++) {
+        box->lanes[lanes].frames = malloc((size_t)lane_depth[lanes] * sizeof(MessageInfo));
+        box->lanes[lanes].packed = malloc((size_t)lane_depth[lanes] * sizeof(uint16_t));
+        box->lanes[lanes].queued_ns = malloc((size_t)lane_depth[lanes] * sizeof(uint64_t));
+        if (!box->lanes[lanes].frames || !box->lanes[lanes].packed || !box->lanes[lanes].queued_ns) {
+            lanes++;
+            goto fail_lanes;
+        }
+    }
+    if (pthread_mutex_init(&box->mutex, NULL) != 0) goto fail_lanes;
+    if (pthread_cond_init(&box->work, NULL) != 0) goto fail_work;
+    if (pthread_cond_init(&box->space, NULL) != 0) goto fail_space;
+    clear_lanes(box);
+    return box;
+fail_space:
+    pthread_cond_destroy(&box->work);
+fail_work:
+    pthread_mutex_destroy(&box->mutex);
+fail_lanes:
+    while (lanes-- > 0) {
+        free(box->lanes[lanes].frames);
+        free(box->lanes[lanes].packed);
+        free(box->lanes[lanes].queued_ns);
+    }
+    free(box);
+    return NULL;
+}
+
+void outbox_destroy(Outbox* box) {
+    if (!box) return;
+    outbox_detach(box);
+    pthread_cond_destroy(&box->space);
+    pthread_cond_destroy(&box->work);
+    pthread_mutex_destroy(&box->mutex);
+    for (int i = 0; i < OUTBOX_LANES; i++) {
+        free(box->lanes[i].frames);
+        free(box->lanes[i].packed);
+        free(box->lanes[i].queued_ns);
+    }
+    free(box);
+}
+
+int outbox_attach(Outbox* box, SOCKET sock) {
+    pthread_mutex_lock(&box->mutex);
+    clear_lanes(box);
+    box->socket = sock;
+    box->failed = 0;
+    box->compress = 0;
+    box->held_from = 0;
+    box->attached = 1;
+    box->running = 1;
+    pthread_mutex_unlock(&box->mutex);
+    if (pthread_create(&box->thread, NULL, writer_thread, box) != 0) {
+        pthread_mutex_lock(&box->mutex);
+        box->attached = 0;
+        box->running = 0;
+        pthread_mutex_unlock(&box->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stops the writer and discards anything still queued. The socket is not
+ * closed; the caller closes it once the writer is gone. */
+void outbox_detach(Outbox* box) {
+    pthread_mutex_lock(&box->mutex);
+    if (!box->attached) {
+        pthread_mutex_unlock(&box->mutex);
+        return;
+    }
+    box->attached = 0;
+    if (box->inflight) shutdown(box->socket, SHUTDOWN_BOTH); /* don't wait on a peer that stopped reading */
+    pthread_cond_broadcast(&box->work);
+    pthread_cond_broadcast(&box->space);
+    pthread_mutex_unlock(&box->mutex);
+    pthread_join(box->thread, NULL);
+    pthread_mutex_lock(&box->mutex);
+    clear_lanes(box);
+    pthread_mutex_unlock(&box->mutex);
+}
+
+/* Stops the writer once its current batch is out, keeping everything still
+ * queued; for a hot restart, which carries the queue over or resumes. If
+ * the batch is not out within timeout_ms the peer has stopped reading:
+ * the connection is shut down, its queue dropped, and -1 returned. */
+int outbox_pause(Outbox* box, int timeout_ms) {
+    struct timespec deadline;
+    deadline_after(&deadline, timeout_ms);
+    int rc = 0;
+    pthread_mutex_lock(&box->mutex);
+    if (!box->attached) {
+        pthread_mutex_unlock(&box->mutex);
+        return 0;
+    }
+    box->attached = 0;
+    pthread_cond_broadcast(&box->work);
+    pthread_cond_broadcast(&box->space);
+    while (box->running) {
+        if (pthread_cond_timedwait(&box->space, &box->mutex, &deadline) != 0 && box->running) {
+            rc = -1;
+            box->failed = 1;
+            clear_lanes(box);
+            shutdown(box->socket, SHUTDOWN_BOTH); /* fails the send it is stuck in */
+            break;
+        }
+    }
+    pthread_mutex_unlock(&box->mutex);
+    pthread_join(box->thread, NULL);
+    return rc;
+}
+
+int outbox_resume(Outbox* box) {
+    pthread_mutex_lock(&box->mutex);
+    box->attached = 1;
+    box->running = 1;
+    pthread_mutex_unlock(&box->mutex);
+    if (pthread_create(&box->thread, NULL, writer_thread, box) != 0) {
+        pthread_mutex_lock(&box->mutex);
+        box->attached = 0;
+        box->running = 0;
+        pthread_mutex_unlock(&box->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+int outbox_queued(Outbox* box) {
+    pthread_mutex_lock(&box->mutex);
+    int n = frames_queued(box);
+    pthread_mutex_unlock(&box->mutex);
+    return n;
+}
+
+/* Copies up to cap queued frames, lane by lane in queue order, and the
+ * first room frame held back, if any. */
+int outbox_export(Outbox* box, QueuedFrame* out, int cap, uint64_t* held_from) {
+    int n = 0;
+    pthread_mutex_lock(&box->mutex);
+    *held_from = box->held_from;
+    for (int i = 0; i < OUTBOX_LANES; i++) {
+        Lane* l = &box->lanes[i];
+        for (int k = 0; k < l->count && n < cap; k++, n++) {
+            int slot = (l->head + k) % lane_depth[i];
+            out[n].lane = (uint16_t)i;
+            out[n].packed = l->packed[slot];
+            out[n].frame = l->frames[slot];
+        }
+    }
+    pthread_mutex_unlock(&box->mutex);
+    return n;
+}
+
+/* Queues the frame, or its packed bytes if len > 0; seq is its room
+ * sequence, 0 for anything else. Once a full lane drops a room frame, the
+ * later ones are held back as well, so the client misses one contiguous
+ * run that outbox_take_gap hands out for a refill from history. Other
+ * frames queued behind the room frames on the chat lane are held back with
+ * them. Returns 1 if the frame was dropped or held back, -1 if the
+ * connection is failing or gone. */
+static int push_frame(Outbox* box, int lane, uint64_t seq, const MessageInfo* msg, const unsigned char* packed, size_t len) {
+    int rc = 0;
+    int behind_room = lane == OUTBOX_CHAT && seq == 0;
+    pthread_mutex_lock(&box->mutex);
+    if (lane == OUTBOX_CHAT && box->lanes[OUTBOX_HISTORY].count > 0) lane = OUTBOX_HISTORY;
+    Lane* l = &box->lanes[lane];
+    int room = seq > 0 && (lane == OUTBOX_CHAT || lane == OUTBOX_HISTORY);
+    if (!box->attached || box->failed) {
+        rc = -1;
+    } else if (box->held_from && ((room && seq >= box->held_from) || behind_room)) {
+        l->dropped++;
+        rc = 1;
+    } else if (l->count == lane_depth[lane]) {
+        l->dropped++;
+        rc = 1;
+        if (room) {
+            if (!box->held_from || seq < box->held_from) box->held_from = seq;
+        } else if (lane != OUTBOX_CHAT && lane != OUTBOX_HISTORY) {
+            box->failed = 1;
+            clear_lanes(box);
+            shutdown(box->socket, SHUTDOWN_BOTH);
+            rc = -1;
+        }
+    } else {
+        int tail = (l->head + l->count) % lane_depth[lane];
+        if (len) memcpy(&l->frames[tail], packed, len);
+        else l->frames[tail] = *msg;
+        l->packed[tail] = (uint16_t)len;
+        l->queued_ns[tail] = monotonic_ns();
+        l->count++;
+        pthread_cond_signal(&box->work);
+    }
+    pthread_mutex_unlock(&box->mutex);
+    return rc;
+}
+
+/* The first room frame held back after a full lane, once the chat and
+ * history lanes have drained, or 0. The caller refills from there. */
+uint64_t outbox_take_gap(Outbox* box) {
+    uint64_t seq = 0;
+    pthread_mutex_lock(&box->mutex);
+    if (box->held_from && box->lanes[OUTBOX_CHAT].count == 0 && box->lanes[OUTBOX_HISTORY].count == 0) {
+        seq = box->held_from;
+        box->held_from = 0;
+    }
+    pthread_mutex_unlock(&box->mutex);
+    return seq;
+}
+
+static int wants_packed(Outbox* box, const MessageInfo* msg) {
+    return __atomic_load_n(&box->compress, __ATOMIC_RELAXED) && !(msg->flags & MSG_FLAG_TRACE);
+}
+
+static size_t pack_frame(Outbox* box, const MessageInfo* msg, unsigned char* out) {
+    uint64_t start = monotonic_ns();
+    size_t len = wire_pack(msg, out);
+    stats_record_pack(&box->server->stats, len ? out[0] : 0, len, monotonic_ns() - start);
+    return len;
+}
+
+/* A multicast reply's seq is a position in the room, not its own. */
+static uint64_t room_seq(const MessageInfo* msg) {
+    return msg->type == MSG_TYPE_MULTICAST ? 0 : msg->seq;
+}
+
+int outbox_push(Outbox* box, int lane, const MessageInfo* msg) {
+    unsigned char packed[sizeof(MessageInfo)];
+    size_t len = wants_packed(box, msg) ? pack_frame(box, msg, packed) : 0;
+    if (len) __atomic_add_fetch(&box->server->stats.packed_sends, 1, __ATOMIC_RELAXED);
+    return push_frame(box, lane, room_seq(msg), msg, packed, len);
+}
+
+/* Like outbox_push, but packs into *packed only the first time a
+ * connection needs it, so a broadcast is compressed once in all. */
+int outbox_push_packed(Outbox* box, int lane, const MessageInfo* msg, PackedFrame* packed) {
+    if (!wants_packed(box, msg)) return push_frame(box, lane, room_seq(msg), msg, NULL, 0);
+    if (!packed->done) {
+        packed->len = pack_frame(box, msg, packed->bytes);
+        packed->done = 1;
+    }
+    if (packed->len) __atomic_add_fetch(&box->server->stats.packed_sends, 1, __ATOMIC_RELAXED);
+    return push_frame(box, lane, room_seq(msg), msg, packed->bytes, packed->len);
+}
+
+/* Queues what outbox_export gave, before anything else is queued. */
+void outbox_import(Outbox* box, const QueuedFrame* frames, int count, uint64_t held_from) {
+    for (int i = 0; i < count; i++) {
+        if (frames[i].lane >= OUTBOX_LANES || frames[i].packed > sizeof(MessageInfo)) continue;
+        (void)push_frame(box, frames[i].lane, 0, &frames[i].frame, (const unsigned char*)&frames[i].frame, frames[i].packed);
+    }
+    pthread_mutex_lock(&box->mutex);
+    box->held_from = held_from;
+    pthread_mutex_unlock(&box->mutex);
+}
+
+/* Frames queued from now on are packed; the client reads both kinds. */
+void outbox_set_compression(Outbox* box, int on) {
+    pthread_mutex_lock(&box->mutex);
+    box->compress = on;
+    pthread_mutex_unlock(&box->mutex);
+}
+
+int outbox_compressing(Outbox* box) {
+    return __atomic_load_n(&box->compress, __ATOMIC_RELAXED);
+}
+
+/* Waits up to timeout_ms until every control frame queued so far is on
+ * the wire, for callers that write to the socket directly and must not
+ * overtake them. Returns -1 if they are still queued. */
+int outbox_sync(Outbox* box, int timeout_ms) {
+    struct timespec deadline;
+    deadline_after(&deadline, timeout_ms);
+    int rc = 0;
+    pthread_mutex_lock(&box->mutex);
+    while (box->attached && !box->failed && (box->lanes[OUTBOX_CONTROL].count > 0 || box->inflight)) {
+        if (pthread_cond_timedwait(&box->space, &box->mutex, &deadline) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&box->mutex);
+    return rc;
+}
+
+void outbox_print_stats(ServerState* server) {
+    unsigned long long sent[OUTBOX_LANES] = {0}, dropped[OUTBOX_LANES] = {0};
+    uint64_t wait_ns[OUTBOX_LANES] = {0}, max_wait_ns[OUTBOX_LANES] = {0};
+    for (int c = 0; c < MAX_CLIENTS; c++) {
+        Outbox* box = server->clients[c].outbox;
+        if (!box) continue;
+        pthread_mutex_lock(&box->mutex);
+        for (int i = 0; i < OUTBOX_LANES; i++) {
+            sent[i] += box->lanes[i].sent;
+            dropped[i] += box->lanes[i].dropped;
+            wait_ns[i] += box->lanes[i].wait_ns;
+            if (box->lanes[i].max_wait_ns > max_wait_ns[i]) max_wait_ns[i] = box->lanes[i].max_wait_ns;
+        }
+        pthread_mutex_unlock(&box->mutex);
+    }
+    printf(CYAN "=== Outbound lanes ===" RESET "\n");
+    for (int i = 0; i < OUTBOX_LANES; i++) {
+        printf("%-8s sent %llu, queued mean %.1f us, max %.1f us, dropped when full %llu\n", lane_name[i], sent[i],
+               sent[i] ? wait_ns[i] / 1000.0 / (double)sent[i] : 0.0, max_wait_ns[i] / 1000.0, dropped[i]);
+    }
+}
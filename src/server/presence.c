@@ -0,0 +1,175 @@
+#include "../../include/common.h"
+
+/*
+ * Presence events are coalesced per client id until the flusher collects
+ * them: join+leave in one window cancels out, join+rename is a join under
+ * the new name, rename+leave is a leave under the old name, and a chain of
+ * renames collapses to its first and last names. Each id has at most one
+ * pending entry, so the batch never holds more than the clients that were
+ * present at the start of the window plus those that joined during it.
+ */
+
+static void safe_strcpy(char* dst, const char* src, size_t cap) {
+    if (!dst || !cap) return;
+    if (!src) { dst[0] = '\0'; return; }
+    strncpy(dst, src, cap - 1);
+    dst[cap - 1] = '\0';
+}
+
+static PresenceEvent* presence_find(PresenceBatch* batch, int client_id) {
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->pending[i].client_id == client_id) return &batch->pending[i];
+    }
+    return NULL;
+}
+
+static void presence_drop(PresenceBatch* batch, PresenceEvent* ev) {
+    int pos = (int)(ev - batch->pending);
+    memmove(&batch->pending[pos], &batch->pending[pos + 1], (size_t)(batch->count - pos - 1) * sizeof(PresenceEvent));
+    batch->count--;
+}
+
+static void presence_add(PresenceBatch* batch, int client_id, int kind, const char* old_nick, const char* nick) {
+    if (batch->count >= PRESENCE_MAX_PENDING) {
+        print_error("Presence batch full, event dropped");
+        return;
+    }
+    PresenceEvent* ev = &batch->pending[batch->count++];
+    ev->client_id = client_id;
+    ev->kind = kind;
+    safe_strcpy(ev->old_nick, old_nick, sizeof(ev->old_nick));
+    safe_strcpy(ev->nick, nick, sizeof(ev->nick));
+    pthread_cond_signal(&batch->cond);
+}
+
+int presence_init(PresenceBatch* batch) {
+    memset(batch, 0, sizeof(*batch));
+    if (pthread_mutex_init(&batch->mutex, NULL) != 0) return -1;
+    if (pthread_cond_init(&batch->cond, NULL) != 0) {
+        pthread_mutex_destroy(&batch->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+/* Wakes the flusher out of presence_collect and waits until it has left,
+ * so the batch can be destroyed under it. */
+void presence_close(PresenceBatch* batch) {
+    pthread_mutex_lock(&batch->mutex);
+    batch->closed = 1;
+    pthread_cond_broadcast(&batch->cond);
+    while (batch->collecting > 0) pthread_cond_wait(&batch->cond, &batch->mutex);
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+/* Lets a closed batch be collected again; events queued meanwhile wait. */
+void presence_reopen(PresenceBatch* batch) {
+    pthread_mutex_lock(&batch->mutex);
+    batch->closed = 0;
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+void presence_destroy(PresenceBatch* batch) {
+    pthread_cond_destroy(&batch->cond);
+    pthread_mutex_destroy(&batch->mutex);
+}
+
+void presence_joined(PresenceBatch* batch, int client_id, const char* nick) {
+    pthread_mutex_lock(&batch->mutex);
+    PresenceEvent* ev = presence_find(batch, client_id);
+    if (!ev) {
+        presence_add(batch, client_id, PRESENCE_JOINED, "", nick);
+    } else if (ev->kind == PRESENCE_JOINED) {
+        safe_strcpy(ev->nick, nick, sizeof(ev->nick));
+    } else {
+        ev->kind = PRESENCE_RENAMED;
+        safe_strcpy(ev->nick, nick, sizeof(ev->nick));
+        if (strcmp(ev->old_nick, ev->nick) == 0) presence_drop(batch, ev);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+void presence_left(PresenceBatch* batch, int client_id, const char* nick) {
+    pthread_mutex_lock(&batch->mutex);
+    PresenceEvent* ev = presence_find(batch, client_id);
+    if (!ev) {
+        presence_add(batch, client_id, PRESENCE_LEFT, nick, nick);
+    } else if (ev->kind == PRESENCE_JOINED) {
+        presence_drop(batch, ev);
+    } else if (ev->kind == PRESENCE_RENAMED) {
+        ev->kind = PRESENCE_LEFT;
+        safe_strcpy(ev->nick, ev->old_nick, sizeof(ev->nick));
+    }
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+void presence_renamed(PresenceBatch* batch, int client_id, const char* old_nick, const char* new_nick) {
+    pthread_mutex_lock(&batch->mutex);
+    PresenceEvent* ev = presence_find(batch, client_id);
+    if (!ev) {
+        presence_add(batch, client_id, PRESENCE_RENAMED, old_nick, new_nick);
+    } else if (ev->kind == PRESENCE_JOINED) {
+        safe_strcpy(ev->nick, new_nick, sizeof(ev->nick));
+    } else if (ev->kind == PRESENCE_RENAMED) {
+        safe_strcpy(ev->nick, new_nick, sizeof(ev->nick));
+        if (strcmp(ev->old_nick, ev->nick) == 0) presence_drop(batch, ev);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+int presence_collect(PresenceBatch* batch, PresenceEvent* out, int cap, int window_ms) {
+    pthread_mutex_lock(&batch->mutex);
+    batch->collecting++;
+    while (batch->count == 0 && !batch->closed) {
+        pthread_cond_wait(&batch->cond, &batch->mutex);
+    }
+    if (batch->closed) {
+        batch->collecting--;
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->mutex);
+        return -1;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += window_ms / 1000;
+    deadline.tv_nsec += (long)(window_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (!batch->closed && pthread_cond_timedwait(&batch->cond, &batch->mutex, &deadline) == 0) {
+    }
+    batch->collecting--;
+    if (batch->closed) pthread_cond_broadcast(&batch->cond);
+    int n = batch->count < cap ? batch->count : cap;
+    memcpy(out, batch->pending, (size_t)n * sizeof(PresenceEvent));
+    memmove(batch->pending, batch->pending + n, (size_t)(batch->count - n) * sizeof(PresenceEvent));
+    batch->count -= n;
+    pthread_mutex_unlock(&batch->mutex);
+    return n;
+}
+
+/*
+ * Wire form of a delta frame: one line per event, "+nick", "-nick" or
+ * "~old new". Nicknames cannot contain spaces or newlines, so no escaping
+ * is needed. Returns the number of bytes written; *consumed is how many
+ * events fit.
+ */
+int presence_format(const PresenceEvent* events, int count, char* out, size_t cap, int* consumed) {
+    size_t used = 0;
+    int i = 0;
+    if (cap) out[0] = '\0';
+    for (; i < count; i++) {
+        char line[2 * MAX_NICK_LEN + 4];
+        const PresenceEvent* ev = &events[i];
+        if (ev->kind == PRESENCE_JOINED) snprintf(line, sizeof(line), "+%s\n", ev->nick);
+        else if (ev->kind == PRESENCE_LEFT) snprintf(line, sizeof(line), "-%s\n", ev->nick);
+        else snprintf(line, sizeof(line), "~%s %s\n", ev->old_nick, ev->nick);
+        size_t len = strlen(line);
+        if (used + len >= cap) break;
+        memcpy(out + used, line, len + 1);
+        used += len;
+    }
+    if (consumed) *consumed = i;
+    return (int)used;
+}
@@ -0,0 +1,94 @@
+#include "../../include/common.h"
+
+/*
+ * The roster is kept pre-serialized as "nick\n" records sorted by nickname.
+ * Entry i spans text[offsets[i] .. offsets[i+1]), so a WHO page is a single
+ * contiguous copy and joins/leaves/renames only shift the tail.
+ */
+
+static int roster_find(const Roster* roster, int client_id) {
+    for (int i = 0; i < roster->count; i++) {
+        if (roster->ids[i] == client_id) return i;
+    }
+    return -1;
+}
+
+static void roster_delete_at(Roster* roster, int pos) {
+    int start = roster->offsets[pos];
+    int len = roster->offsets[pos + 1] - start;
+    int used = roster->offsets[roster->count];
+    memmove(roster->text + start, roster->text + start + len, (size_t)(used - start - len));
+    for (int i = pos; i < roster->count; i++) {
+        if (i + 1 < roster->count) roster->ids[i] = roster->ids[i + 1];
+        roster->offsets[i] = roster->offsets[i + 1] - len;
+    }
+    roster->count--;
+}
+
+static void roster_insert_sorted(Roster* roster, int client_id, const char* nickname) {
+    size_t nick_len = strnlen(nickname, MAX_NICK_LEN - 1);
+    int len = (int)nick_len + 1;
+    int pos = 0;
+    while (pos < roster->count) {
+        const char* entry = roster->text + roster->offsets[pos];
+        size_t entry_len = (size_t)(roster->offsets[pos + 1] - roster->offsets[pos] - 1);
+        size_t common = entry_len < nick_len ? entry_len : nick_len;
+        int cmp = memcmp(entry, nickname, common);
+        if (cmp > 0 || (cmp == 0 && entry_len > nick_len)) break;
+        pos++;
+    }
+    int start = roster->offsets[pos];
+    int used = roster->offsets[roster->count];
+    memmove(roster->text + start + len, roster->text + start, (size_t)(used - start));
+    memcpy(roster->text + start, nickname, nick_len);
+    roster->text[start + len - 1] = '\n';
+    for (int i = roster->count; i > pos; i--) {
+        roster->ids[i] = roster->ids[i - 1];
+        roster->offsets[i + 1] = roster->offsets[i] + len;
+    }
+    roster->offsets[pos + 1] = start + len;
+    roster->ids[pos] = client_id;
+    roster->count++;
+}
+
+int roster_init(Roster* roster) {
+    memset(roster, 0, sizeof(*roster));
+    return pthread_mutex_init(&roster->mutex, NULL);
+}
+
+void roster_destroy(Roster* roster) {
+    pthread_mutex_destroy(&roster->mutex);
+}
+
+void roster_upsert(Roster* roster, int client_id, const char* nickname) {
+    pthread_mutex_lock(&roster->mutex);
+    int pos = roster_find(roster, client_id);
+    if (pos >= 0) roster_delete_at(roster, pos);
+    if (roster->count < ROSTER_MAX) roster_insert_sorted(roster, client_id, nickname);
+    pthread_mutex_unlock(&roster->mutex);
+}
+
+void roster_remove(Roster* roster, int client_id) {
+    pthread_mutex_lock(&roster->mutex);
+    int pos = roster_find(roster, client_id);
+    if (pos >= 0) roster_delete_at(roster, pos);
+    pthread_mutex_unlock(&roster->mutex);
+}
+
+int roster_page(Roster* roster, int cursor, int page_size, char* out, size_t cap, int* total) {
+    if (cap) out[0] = '\0';
+    pthread_mutex_lock(&roster->mutex);
+    if (total) *total = roster->count;
+    if (cursor < 0 || cursor >= roster->count || page_size <= 0 || cap == 0) {
+        pthread_mutex_unlock(&roster->mutex);
+        return 0;
+    }
+    int end = cursor + page_size;
+    if (end > roster->count) end = roster->count;
+    while (end > cursor && (size_t)(roster->offsets[end] - roster->offsets[cursor]) >= cap) end--;
+    size_t len = (size_t)(roster->offsets[end] - roster->offsets[cursor]);
+    memcpy(out, roster->text + roster->offsets[cursor], len);
+    out[len] = '\0';
+    pthread_mutex_unlock(&roster->mutex);
+    return end - cursor;
+}
@@ -0,0 +1,150 @@
+#include "../../include/common.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define SANITIZE_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Inbound text, including both nickname fields, which clients print as
+ * they are, is rewritten in place before fan-out: C0 controls, DEL and
+ * C1 controls (U+0080..U+009F) are dropped so no escape sequence reaches a
+ * terminal, tabs become spaces, and bytes that are not part of a valid
+ * UTF-8 sequence become '?'. Output is never longer than input.
+ *
+ * Most chat is printable ASCII, so a vector kernel first skips the longest
+ * run of bytes in 0x20..0x7E; only the byte that stops it goes through the
+ * scalar decoder.
+ */
+
+typedef size_t (*scan_fn)(const unsigned char* p, size_t n);
+
+static size_t scan_safe_scalar(const unsigned char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && p[i] >= 0x20 && p[i] < 0x7F) i++;
+    return i;
+}
+
+#ifdef SANITIZE_X86
+static size_t scan_safe_sse2(const unsigned char* p, size_t n) {
+    const __m128i low = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, low));
+        unsigned mask = (unsigned)_mm_movemask_epi8(ok);
+        if (mask != 0xFFFFu) return i + (size_t)__builtin_ctz(~mask);
+    }
+    return i + scan_safe_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_safe_avx2(const unsigned char* p, size_t n) {
+    const __m256i low = _mm256_set1_epi8(0x1F);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, del), _mm256_cmpgt_epi8(v, low));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(ok);
+        if (mask != 0xFFFFFFFFu) return i + (size_t)__builtin_ctz(~mask);
+    }
+    return i + scan_safe_sse2(p + i, n - i);
+}
+#endif
+
+static scan_fn scan_safe = scan_safe_scalar;
+static const char* scan_name = "scalar";
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void) {
+#ifdef SANITIZE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_safe = scan_safe_avx2;
+        scan_name = "avx2";
+    } else {
+        scan_safe = scan_safe_sse2;
+        scan_name = "sse2";
+    }
+#endif
+}
+
+const char* sanitize_kernel_name(void) {
+    pthread_once(&scan_once, select_kernel);
+    return scan_name;
+}
+
+/* Length of the valid UTF-8 sequence starting at p, or 0 if invalid. */
+static size_t utf8_sequence_len(const unsigned char* p, size_t n) {
+    unsigned char c = p[0];
+    size_t len;
+    unsigned char lo = 0x80, hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) len = 2;
+    else if (c == 0xE0) { len = 3; lo = 0xA0; }
+    else if (c == 0xED) { len = 3; hi = 0x9F; }
+    else if (c >= 0xE1 && c <= 0xEF) len = 3;
+    else if (c == 0xF0) { len = 4; lo = 0x90; }
+    else if (c == 0xF4) { len = 4; hi = 0x8F; }
+    else if (c >= 0xF1 && c <= 0xF3) len = 4;
+    else return 0;
+    if (len > n) return 0;
+    if (p[1] < lo || p[1] > hi) return 0;
+    for (size_t i = 2; i < len; i++) {
+        if (p[i] < 0x80 || p[i] > 0xBF) return 0;
+    }
+    return len;
+}
+
+size_t sanitize_text(char* text, size_t cap, int* rewritten) {
+    if (!cap) return 0;
+    pthread_once(&scan_once, select_kernel);
+    unsigned char* p = (unsigned char*)text;
+    size_t len = strnlen(text, cap - 1);
+    size_t r = 0, w = 0;
+    int changed = p[len] != '\0';
+    while (r < len) {
+        size_t safe = scan_safe(p + r, len - r);
+        if (w != r) memmove(p + w, p + r, safe);
+        r += safe;
+        w += safe;
+        if (r >= len) break;
+
+        unsigned char c = p[r];
+        if (c < 0x80) {
+            if (c == '\t') p[w++] = ' ';
+            r++;
+            changed = 1;
+            continue;
+        }
+        size_t n = utf8_sequence_len(p + r, len - r);
+        if (n == 0) {
+            p[w++] = '?';
+            r++;
+            changed = 1;
+            continue;
+        }
+        if (n == 2 && c == 0xC2 && p[r + 1] < 0xA0) {
+            r += 2;
+            changed = 1;
+            continue;
+        }
+        if (w != r) memmove(p + w, p + r, n);
+        w += n;
+        r += n;
+    }
+    p[w] = '\0';
+    if (rewritten) *rewritten = changed;
+    return w;
+}
+
+int sanitize_frame(MessageInfo* msg, size_t* bytes_scanned) {
+    int nick = 0, target = 0, text = 0;
+    size_t scanned = sanitize_text(msg->nickname, sizeof(msg->nickname), &nick);
+    scanned += sanitize_text(msg->target_nickname, sizeof(msg->target_nickname), &target);
+    scanned += strnlen(msg->message, sizeof(msg->message));
+    sanitize_text(msg->message, sizeof(msg->message), &text);
+    if (bytes_scanned) *bytes_scanned = scanned;
+    return nick || target || text;
+}
@@ -0,0 +1,424 @@
+#include "../../include/common.h"
+
+/*
+ * Full-text search over room history.
+ *
+ * A single worker thread owns the index. Chat frames are handed to it
+ * through a bounded job queue as they are broadcast, and /search queries go
+ * through the same queue, so indexing and querying never block message
+ * delivery on anything but the queue mutex.
+ *
+ * The index is split into segments of SEARCH_SEGMENT_SPAN messages. Each
+ * segment maps terms to posting lists of sequence numbers, varint-encoded
+ * as deltas. Segments are dropped whole once every message they cover has
+ * left the history ring, so the index is bounded by the history retention.
+ */
+
+typedef enum {
+    SEARCH_JOB_INDEX = 1,
+    SEARCH_JOB_QUERY
+} search_job_kind_t;
+
+typedef struct {
+    int kind;
+    int client_index;
+    int client_id;
+    uint64_t seq;
+    char text[MAX_MSG_LEN];
+} SearchJob;
+
+typedef struct {
+    char term[SEARCH_TERM_MAX];
+    uint8_t* postings;
+    uint32_t len;
+    uint32_t cap;
+    uint64_t last_seq;
+} TermEntry;
+
+typedef struct {
+    uint64_t first_seq;
+    uint64_t last_seq;
+    int messages;
+    TermEntry* table;
+    uint32_t table_cap;
+    uint32_t terms;
+    size_t posting_bytes;
+} Segment;
+
+struct SearchIndex {
+    ServerState* server;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    SearchJob* jobs;
+    int head;
+    int count;
+    int stopping;
+    Segment* segments[SEARCH_MAX_SEGMENTS];
+    int segment_count;
+    unsigned long long indexed;
+    unsigned long long dropped;
+    unsigned long long queries;
+};
+
+static void safe_strcpy(char* dst, const char* src, size_t cap) {
+    if (!dst || !cap) return;
+    if (!src) { dst[0] = '\0'; return; }
+    strncpy(dst, src, cap - 1);
+    dst[cap - 1] = '\0';
+}
+
+static uint32_t term_hash(const char* term) {
+    uint32_t h = 2166136261u;
+    for (; *term; term++) {
+        h ^= (unsigned char)*term;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int is_term_byte(unsigned char c) {
+    return isalnum(c) || c >= 0x80;
+}
+
+/* Splits text into lowercase terms of at least two bytes. Returns the
+ * position after the term, or NULL when there are no more terms. */
+static const char* next_term(const char* p, char* term) {
+    while (*p && !is_term_byte((unsigned char)*p)) p++;
+    while (*p) {
+        size_t n = 0;
+        while (*p && is_term_byte((unsigned char)*p)) {
+            if (n < SEARCH_TERM_MAX - 1) term[n++] = (char)tolower((unsigned char)*p);
+            p++;
+        }
+        term[n] = '\0';
+        if (n >= 2) return p;
+        while (*p && !is_term_byte((unsigned char)*p)) p++;
+    }
+    return NULL;
+}
+
+static Segment* segment_new(uint64_t first_seq) {
+    Segment* seg = calloc(1, sizeof(Segment));
+    if (!seg) return NULL;
+    seg->table_cap = 256;
+    seg->table = calloc(seg->table_cap, sizeof(TermEntry));
+    if (!seg->table) {
+        free(seg);
+        return NULL;
+    }
+    seg->first_seq = first_seq;
+    return seg;
+}
+
+static void segment_free(Segment* seg) {
+    for (uint32_t i = 0; i < seg->table_cap; i++) free(seg->table[i].postings);
+    free(seg->table);
+    free(seg);
+}
+
+static TermEntry* segment_lookup(Segment* seg, const char* term) {
+    uint32_t mask = seg->table_cap - 1;
+    for (uint32_t i = term_hash(term) & mask;; i = (i + 1) & mask) {
+        TermEntry* e = &seg->table[i];
+        if (!e->term[0] || strcmp(e->term, term) == 0) return e;
+    }
+}
+
+static int segment_grow(Segment* seg) {
+    uint32_t old_cap = seg->table_cap;
+    TermEntry* old = seg->table;
+    TermEntry* table = calloc((size_t)old_cap * 2, sizeof(TermEntry));
+    if (!table) return -1;
+    seg->table = table;
+    seg->table_cap = old_cap * 2;
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (old[i].term[0]) *segment_lookup(seg, old[i].term) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static void posting_append(Segment* seg, TermEntry* e, uint64_t seq) {
+    if (e->last_seq == seq) return;
+    if (e->len + 10 > e->cap) {
+        uint32_t cap = e->cap ? e->cap * 2 : 16;
+        uint8_t* grown = realloc(e->postings, cap);
+        if (!grown) return;
+        seg->posting_bytes += cap - e->cap;
+        e->postings = grown;
+        e->cap = cap;
+    }
+    uint64_t delta = seq - e->last_seq;
+    while (delta >= 0x80) {
+        e->postings[e->len++] = (uint8_t)(delta | 0x80);
+        delta >>= 7;
+    }
+    e->postings[e->len++] = (uint8_t)delta;
+    e->last_seq = seq;
+}
+
+static int posting_decode(const TermEntry* e, uint64_t* out, int cap) {
+    int n = 0;
+    uint64_t seq = 0;
+    uint32_t i = 0;
+    while (i < e->len && n < cap) {
+        uint64_t delta = 0;
+        int shift = 0;
+        while (i < e->len) {
+            uint8_t b = e->postings[i++];
+            delta |= (uint64_t)(b & 0x7f) << shift;
+            shift += 7;
+            if (!(b & 0x80)) break;
+        }
+        seq += delta;
+        out[n++] = seq;
+    }
+    return n;
+}
+
+static void evict_segments(SearchIndex* index) {
+    uint64_t oldest = 0;
+    history_bounds(&index->server->history, &oldest, NULL);
+    while (index->segment_count > 0 && index->segments[0]->messages > 0 &&
+           index->segments[0]->last_seq < oldest && index->segment_count > 1) {
+        segment_free(index->segments[0]);
+        memmove(index->segments, index->segments + 1, (size_t)(index->segment_count - 1) * sizeof(Segment*));
+        index->segment_count--;
+    }
+}
+
+static void index_message(SearchIndex* index, const SearchJob* job) {
+    Segment* seg = index->segment_count ? index->segments[index->segment_count - 1] : NULL;
+    if (!seg || seg->messages >= SEARCH_SEGMENT_SPAN) {
+        if (index->segment_count == SEARCH_MAX_SEGMENTS) {
+            segment_free(index->segments[0]);
+            memmove(index->segments, index->segments + 1, (size_t)(index->segment_count - 1) * sizeof(Segment*));
+            index->segment_count--;
+        }
+        seg = segment_new(job->seq);
+        if (!seg) return;
+        index->segments[index->segment_count++] = seg;
+    }
+    char term[SEARCH_TERM_MAX];
+    const char* p = job->text;
+    while ((p = next_term(p, term)) != NULL) {
+        if ((seg->terms + 1) * 4 > seg->table_cap * 3 && segment_grow(seg) != 0) break;
+        TermEntry* e = segment_lookup(seg, term);
+        if (!e->term[0]) {
+            safe_strcpy(e->term, term, sizeof(e->term));
+            seg->terms++;
+        }
+        posting_append(seg, e, job->seq);
+    }
+    seg->messages++;
+    seg->last_seq = job->seq;
+    index->indexed++;
+    evict_segments(index);
+}
+
+static int intersect(uint64_t* a, int na, const uint64_t* b, int nb) {
+    int i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) i++;
+        else if (a[i] > b[j]) j++;
+        else {
+            a[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+static int accept_hit(SearchIndex* index, uint64_t seq, const char* from, MessageInfo* out) {
+    if (!history_get(&index->server->history, seq, out)) return 0;
+    if (out->type != MSG_TYPE_CHAT) return 0;
+    if (from[0] && strcmp(out->nickname, from) != 0) return 0;
+    return 1;
+}
+
+static int run_query(SearchIndex* index, const char* query, MessageInfo* hits) {
+    char terms[SEARCH_MAX_TERMS][SEARCH_TERM_MAX];
+    int term_count = 0;
+    char from[MAX_NICK_LEN] = {0};
+    char words[MAX_MSG_LEN];
+    safe_strcpy(words, query, sizeof(words));
+
+    for (char* word = strtok(words, " "); word; word = strtok(NULL, " ")) {
+        if (strncmp(word, "from:", 5) == 0) {
+            safe_strcpy(from, word + 5, sizeof(from));
+            continue;
+        }
+        char term[SEARCH_TERM_MAX];
+        const char* p = word;
+        while (term_count < SEARCH_MAX_TERMS && (p = next_term(p, term)) != NULL) {
+            safe_strcpy(terms[term_count++], term, SEARCH_TERM_MAX);
+        }
+    }
+
+    int found = 0;
+    if (term_count == 0) {
+        if (!from[0]) return 0;
+        uint64_t oldest = 0, latest = 0;
+        history_bounds(&index->server->history, &oldest, &latest);
+        for (uint64_t seq = latest; seq >= oldest && seq > 0 && found < SEARCH_MAX_RESULTS; seq--) {
+            if (accept_hit(index, seq, from, &hits[found])) found++;
+        }
+        return found;
+    }
+
+    uint64_t candidates[SEARCH_SEGMENT_SPAN];
+    uint64_t postings[SEARCH_SEGMENT_SPAN];
+    for (int s = index->segment_count - 1; s >= 0 && found < SEARCH_MAX_RESULTS; s--) {
+        Segment* seg = index->segments[s];
+        int n = -1;
+        for (int t = 0; t < term_count && n != 0; t++) {
+            TermEntry* e = segment_lookup(seg, terms[t]);
+            if (!e->term[0]) {
+                n = 0;
+                break;
+            }
+            if (n < 0) {
+                n = posting_decode(e, candidates, SEARCH_SEGMENT_SPAN);
+            } else {
+                int m = posting_decode(e, postings, SEARCH_SEGMENT_SPAN);
+                n = intersect(candidates, n, postings, m);
+            }
+        }
+        for (int i = n - 1; i >= 0 && found < SEARCH_MAX_RESULTS; i--) {
+            if (accept_hit(index, candidates[i], from, &hits[found])) found++;
+        }
+    }
+    return found;
+}
+
+static void answer_query(SearchIndex* index, const SearchJob* job) {
+    MessageInfo hits[SEARCH_MAX_RESULTS];
+    int n = run_query(index, job->text, hits);
+    index->queries++;
+
+    ServerState* server = index->server;
+    pthread_mutex_lock(&server->clients_mutex);
+    Client* c = &server->clients[job->client_index];
+    if (c->active && c->client_id == job->client_id) {
+        for (int i = 0; i < n; i++) {
+            MessageInfo result = hits[i];
+            result.type = MSG_TYPE_SEARCH_RESULT;
+            result.cursor = (i + 1 < n) ? i + 1 : -1;
+            result.count = n;
+            result.seq = 0;
+            result.flags = 0;
+            if (send_to_client(server, job->client_index, &result) == SOCKET_ERROR) break;
+        }
+        if (n == 0) {
+            MessageInfo none;
+            msg_encode(&none, MSG_TYPE_SEARCH_RESULT, "Server", NULL, NULL);
+            none.cursor = -1;
+            (void)send_to_client(server, job->client_index, &none);
+        }
+    }
+    pthread_mutex_unlock(&server->clients_mutex);
+}
+
+static void* search_worker(void* arg) {
+    SearchIndex* index = arg;
+    SearchJob* job = malloc(sizeof(SearchJob));
+    if (!job) return NULL;
+    for (;;) {
+        pthread_mutex_lock(&index->mutex);
+        while (index->count == 0 && !index->stopping) pthread_cond_wait(&index->cond, &index->mutex);
+        if (index->stopping) {
+            pthread_mutex_unlock(&index->mutex);
+            break;
+        }
+        *job = index->jobs[index->head];
+        index->head = (index->head + 1) % SEARCH_QUEUE_LEN;
+        index->count--;
+        pthread_mutex_unlock(&index->mutex);
+
+        if (job->kind == SEARCH_JOB_INDEX) index_message(index, job);
+        else answer_query(index, job);
+    }
+    free(job);
+    return NULL;
+}
+
+static int enqueue(SearchIndex* index, int kind, int client_index, int client_id, uint64_t seq, const char* text) {
+    pthread_mutex_lock(&index->mutex);
+    if (index->count == SEARCH_QUEUE_LEN) {
+        if (kind == SEARCH_JOB_INDEX) index->dropped++;
+        pthread_mutex_unlock(&index->mutex);
+        return -1;
+    }
+    SearchJob* job = &index->jobs[(index->head + index->count) % SEARCH_QUEUE_LEN];
+    job->kind = kind;
+    job->client_index = client_index;
+    job->client_id = client_id;
+    job->seq = seq;
+    safe_strcpy(job->text, text, sizeof(job->text));
+    index->count++;
+    pthread_cond_signal(&index->cond);
+    pthread_mutex_unlock(&index->mutex);
+    return 0;
+}
+
+SearchIndex* search_start(ServerState* server) {
+    SearchIndex* index = calloc(1, sizeof(SearchIndex));
+    if (!index) return NULL;
+    index->jobs = calloc(SEARCH_QUEUE_LEN, sizeof(SearchJob));
+    if (!index->jobs) {
+        free(index);
+        return NULL;
+    }
+    index->server = server;
+    if (pthread_mutex_init(&index->mutex, NULL) != 0) goto fail_mutex;
+    if (pthread_cond_init(&index->cond, NULL) != 0) goto fail_cond;
+    if (pthread_create(&index->thread, NULL, search_worker, index) != 0) goto fail_thread;
+    return index;
+fail_thread:
+    pthread_cond_destroy(&index->cond);
+fail_cond:
+    pthread_mutex_destroy(&index->mutex);
+fail_mutex:
+    free(index->jobs);
+    free(index);
+    return NULL;
+}
+
+void search_index_message(SearchIndex* index, const MessageInfo* msg) {
+    if (!index || msg->type != MSG_TYPE_CHAT || msg->seq == 0) return;
+    (void)enqueue(index, SEARCH_JOB_INDEX, -1, msg->client_id, msg->seq, msg->message);
+}
+
+int search_submit_query(SearchIndex* index, int client_index, int client_id, const char* query) {
+    if (!index) return -1;
+    return enqueue(index, SEARCH_JOB_QUERY, client_index, client_id, 0, query);
+}
+
+/* Stops the worker between jobs, keeping the queue; for a hot restart. */
+void search_pause(SearchIndex* index) {
+    if (!index) return;
+    pthread_mutex_lock(&index->mutex);
+    index->stopping = 1;
+    pthread_cond_broadcast(&index->cond);
+    pthread_mutex_unlock(&index->mutex);
+    pthread_join(index->thread, NULL);
+}
+
+void search_resume(SearchIndex* index) {
+    if (!index) return;
+    pthread_mutex_lock(&index->mutex);
+    index->stopping = 0;
+    pthread_mutex_unlock(&index->mutex);
+    if (pthread_create(&index->thread, NULL, search_worker, index) != 0) print_error("Failed to restart the search worker");
+}
+
+void search_print_stats(SearchIndex* index) {
+    if (!index) return;
+    pthread_mutex_lock(&index->mutex);
+    printf(CYAN "=== Search index ===" RESET "\n");
+    printf("indexed %llu, dropped %llu, queries %llu, queued %d\n",
+           index->indexed, index->dropped, index->queries, index->count);
+    pthread_mutex_unlock(&index->mutex);
+}
@@ -38,11 +38,9 @@ int validate_nickname(const char* nickname, char* reason_out, size_t reason_cap)
         if (reason_out && reason_cap) safe_strcpy(reason_out, "too long", reason_cap);
         return 0;
     }
-    for (size_t i = 0; nickname[i]; ++i) {
-        if (!is_allowed_nick_char((unsigned char)nickname[i])) {
-            if (reason_out && reason_cap) safe_strcpy(reason_out, "invalid character", reason_cap);
-            return 0;
-        }
+    if (nickname[strspn(nickname, NICK_ALLOWED_CHARS)] != '\0') {
+        if (reason_out && reason_cap) safe_strcpy(reason_out, "invalid character", reason_cap);
+        return 0;
     }
     if (strcmp(nickname, "Anonymous") == 0) {
         if (reason_out && reason_cap) safe_strcpy(reason_out, "reserved name", reason_cap);
@@ -56,6 +54,8 @@ int initialize_network(void) {
     WSADATA wsa_data;
     return WSAStartup(MAKEWORD(2, 2), &wsa_data);
 #else
+    /* a peer that vanishes mid-send must surface as EPIPE, not kill us */
+    signal(SIGPIPE, SIG_IGN);
     return 0;
 #endif
 }
@@ -93,6 +93,55 @@ int bind_socket(SOCKET sock, int port) {
     return 0;
 }
 
+#ifndef _WIN32
+/* A socket file nobody answers on was left behind by a server that did not
+ * shut down cleanly; one that answers belongs to a running server. */
+static int local_path_in_use(const struct sockaddr_un* addr) {
+    SOCKET probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == INVALID_SOCKET) return 1;
+    int in_use = connect(probe, (const struct sockaddr*)addr, sizeof(*addr)) == 0 || errno != ECONNREFUSED;
+    CLOSE_SOCKET(probe);
+    return in_use;
+}
+#endif
+
+/* Same-host clients and bots skip the TCP stack; the listener shares the
+ * client table and protocol with the TCP one. */
+SOCKET open_local_listener(const char* path) {
+#ifdef _WIN32
+    (void)path;
+    print_error("Unix domain sockets are not supported on this platform");
+    return INVALID_SOCKET;
+#else
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        print_error("Unix socket path is too long");
+        return INVALID_SOCKET;
+    }
+    safe_strcpy(addr.sun_path, path, sizeof(addr.sun_path));
+    if (access(path, F_OK) == 0) {
+        if (local_path_in_use(&addr)) {
+            print_error("Unix socket path is in use by another server");
+            return INVALID_SOCKET;
+        }
+        (void)unlink(path);
+    }
+    SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        print_error("Failed to create unix socket");
+        return INVALID_SOCKET;
+    }
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        print_error("Failed to bind unix socket");
+        CLOSE_SOCKET(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+#endif
+}
+
 int listen_socket(SOCKET sock, int backlog) {
     if (listen(sock, backlog) == SOCKET_ERROR) {
         print_error("Failed to listen on socket");
@@ -112,77 +161,228 @@ SOCKET accept_connection(SOCKET sock, struct sockaddr_in* client_addr) {
 }
 
 int send_message(SOCKET sock, const MessageInfo* msg) {
-    return send(sock, (const char*)msg, sizeof(MessageInfo), 0);
+    const char* p = (const char*)msg;
+    size_t left = sizeof(MessageInfo);
+    while (left > 0) {
+        int n = send(sock, p, (int)left, 0);
+        if (n <= 0) return SOCKET_ERROR;
+        p += n;
+        left -= (size_t)n;
+    }
+    return (int)sizeof(MessageInfo);
 }
 
 int receive_message(SOCKET sock, MessageInfo* msg) {
-    return recv(sock, (char*)msg, sizeof(MessageInfo), 0);
+    int n = recv(sock, (char*)msg, sizeof(MessageInfo), MSG_WAITALL);
+    if (n > 0 && n < (int)sizeof(MessageInfo)) return 0;
+    return n;
 }
 
-int server_init(ServerState* server, int port) {
-    memset(server, 0, sizeof(ServerState));
-    server->next_client_id = 1;
+static int server_state_init(ServerState* server) {
+    int send_locks = 0, outboxes = 0;
     if (pthread_mutex_init(&server->clients_mutex, NULL) != 0) {
         print_error("Failed to initialize clients mutex");
         return -1;
     }
+    for (; send_locks < MAX_CLIENTS; send_locks++) {
+        if (pthread_mutex_init(&server->clients[send_locks].send_mutex, NULL) != 0) {
+            print_error("Failed to initialize client send mutex");
+            goto fail_send_locks;
+        }
+    }
+    for (; outboxes < MAX_CLIENTS; outboxes++) {
+        server->clients[outboxes].outbox = outbox_create(server, outboxes);
+        if (!server->clients[outboxes].outbox) {
+            print_error("Failed to allocate client outbound queues");
+            goto fail_outboxes;
+        }
+    }
+    if (roster_init(&server->roster) != 0) {
+        print_error("Failed to initialize roster mutex");
+        goto fail_roster;
+    }
+    if (presence_init(&server->presence) != 0) {
+        print_error("Failed to initialize presence batch");
+        goto fail_presence;
+    }
+    if (history_init(&server->history) != 0) {
+        print_error("Failed to initialize room history");
+        goto fail_history;
+    }
+    if (session_table_init(&server->sessions) != 0) {
+        print_error("Failed to initialize session table");
+        goto fail_sessions;
+    }
+    return 0;
+fail_sessions:
+    history_destroy(&server->history);
+fail_history:
+    presence_destroy(&server->presence);
+fail_presence:
+    roster_destroy(&server->roster);
+fail_roster:
+fail_outboxes:
+    while (outboxes-- > 0) outbox_destroy(server->clients[outboxes].outbox);
+fail_send_locks:
+    while (send_locks-- > 0) pthread_mutex_destroy(&server->clients[send_locks].send_mutex);
+    pthread_mutex_destroy(&server->clients_mutex);
+    return -1;
+}
+
+static void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep((useconds_t)ms * 1000);
+#endif
+}
+
+static void server_state_destroy(ServerState* server) {
+    session_table_destroy(&server->sessions);
+    history_destroy(&server->history);
+    presence_destroy(&server->presence);
+    roster_destroy(&server->roster);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        outbox_destroy(server->clients[i].outbox);
+        pthread_mutex_destroy(&server->clients[i].send_mutex);
+    }
+    pthread_mutex_destroy(&server->clients_mutex);
+}
+
+int server_init(ServerState* server, int port, const char* local_path) {
+    memset(server, 0, sizeof(ServerState));
+    server->next_client_id = 1;
+    server->local_socket = INVALID_SOCKET;
+    server->trusted_uid = -1;
+    if (server_state_init(server) != 0) {
+        return -1;
+    }
     if (initialize_network() != 0) {
         print_error(FAILED_INIT_MESSAGE);
-        pthread_mutex_destroy(&server->clients_mutex);
+        server_state_destroy(server);
         return -1;
     }
     server->server_socket = create_socket();
     if (server->server_socket == INVALID_SOCKET) {
         cleanup_network();
-        pthread_mutex_destroy(&server->clients_mutex);
+        server_state_destroy(server);
         return -1;
     }
     if (bind_socket(server->server_socket, port) != 0) {
         CLOSE_SOCKET(server->server_socket);
         cleanup_network();
-        pthread_mutex_destroy(&server->clients_mutex);
+        server_state_destroy(server);
         return -1;
     }
     if (listen_socket(server->server_socket, 64) != 0) {
         CLOSE_SOCKET(server->server_socket);
         cleanup_network();
-        pthread_mutex_destroy(&server->clients_mutex);
+        server_state_destroy(server);
+        return -1;
+    }
+    if (local_path) {
+        server->local_socket = open_local_listener(local_path);
+        if (server->local_socket == INVALID_SOCKET || listen_socket(server->local_socket, 64) != 0) {
+            if (server->local_socket != INVALID_SOCKET) CLOSE_SOCKET(server->local_socket);
+            CLOSE_SOCKET(server->server_socket);
+            cleanup_network();
+            server_state_destroy(server);
+            return -1;
+        }
+        safe_strcpy(server->local_path, local_path, sizeof(server->local_path));
+    }
+    return 0;
+}
+
+/* Like server_init, but the listeners, connections and room state come
+ * from a running server (see handoff.c). On failure the takeover is
+ * abandoned and the old server carries on. */
+int server_adopt(ServerState* server, Takeover* takeover) {
+    memset(server, 0, sizeof(ServerState));
+    server->next_client_id = 1;
+    server->local_socket = INVALID_SOCKET;
+    server->trusted_uid = -1;
+    if (server_state_init(server) != 0) {
+        handoff_abandon(takeover);
+        return -1;
+    }
+    if (initialize_network() != 0) {
+        print_error(FAILED_INIT_MESSAGE);
+        handoff_abandon(takeover);
+        server_state_destroy(server);
+        return -1;
+    }
+    if (handoff_restore(server, takeover) != 0) {
+        handoff_abandon(takeover);
+        cleanup_network();
+        server_state_destroy(server);
         return -1;
     }
     return 0;
 }
 
 void server_cleanup(ServerState* server) {
+    /* readers see the shutdown, remove their clients and close the sockets;
+     * the state they use is only torn down once they are gone */
     pthread_mutex_lock(&server->clients_mutex);
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].active) {
-            CLOSE_SOCKET(server->clients[i].socket);
-        }
+        if (server->clients[i].active) shutdown(server->clients[i].socket, SHUTDOWN_BOTH);
     }
     pthread_mutex_unlock(&server->clients_mutex);
+    for (int waited = 0; waited < SHUTDOWN_DRAIN_MS; waited += 10) {
+        pthread_mutex_lock(&server->clients_mutex);
+        int left = server->client_count;
+        pthread_mutex_unlock(&server->clients_mutex);
+        if (left == 0) break;
+        sleep_ms(10);
+    }
     CLOSE_SOCKET(server->server_socket);
+    if (server->local_socket != INVALID_SOCKET) {
+        CLOSE_SOCKET(server->local_socket);
+#ifndef _WIN32
+        (void)unlink(server->local_path);
+#endif
+    }
     cleanup_network();
-    pthread_mutex_destroy(&server->clients_mutex);
+    /* every thread that locks clients_mutex or pushes to an outbox is
+     * stopped before either goes away */
+    __atomic_store_n(&server->stopping, 1, __ATOMIC_SEQ_CST);
+    shm_bus_stop(server->bus);
+    if (server->bus_running) pthread_join(server->bus_tid, NULL);
+    server->bus_running = 0;
+    shm_bus_close(server->bus);
+    server->bus = NULL;
+    WorkerPool* workers = server->workers;
+    server->workers = NULL;
+    worker_pool_stop(workers);
+    if (server->sweeper_running) pthread_join(server->sweeper_tid, NULL);
+    server->sweeper_running = 0;
+    server_pause_background(server);
+    Capture* capture = server->capture;
+    server->capture = NULL;
+    capture_close(capture);
+    multicast_close(server->multicast);
+    server->multicast = NULL;
+    admission_close(server->admission);
+    server->admission = NULL;
+    server_state_destroy(server);
 }
 
-static void system_msg_to_socket(SOCKET s, const char* text) {
-    MessageInfo msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_TYPE_SYSTEM;
-    safe_strcpy(msg.nickname, "Server", sizeof(msg.nickname));
-    safe_strcpy(msg.message, text, sizeof(msg.message));
-    msg.timestamp = time(NULL);
-    (void)send_message(s, &msg);
+/* Frames are queued on the client's outbox and written by its writer
+ * thread; the lane follows from the frame type (see outbox.c). */
+int send_to_client(ServerState* server, int client_index, const MessageInfo* msg) {
+    return send_to_client_lane(server, client_index, outbox_lane_for(msg->type), msg);
+}
+
+int send_to_client_lane(ServerState* server, int client_index, int lane, const MessageInfo* msg) {
+    /* a room frame dropped from a full lane is not a send error */
+    return outbox_push(server->clients[client_index].outbox, lane, msg) < 0 ? SOCKET_ERROR : (int)sizeof(MessageInfo);
 }
 
-static void system_msg_broadcast(ServerState* server, const char* text, int exclude_index) {
+static void system_msg_to_client(ServerState* server, int client_index, const char* text) {
     MessageInfo msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_TYPE_SYSTEM;
-    safe_strcpy(msg.nickname, "Server", sizeof(msg.nickname));
-    safe_strcpy(msg.message, text, sizeof(msg.message));
-    msg.timestamp = time(NULL);
-    broadcast_message(server, &msg, exclude_index);
+    msg_encode(&msg, MSG_TYPE_SYSTEM, "Server", NULL, text);
+    (void)send_to_client(server, client_index, &msg);
 }
 
 int find_client_by_nickname(ServerState* server, const char* nickname) {
@@ -207,10 +407,19 @@ int is_nickname_available(ServerState* server, const char* nickname) {
             break;
         }
     }
+    if (available && session_nick_held(&server->sessions, nickname, -1)) available = 0;
     pthread_mutex_unlock(&server->clients_mutex);
     return available;
 }
 
+/* Called with clients_mutex held. */
+static void follow_rename(ServerState* server, const char* old_nick, const char* new_nick) {
+    if (strcmp(old_nick, "Anonymous") == 0) return;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (server->clients[i].active) filter_renamed(&server->clients[i].filter, old_nick, new_nick);
+    }
+}
+
 int set_client_nickname(ServerState* server, int client_index, const char* new_nick, char* old_out, size_t old_cap) {
     if (client_index < 0 || client_index >= MAX_CLIENTS) return -1;
     char reason[64] = {0};
@@ -229,8 +438,14 @@ int set_client_nickname(ServerState* server, int client_index, const char* new_n
             return -3;
         }
     }
+    if (session_nick_held(&server->sessions, new_nick, server->clients[client_index].client_id)) {
+        pthread_mutex_unlock(&server->clients_mutex);
+        return -3;
+    }
     if (old_out && old_cap) safe_strcpy(old_out, server->clients[client_index].nickname, old_cap);
+    follow_rename(server, server->clients[client_index].nickname, new_nick);
     safe_strcpy(server->clients[client_index].nickname, new_nick, sizeof(server->clients[client_index].nickname));
+    filter_set_nickname(&server->clients[client_index].filter, new_nick);
     pthread_mutex_unlock(&server->clients_mutex);
     return 0;
 }
@@ -243,11 +458,25 @@ int add_client(ServerState* server, SOCKET client_socket, struct sockaddr_in cli
     }
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (!server->clients[i].active) {
+            if (outbox_attach(server->clients[i].outbox, client_socket) != 0) {
+                pthread_mutex_unlock(&server->clients_mutex);
+                print_error("Failed to create client writer thread");
+                return -2;
+            }
             server->clients[i].socket = client_socket;
             server->clients[i].address = client_addr;
             server->clients[i].active = 1;
+            server->clients[i].leaving = 0;
+            server->clients[i].detached = 0;
             server->clients[i].client_id = server->next_client_id++;
             safe_strcpy(server->clients[i].nickname, "Anonymous", sizeof(server->clients[i].nickname));
+            filter_reset(&server->clients[i].filter, "Anonymous");
+            server->clients[i].multicast = 0;
+            server->clients[i].local = 0;
+            server->clients[i].peer_uid = -1;
+            server->clients[i].peer_pid = -1;
+            server->clients[i].trusted = 0;
+            server->clients[i].adopted = 0;
             server->client_count++;
             pthread_mutex_unlock(&server->clients_mutex);
             return i;
@@ -260,7 +489,21 @@ int add_client(ServerState* server, SOCKET client_socket, struct sockaddr_in cli
 void remove_client(ServerState* server, int client_index) {
     pthread_mutex_lock(&server->clients_mutex);
     if (client_index >= 0 && client_index < MAX_CLIENTS && server->clients[client_index].active) {
-        CLOSE_SOCKET(server->clients[client_index].socket);
+        Client* c = &server->clients[client_index];
+        int joined = strcmp(c->nickname, "Anonymous") != 0;
+        outbox_detach(c->outbox);
+        pthread_mutex_lock(&c->send_mutex);
+        CLOSE_SOCKET(c->socket);
+        pthread_mutex_unlock(&c->send_mutex);
+        if (c->detached) {
+            /* the session moved to a newer connection, nothing to announce */
+        } else if (joined && !c->leaving && session_hold(&server->sessions, c->client_id, time(NULL))) {
+            print_system_message("Session held for reconnect");
+        } else {
+            session_drop(&server->sessions, c->client_id);
+            roster_remove(&server->roster, c->client_id);
+            if (joined) presence_left(&server->presence, c->client_id, c->nickname);
+        }
         server->clients[client_index].active = 0;
         server->client_count--;
         print_system_message("Client disconnected");
@@ -268,25 +511,101 @@ void remove_client(ServerState* server, int client_index) {
     pthread_mutex_unlock(&server->clients_mutex);
 }
 
-void broadcast_message(ServerState* server, const MessageInfo* msg, int exclude_index) {
+/* Records who is on the other end of a unix socket connection, before its
+ * reader starts. Only the kernel's answer counts: a bot whose uid matches
+ * --unix-trust is trusted. */
+/* The uid of the process at the other end of a unix socket, or -1 if the
+ * platform cannot tell. Stores its pid in *pid too where known. */
+int local_peer_uid(SOCKET sock, int* pid) {
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = (socklen_t)sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        if (pid) *pid = (int)cred.pid;
+        return (int)cred.uid;
+    }
+#elif !defined(_WIN32)
+    uid_t uid;
+    gid_t gid;
+    (void)pid;
+    if (getpeereid(sock, &uid, &gid) == 0) return (int)uid;
+#else
+    (void)sock; (void)pid;
+#endif
+    return -1;
+}
+
+static void identify_local_peer(ServerState* server, int client_index) {
+    Client* c = &server->clients[client_index];
+    c->local = 1;
+    c->peer_uid = local_peer_uid(c->socket, &c->peer_pid);
+    c->trusted = server->trusted_uid >= 0 && c->peer_uid == server->trusted_uid;
+}
+
+/* A trusted local bot may speak for others, as a bridge does for the users
+ * on its side: its chat keeps the nickname it carries, provided that name is
+ * valid and nobody here holds it. Anything else goes out under its own. */
+static int may_speak_as(ServerState* server, int client_index, const char* nickname) {
+    if (!server->clients[client_index].trusted || strcmp(nickname, server->clients[client_index].nickname) == 0) return 0;
+    return validate_nickname(nickname, NULL, 0) && is_nickname_available(server, nickname);
+}
+
+static void broadcast_local(ServerState* server, MessageInfo* msg, int exclude_index) {
+    int traced = (msg->flags & MSG_FLAG_TRACE) != 0;
+    PackedFrame packed;
+    packed.done = 0;
     pthread_mutex_lock(&server->clients_mutex);
+    if (traced) msg->trace[TRACE_SERVER_ENQUEUE] = monotonic_ns();
+    history_append(&server->history, msg);
+    if (msg->type == MSG_TYPE_CHAT) search_index_message(server->search, msg);
+    uint64_t sender_key = msg->type == MSG_TYPE_CHAT ? filter_key(msg->nickname) : 0;
+    if (traced && server->multicast) msg->trace[TRACE_SERVER_FLUSH] = monotonic_ns();
+    /* subscribers filter multicast frames themselves */
+    int published = server->multicast && multicast_publish(server->multicast, msg) == 0;
+    if (traced && published) stats_record_flush(&server->stats, msg->trace, monotonic_ns());
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].active && i != exclude_index) {
-            if (send_message(server->clients[i].socket, msg) == SOCKET_ERROR) {
+        /* connections that have not joined or resumed yet are not in the room */
+        if (server->clients[i].active && i != exclude_index && strcmp(server->clients[i].nickname, "Anonymous") != 0) {
+            if (published && server->clients[i].multicast) continue;
+            int suppressed = filter_check(&server->clients[i].filter, msg, sender_key);
+            if (suppressed != FILTER_PASS) {
+                stats_record_filtered(&server->stats, suppressed);
+                continue;
+            }
+            if (outbox_push_packed(server->clients[i].outbox, OUTBOX_CHAT, msg, &packed) < 0) {
+                /* its reader removes it once the frames it queued have run */
                 print_error("Failed to send message to client");
-                SOCKET bad = server->clients[i].socket;
-                pthread_mutex_unlock(&server->clients_mutex);
-                for (int j = 0; j < MAX_CLIENTS; ++j) {
-                    if (server->clients[j].active && server->clients[j].socket == bad) {
-                        remove_client(server, j);
-                        break;
-                    }
-                }
-                pthread_mutex_lock(&server->clients_mutex);
+                shutdown(server->clients[i].socket, SHUTDOWN_BOTH);
             }
         }
     }
     pthread_mutex_unlock(&server->clients_mutex);
+    if (traced) stats_record_trace(&server->stats, msg);
+}
+
+void broadcast_message(ServerState* server, const MessageInfo* msg, int exclude_index) {
+    MessageInfo frame = *msg;
+    broadcast_local(server, &frame, exclude_index);
+    if (server->bus) (void)shm_bus_publish(server->bus, &frame);
+}
+
+static void* bus_reader_thread(void* arg) {
+    ServerState* server = arg;
+    MessageInfo msg;
+    unsigned long long reported = 0;
+    for (;;) {
+        int rc = shm_bus_next(server->bus, &msg, 1000);
+        if (rc < 0) break;
+        unsigned long long overruns = 0, dropped = 0;
+        shm_bus_stats(server->bus, &overruns, &dropped);
+        if (overruns != reported) {
+            reported = overruns;
+            print_error("Shared-memory bus overrun, resynchronized to latest frame");
+            printf("Frames dropped so far: " YELLOW "%llu" RESET "\n", dropped);
+        }
+        if (rc > 0) broadcast_local(server, &msg, -1);
+    }
+    return NULL;
 }
 
 int server_send_private_message(ServerState* server, const MessageInfo* msg) {
@@ -294,149 +613,641 @@ int server_send_private_message(ServerState* server, const MessageInfo* msg) {
     if (target_index == -1) return -1;
     pthread_mutex_lock(&server->clients_mutex);
     int result = -1;
-    if (server->clients[target_index].active) {
-        result = (send_message(server->clients[target_index].socket, msg) == SOCKET_ERROR) ? -1 : 0;
+    int suppressed = filter_check(&server->clients[target_index].filter, msg, filter_key(msg->nickname));
+    if (suppressed != FILTER_PASS) {
+        /* the sender is not told they are ignored */
+        stats_record_filtered(&server->stats, suppressed);
+        result = 0;
+    } else if (server->clients[target_index].active) {
+        if (msg->flags & MSG_FLAG_TRACE) {
+            MessageInfo traced = *msg;
+            traced.trace[TRACE_SERVER_ENQUEUE] = monotonic_ns();
+            result = (send_to_client(server, target_index, &traced) == SOCKET_ERROR) ? -1 : 0;
+            stats_record_trace(&server->stats, &traced);
+        } else {
+            result = (send_to_client(server, target_index, msg) == SOCKET_ERROR) ? -1 : 0;
+        }
     }
     pthread_mutex_unlock(&server->clients_mutex);
     return result;
 }
 
+/* Leaves seq at 0: the control lane overtakes a replay still queued on the
+ * history lane, and the client's position only follows the room frames it
+ * has actually been shown. */
+static void send_session(ServerState* server, int client_index, const char* token) {
+    MessageInfo session;
+    msg_encode(&session, MSG_TYPE_SESSION, "Server", server->clients[client_index].nickname, token);
+    session.client_id = server->clients[client_index].client_id;
+    session.length = server->history.epoch;
+    (void)send_to_client(server, client_index, &session);
+}
+
+/* Queues the roster as WHO_RESPONSE pages from cursor on. */
+static void send_roster(ServerState* server, int client_index, int lane, int cursor, int page_size) {
+    for (;;) {
+        MessageInfo page;
+        msg_encode(&page, MSG_TYPE_WHO_RESPONSE, "Server", NULL, NULL);
+        int total = 0;
+        int n = roster_page(&server->roster, cursor, page_size, page.message, sizeof(page.message), &total);
+        cursor += n;
+        page.count = total;
+        page.cursor = (n > 0 && cursor < total) ? cursor : -1;
+        if (send_to_client_lane(server, client_index, lane, &page) == SOCKET_ERROR) return;
+        if (page.cursor < 0) return;
+    }
+}
+
+/* Queues room frames newer than after_seq. Called with clients_mutex held,
+ * in the same critical section that puts the client in the room, so a live
+ * broadcast is queued either before the replay snapshot or after it. */
+static void replay_history(ServerState* server, int client_index, uint64_t after_seq) {
+    Client* c = &server->clients[client_index];
+    uint64_t oldest = 0, latest = 0;
+    int lost = 0;
+    history_bounds(&server->history, &oldest, &latest);
+    if (after_seq < latest) {
+        uint64_t from = after_seq + 1;
+        if (from < oldest) {
+            lost = 1;
+            char note[96];
+            snprintf(note, sizeof(note), "%llu messages were lost", (unsigned long long)(oldest - from));
+            system_msg_to_client(server, client_index, note);
+            from = oldest;
+        }
+        for (uint64_t seq = from; seq <= latest; seq++) {
+            MessageInfo frame;
+            if (!history_get(&server->history, seq, &frame)) continue;
+            if (frame.type == MSG_TYPE_CHAT && frame.client_id == c->client_id) continue;
+            int suppressed = filter_check(&c->filter, &frame, filter_key(frame.nickname));
+            if (suppressed != FILTER_PASS) {
+                stats_record_filtered(&server->stats, suppressed);
+                continue;
+            }
+            if (send_to_client_lane(server, client_index, OUTBOX_HISTORY, &frame) == SOCKET_ERROR) break;
+        }
+    }
+    /* presence deltas may have been among the lost ones */
+    if (lost) send_roster(server, client_index, OUTBOX_HISTORY, 0, WHO_PAGE_MAX);
+}
+
+/* Refills the room frames a full lane held back (see push_frame) once the
+ * client has drained what was queued before them. Holding clients_mutex,
+ * like a broadcast, keeps live frames out of the refill. */
+static void repair_gaps(ServerState* server) {
+    pthread_mutex_lock(&server->clients_mutex);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (!server->clients[i].active) continue;
+        uint64_t from = outbox_take_gap(server->clients[i].outbox);
+        if (from) replay_history(server, i, from - 1);
+    }
+    pthread_mutex_unlock(&server->clients_mutex);
+}
+
+static void* session_sweeper_thread(void* arg) {
+    ServerState* server = arg;
+    Session expired[SESSION_MAX];
+    time_t swept = 0;
+    /* polls often enough for server_cleanup to join it without a wait */
+    while (!__atomic_load_n(&server->stopping, __ATOMIC_SEQ_CST)) {
+        sleep_ms(HANDOFF_POLL_MS);
+        repair_gaps(server);
+        time_t now = time(NULL);
+        if (now == swept) continue;
+        swept = now;
+        int n = session_expire(&server->sessions, now, expired, SESSION_MAX);
+        for (int i = 0; i < n; i++) {
+            roster_remove(&server->roster, expired[i].client_id);
+            presence_left(&server->presence, expired[i].client_id, expired[i].nickname);
+            print_system_message("Held session expired");
+            printf("Nickname: " CYAN "%s" RESET " (ID: " YELLOW "%d" RESET ")\n", expired[i].nickname, expired[i].client_id);
+        }
+    }
+    return NULL;
+}
+
+static void* presence_thread(void* arg) {
+    ServerState* server = arg;
+    PresenceEvent events[PRESENCE_MAX_PENDING];
+    for (;;) {
+        int n = presence_collect(&server->presence, events, PRESENCE_MAX_PENDING, PRESENCE_WINDOW_MS);
+        if (n < 0) break;
+        int sent = 0;
+        while (sent < n) {
+            MessageInfo delta;
+            int consumed = 0;
+            msg_encode(&delta, MSG_TYPE_PRESENCE, "Server", NULL, NULL);
+            presence_format(events + sent, n - sent, delta.message, sizeof(delta.message), &consumed);
+            if (consumed == 0) break;
+            delta.count = consumed;
+            broadcast_message(server, &delta, -1);
+            sent += consumed;
+        }
+    }
+    return NULL;
+}
+
+static void start_presence(ServerState* server) {
+    if (pthread_create(&server->presence_tid, NULL, presence_thread, server) == 0) {
+        server->presence_running = 1;
+    } else {
+        print_error("Failed to create presence thread");
+    }
+}
+
+/* Stops every thread that queues frames or writes to clients on its own
+ * account, so a hot restart can hand the connections over in one piece. */
+void server_pause_background(ServerState* server) {
+    presence_close(&server->presence);
+    if (server->presence_running) pthread_join(server->presence_tid, NULL);
+    server->presence_running = 0;
+    search_pause(server->search);
+    transfer_pause(server->transfers);
+    admission_pause(server->admission);
+}
+
+void server_resume_background(ServerState* server) {
+    presence_reopen(&server->presence);
+    start_presence(server);
+    search_resume(server->search);
+    transfer_resume(server->transfers);
+    admission_resume(server->admission);
+}
+
 typedef struct {
     ServerState* server;
     int client_index;
 } client_thread_data_t;
 
-static int handle_join_message(ServerState* server, int client_index, const MessageInfo* msg) {
+static void offer_multicast(ServerState* server, int client_index) {
+    /* a local connection already skips the network stack */
+    if (!server->multicast || server->clients[client_index].local) return;
+    MessageInfo offer;
+    msg_encode(&offer, MSG_TYPE_MULTICAST, "Server", NULL, NULL);
+    offer.cursor = MCAST_OFFER;
+    multicast_offer(server->multicast, &offer);
+    (void)send_to_client(server, client_index, &offer);
+}
+
+/* Packed frames start with whatever the client queues after this. */
+static void negotiate_compression(ServerState* server, int client_index, const MessageInfo* msg) {
+    if (server->compress && (msg->flags & MSG_FLAG_COMPRESS) && msg->cursor == COMPRESS_DICT_VERSION) {
+        outbox_set_compression(server->clients[client_index].outbox, 1);
+    }
+}
+
+static int handle_join_message(ServerState* server, int client_index, MessageInfo* msg) {
     char reason[64] = {0};
     if (!validate_nickname(msg->nickname, reason, sizeof(reason))) {
-        MessageInfo error_msg = {0};
-        error_msg.type = MSG_TYPE_NICKNAME_TAKEN;
-        safe_strcpy(error_msg.nickname, "Server", sizeof(error_msg.nickname));
+        MessageInfo error_msg;
+        msg_encode(&error_msg, MSG_TYPE_NICKNAME_TAKEN, "Server", NULL, NULL);
         snprintf(error_msg.message, sizeof(error_msg.message), "Invalid nickname: %s. Allowed: letters, digits, . _ - and < %d chars.", reason, MAX_NICK_LEN);
-        error_msg.timestamp = time(NULL);
-        (void)send_message(server->clients[client_index].socket, &error_msg);
+        (void)send_to_client(server, client_index, &error_msg);
         return 0;
     }
     if (!is_nickname_available(server, msg->nickname)) {
-        MessageInfo taken_msg = {0};
-        taken_msg.type = MSG_TYPE_NICKNAME_TAKEN;
-        safe_strcpy(taken_msg.nickname, "Server", sizeof(taken_msg.nickname));
+        MessageInfo taken_msg;
+        msg_encode(&taken_msg, MSG_TYPE_NICKNAME_TAKEN, "Server", NULL, NULL);
         snprintf(taken_msg.message, sizeof(taken_msg.message), "Nickname '%s' is already taken. Please choose another.", msg->nickname);
-        taken_msg.timestamp = time(NULL);
-        (void)send_message(server->clients[client_index].socket, &taken_msg);
+        (void)send_to_client(server, client_index, &taken_msg);
         return 0;
     }
     char old_nick[MAX_NICK_LEN];
+    negotiate_compression(server, client_index, msg);
     pthread_mutex_lock(&server->clients_mutex);
     safe_strcpy(old_nick, server->clients[client_index].nickname, sizeof(old_nick));
+    follow_rename(server, old_nick, msg->nickname);
     safe_strcpy(server->clients[client_index].nickname, msg->nickname, sizeof(server->clients[client_index].nickname));
+    filter_set_nickname(&server->clients[client_index].filter, msg->nickname);
+    /* a client with a local cache from this server run only needs what it missed */
+    if (strcmp(old_nick, "Anonymous") == 0 && msg->seq > 0 && msg->length == server->history.epoch) {
+        replay_history(server, client_index, msg->seq);
+    }
     pthread_mutex_unlock(&server->clients_mutex);
+    roster_upsert(&server->roster, server->clients[client_index].client_id, msg->nickname);
     print_system_message("User joined the chat");
     printf("Nickname: " CYAN "%s" RESET " (ID: " YELLOW "%d" RESET ")\n", msg->nickname, server->clients[client_index].client_id);
-    MessageInfo success_msg = (MessageInfo){0};
-    success_msg.type = MSG_TYPE_NICKNAME_AVAILABLE;
-    safe_strcpy(success_msg.nickname, "Server", sizeof(success_msg.nickname));
+    MessageInfo success_msg;
+    msg_encode(&success_msg, MSG_TYPE_NICKNAME_AVAILABLE, "Server", NULL, NULL);
     snprintf(success_msg.message, sizeof(success_msg.message), "Nickname '%s' is registered!", msg->nickname);
-    success_msg.timestamp = time(NULL);
-    (void)send_message(server->clients[client_index].socket, &success_msg);
-    MessageInfo join_msg = *msg;
-    join_msg.type = MSG_TYPE_SYSTEM;
-    snprintf(join_msg.message, sizeof(join_msg.message), "%s joined the chat", msg->nickname);
-    broadcast_message(server, &join_msg, client_index);
+    (void)send_to_client(server, client_index, &success_msg);
+    char token[SESSION_TOKEN_LEN + 1];
+    if (session_issue(&server->sessions, server->clients[client_index].client_id, msg->nickname, token) == 0) {
+        send_session(server, client_index, token);
+    }
+    if (strcmp(old_nick, "Anonymous") == 0) offer_multicast(server, client_index);
+    if (strcmp(old_nick, "Anonymous") == 0) presence_joined(&server->presence, server->clients[client_index].client_id, msg->nickname);
+    else presence_renamed(&server->presence, server->clients[client_index].client_id, old_nick, msg->nickname);
     return 0;
 }
 
-static int handle_private_message(ServerState* server, int client_index, const MessageInfo* msg) {
+static int handle_private_message(ServerState* server, int client_index, MessageInfo* msg) {
+    /* the recipient's ignore list must see who really sent it */
+    msg->client_id = server->clients[client_index].client_id;
+    if (!may_speak_as(server, client_index, msg->nickname)) {
+        safe_strcpy(msg->nickname, server->clients[client_index].nickname, sizeof(msg->nickname));
+    }
     printf(MAGENTA "[PRIVATE]" RESET " From " CYAN "%s" RESET " to " CYAN "%s" RESET ": %s\n", msg->nickname, msg->target_nickname, msg->message);
     if (server_send_private_message(server, msg) != 0) {
         char buf[128];
         snprintf(buf, sizeof(buf), "User '%s' not found or offline.", msg->target_nickname);
-        system_msg_to_socket(server->clients[client_index].socket, buf);
+        system_msg_to_client(server, client_index, buf);
     }
     return 0;
 }
 
-static int handle_leave_message(ServerState* server, int client_index, const MessageInfo* msg) {
+static int handle_leave_message(ServerState* server, int client_index, MessageInfo* msg) {
+    server->clients[client_index].leaving = 1;
     print_system_message("User left the chat");
     printf("Nickname: " CYAN "%s" RESET " (ID: " YELLOW "%d" RESET ")\n", msg->nickname, server->clients[client_index].client_id);
-    MessageInfo leave_msg = *msg;
-    leave_msg.type = MSG_TYPE_SYSTEM;
-    snprintf(leave_msg.message, sizeof(leave_msg.message), "%s left the chat", msg->nickname);
-    broadcast_message(server, &leave_msg, client_index);
     return 1;
 }
 
-static int handle_rename_message(ServerState* server, int client_index, const MessageInfo* msg) {
+static int handle_rename_message(ServerState* server, int client_index, MessageInfo* msg) {
     const char* desired = msg->target_nickname;
     char old_nick[MAX_NICK_LEN] = {0};
     int rc = set_client_nickname(server, client_index, desired, old_nick, sizeof(old_nick));
     if (rc == 0) {
+        roster_upsert(&server->roster, server->clients[client_index].client_id, desired);
+        session_rename(&server->sessions, server->clients[client_index].client_id, desired);
         char ok[128];
         snprintf(ok, sizeof(ok), "Nickname changed to '%s'.", desired);
-        system_msg_to_socket(server->clients[client_index].socket, ok);
-        char line[2*MAX_NICK_LEN + 32];
-        snprintf(line, sizeof(line), "[Nickname changed from %s to %s]", old_nick, desired);
-        system_msg_broadcast(server, line, client_index);
+        system_msg_to_client(server, client_index, ok);
+        if (strcmp(old_nick, "Anonymous") == 0) presence_joined(&server->presence, server->clients[client_index].client_id, desired);
+        else presence_renamed(&server->presence, server->clients[client_index].client_id, old_nick, desired);
     } else {
         char why[160];
         if (rc == -2) snprintf(why, sizeof(why), "Invalid nickname.");
         else if (rc == -3) snprintf(why, sizeof(why), "Nickname '%s' is already taken.", desired);
         else snprintf(why, sizeof(why), "Unable to change nickname.");
-        MessageInfo err = {0};
-        err.type = MSG_TYPE_NICKNAME_TAKEN;
-        safe_strcpy(err.nickname, "Server", sizeof(err.nickname));
-        safe_strcpy(err.message, why, sizeof(err.message));
-        err.timestamp = time(NULL);
-        (void)send_message(server->clients[client_index].socket, &err);
+        MessageInfo err;
+        msg_encode(&err, MSG_TYPE_NICKNAME_TAKEN, "Server", NULL, why);
+        (void)send_to_client(server, client_index, &err);
+    }
+    return 0;
+}
+
+static int handle_who_message(ServerState* server, int client_index, MessageInfo* msg) {
+    int cursor = msg->cursor > 0 ? msg->cursor : 0;
+    int page_size = msg->count > 0 ? msg->count : WHO_PAGE_DEFAULT;
+    if (page_size > WHO_PAGE_MAX) page_size = WHO_PAGE_MAX;
+    send_roster(server, client_index, outbox_lane_for(MSG_TYPE_WHO_RESPONSE), cursor, page_size);
+    return 0;
+}
+
+static int handle_resume_message(ServerState* server, int client_index, MessageInfo* msg) {
+    Session session;
+    /* only a connection that has not joined yet may take a session over */
+    pthread_mutex_lock(&server->clients_mutex);
+    int joined = strcmp(server->clients[client_index].nickname, "Anonymous") != 0;
+    pthread_mutex_unlock(&server->clients_mutex);
+    if (joined) {
+        system_msg_to_client(server, client_index, "Already in the room, cannot resume another session.");
+        return 0;
+    }
+    if (!session_resume(&server->sessions, msg->message, &session)) {
+        MessageInfo failed;
+        msg_encode(&failed, MSG_TYPE_RESUME_FAILED, "Server", NULL, "Session expired, joining again.");
+        (void)send_to_client(server, client_index, &failed);
+        return 0;
     }
+    negotiate_compression(server, client_index, msg);
+    pthread_mutex_lock(&server->clients_mutex);
+    if (!session.held) {
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            Client* old = &server->clients[i];
+            if (i != client_index && old->active && old->client_id == session.client_id) {
+                old->detached = 1;
+                shutdown(old->socket, SHUTDOWN_BOTH);
+            }
+        }
+    }
+    server->clients[client_index].client_id = session.client_id;
+    safe_strcpy(server->clients[client_index].nickname, session.nickname, sizeof(server->clients[client_index].nickname));
+    filter_set_nickname(&server->clients[client_index].filter, session.nickname);
+    send_session(server, client_index, session.token);
+    replay_history(server, client_index, msg->seq);
+    pthread_mutex_unlock(&server->clients_mutex);
+    offer_multicast(server, client_index);
+    print_system_message("Session resumed");
+    printf("Nickname: " CYAN "%s" RESET " (ID: " YELLOW "%d" RESET ")\n", session.nickname, session.client_id);
     return 0;
 }
 
-static int process_message(ServerState* server, int client_index, const MessageInfo* msg) {
+static int handle_ping_message(ServerState* server, int client_index, MessageInfo* msg) {
+    MessageInfo pong = *msg;
+    pong.type = MSG_TYPE_PONG;
+    safe_strcpy(pong.nickname, "Server", sizeof(pong.nickname));
+    pthread_mutex_lock(&server->clients_mutex);
+    pong.trace[TRACE_SERVER_ENQUEUE] = monotonic_ns();
+    (void)send_to_client(server, client_index, &pong);
+    pthread_mutex_unlock(&server->clients_mutex);
+    stats_record_trace(&server->stats, &pong);
+    return 0;
+}
+
+static int handle_search_message(ServerState* server, int client_index, MessageInfo* msg) {
+    pthread_mutex_lock(&server->clients_mutex);
+    int client_id = server->clients[client_index].client_id;
+    int joined = strcmp(server->clients[client_index].nickname, "Anonymous") != 0;
+    pthread_mutex_unlock(&server->clients_mutex);
+    if (!joined) {
+        system_msg_to_client(server, client_index, "Join the room before searching");
+        return 0;
+    }
+    if (!server->search) {
+        system_msg_to_client(server, client_index, "Search is unavailable");
+        return 0;
+    }
+    if (search_submit_query(server->search, client_index, client_id, msg->message) != 0) {
+        system_msg_to_client(server, client_index, "Search is busy, try again shortly");
+    }
+    return 0;
+}
+
+static int handle_file_message(ServerState* server, int client_index, MessageInfo* msg) {
+    if (!server->transfers) {
+        if (msg->type == MSG_TYPE_FILE_OFFER) system_msg_to_client(server, client_index, "File transfer is unavailable");
+        return msg->type == MSG_TYPE_FILE_DATA ? 1 : 0;
+    }
     switch (msg->type) {
-        case MSG_TYPE_JOIN:
-            return handle_join_message(server, client_index, msg);
-        case MSG_TYPE_CHAT:
-            print_message(msg->nickname, msg->message);
-            broadcast_message(server, msg, client_index);
+        case MSG_TYPE_FILE_OFFER:
+            if (strcmp(server->clients[client_index].nickname, "Anonymous") == 0) {
+                system_msg_to_client(server, client_index, "Join the room before sending files");
+                return 0;
+            }
+            transfer_offer(server->transfers, client_index, msg);
+            return 0;
+        case MSG_TYPE_FILE_DATA:
+            return transfer_receive_chunk(server->transfers, client_index, msg) == 0 ? 0 : 1;
+        case MSG_TYPE_FILE_ACK:
+            transfer_ack(server->transfers, client_index, msg);
             return 0;
-        case MSG_TYPE_PRIVATE:
-            return handle_private_message(server, client_index, msg);
-        case MSG_TYPE_LEAVE:
-            return handle_leave_message(server, client_index, msg);
-        case MSG_TYPE_RENAME:
-            return handle_rename_message(server, client_index, msg);
         default:
-            print_error("Unknown message type received");
+            transfer_finish(server->transfers, client_index, msg);
             return 0;
     }
 }
 
+/* Filters apply to this connection only. Success is silent: the client
+ * confirms locally, and it replays its filters after every reconnect. */
+static int handle_filter_message(ServerState* server, int client_index, MessageInfo* msg) {
+    char reason[64] = {0};
+    if (msg->count != FILTER_OP_MODE && !validate_nickname(msg->target_nickname, reason, sizeof(reason))) {
+        system_msg_to_client(server, client_index, "Invalid nickname.");
+        return 0;
+    }
+    DeliveryFilter* f = &server->clients[client_index].filter;
+    int rc = 0;
+    pthread_mutex_lock(&server->clients_mutex);
+    if (msg->count == FILTER_OP_IGNORE) {
+        rc = filter_ignore(f, msg->target_nickname);
+    } else if (msg->count == FILTER_OP_UNIGNORE) {
+        (void)filter_unignore(f, msg->target_nickname);
+    } else if (msg->count == FILTER_OP_MODE && msg->cursor >= DELIVER_ALL && msg->cursor <= DELIVER_MUTED) {
+        f->mode = msg->cursor;
+    } else {
+        rc = -2;
+    }
+    pthread_mutex_unlock(&server->clients_mutex);
+    if (rc == -1) system_msg_to_client(server, client_index, "Ignore list is full.");
+    else if (rc == -2) system_msg_to_client(server, client_index, "Unknown filter request.");
+    return 0;
+}
+
+/* MCAST_SUBSCRIBE stops unicast room frames to this connection. The reply
+ * goes on the chat lane, behind every room frame already queued for it, so
+ * its seq is where the client starts taking frames from the group; if the
+ * lane drops it, the client is left on unicast rather than cut off. A
+ * MCAST_NACK gap is resent from history over TCP, unfiltered so the
+ * client's sequence stays contiguous. */
+static int handle_multicast_message(ServerState* server, int client_index, MessageInfo* msg) {
+    if (!server->multicast) return 0;
+    MessageInfo reply;
+    msg_encode(&reply, MSG_TYPE_MULTICAST, "Server", NULL, NULL);
+    if (msg->cursor == MCAST_SUBSCRIBE) {
+        pthread_mutex_lock(&server->clients_mutex);
+        reply.cursor = MCAST_SUBSCRIBED;
+        history_bounds(&server->history, NULL, &reply.seq);
+        if (outbox_push(server->clients[client_index].outbox, OUTBOX_CHAT, &reply) == 0) server->clients[client_index].multicast = 1;
+        pthread_mutex_unlock(&server->clients_mutex);
+        return 0;
+    }
+    if (msg->cursor != MCAST_NACK || msg->seq == 0 || msg->count <= 0) return 0;
+    uint64_t oldest = 0, latest = 0;
+    history_bounds(&server->history, &oldest, &latest);
+    uint64_t from = msg->seq;
+    uint64_t to = from + (uint64_t)(msg->count < MULTICAST_NACK_MAX ? msg->count : MULTICAST_NACK_MAX) - 1;
+    if (to > latest) to = latest;
+    int repaired = 0, lost = 0;
+    if (from <= to && from < oldest) {
+        reply.cursor = MCAST_LOST;
+        reply.seq = to < oldest ? to : oldest - 1;
+        reply.count = (int)(reply.seq - from + 1);
+        lost = reply.count;
+        (void)send_to_client_lane(server, client_index, OUTBOX_HISTORY, &reply);
+        from = reply.seq + 1;
+    }
+    for (uint64_t seq = from; seq <= to; seq++) {
+        MessageInfo frame;
+        if (!history_get(&server->history, seq, &frame)) continue;
+        if (send_to_client_lane(server, client_index, OUTBOX_HISTORY, &frame) == SOCKET_ERROR) break;
+        repaired++;
+    }
+    multicast_note_repair(server->multicast, repaired, lost);
+    return 0;
+}
+
+static int handle_chat_message(ServerState* server, int client_index, MessageInfo* msg) {
+    msg->client_id = server->clients[client_index].client_id;
+    if (!may_speak_as(server, client_index, msg->nickname)) {
+        safe_strcpy(msg->nickname, server->clients[client_index].nickname, sizeof(msg->nickname));
+    }
+    print_message(msg->nickname, msg->message);
+    broadcast_message(server, msg, client_index);
+    return 0;
+}
+
+/* A handler returns 1 when the connection should be closed. Every type a
+ * client may send (see MSG_TYPES) needs an entry; msg_decode has already
+ * turned away the rest. */
+typedef int (*message_handler_t)(ServerState* server, int client_index, MessageInfo* msg);
+
+static const message_handler_t message_handlers[MSG_TYPE_COUNT] = {
+    [MSG_TYPE_CHAT] = handle_chat_message,
+    [MSG_TYPE_JOIN] = handle_join_message,
+    [MSG_TYPE_LEAVE] = handle_leave_message,
+    [MSG_TYPE_PRIVATE] = handle_private_message,
+    [MSG_TYPE_RENAME] = handle_rename_message,
+    [MSG_TYPE_WHO] = handle_who_message,
+    [MSG_TYPE_RESUME] = handle_resume_message,
+    [MSG_TYPE_PING] = handle_ping_message,
+    [MSG_TYPE_SEARCH] = handle_search_message,
+    [MSG_TYPE_FILE_OFFER] = handle_file_message,
+    [MSG_TYPE_FILE_DATA] = handle_file_message,
+    [MSG_TYPE_FILE_ACK] = handle_file_message,
+    [MSG_TYPE_FILE_END] = handle_file_message,
+    [MSG_TYPE_FILTER] = handle_filter_message,
+    [MSG_TYPE_MULTICAST] = handle_multicast_message,
+};
+
+static int process_message(ServerState* server, int client_index, MessageInfo* msg) {
+    size_t scanned = 0;
+    uint64_t sanitize_start = monotonic_ns();
+    int rewritten = sanitize_frame(msg, &scanned);
+    stats_record_sanitize(&server->stats, scanned, monotonic_ns() - sanitize_start, rewritten);
+    message_handler_t handler = message_handlers[msg->type];
+    return handler ? handler(server, client_index, msg) : 0;
+}
+
+static void run_client_task(ServerState* server, int client_index, MessageInfo* msg) {
+    if (process_message(server, client_index, msg) == 1) shutdown(server->clients[client_index].socket, SHUTDOWN_BOTH);
+}
+
+static int default_worker_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long n = (long)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 2) n = 2;
+    if (n > WORKER_POOL_MAX) n = WORKER_POOL_MAX;
+    return (int)n;
+}
+
+/* With hot restart enabled, readers wait for frames in short slices so
+ * they can park between two frames when a successor takes over. */
+static void wait_for_frame(ServerState* server, int client_index) {
+    SOCKET sock = server->clients[client_index].socket;
+    for (;;) {
+        if (handoff_pending(server->handoff)) {
+            worker_pool_drain(server->workers, client_index);
+            handoff_park(server->handoff);
+            continue;
+        }
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(sock, &readable);
+        struct timeval tv = {0, HANDOFF_POLL_MS * 1000};
+        if (select((int)sock + 1, &readable, NULL, NULL, &tv) != 0) return;
+    }
+}
+
+/* Reads and decodes this connection's frames; the worker pool handles them. */
 void* handle_client(void* arg) {
     client_thread_data_t* data = arg;
     ServerState* server = data->server;
     int client_index = data->client_index;
     free(data);
     MessageInfo msg;
-    char client_ip[INET_ADDRSTRLEN] = {0};
-    inet_ntop(AF_INET, &server->clients[client_index].address.sin_addr, client_ip, INET_ADDRSTRLEN);
-    print_system_message("New client connected");
-    printf("Client IP: " CYAN "%s" RESET ", Port: " CYAN "%d" RESET ", ID: " YELLOW "%d" RESET "\n", client_ip, ntohs(server->clients[client_index].address.sin_port), server->clients[client_index].client_id);
-    system_msg_to_socket(server->clients[client_index].socket, "Welcome to the chat room!");
+    Client* c = &server->clients[client_index];
+    print_system_message(c->adopted ? "Client handed over" : "New client connected");
+    if (c->local) {
+        printf("Local socket, UID: " CYAN "%d" RESET ", PID: " CYAN "%d" RESET ", ID: " YELLOW "%d" RESET "%s\n", c->peer_uid, c->peer_pid, c->client_id, c->trusted ? GREEN " (trusted)" RESET : "");
+    } else {
+        char client_ip[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &c->address.sin_addr, client_ip, INET_ADDRSTRLEN);
+        printf("Client IP: " CYAN "%s" RESET ", Port: " CYAN "%d" RESET ", ID: " YELLOW "%d" RESET "\n", client_ip, ntohs(c->address.sin_port), c->client_id);
+    }
+    if (!c->adopted) system_msg_to_client(server, client_index, "Welcome to the chat room!");
+    int conn_id = server->clients[client_index].client_id;
+    capture_event(server->capture, conn_id, CAPTURE_OPEN);
     int should_disconnect = 0;
     while (!should_disconnect) {
+        if (server->handoff) wait_for_frame(server, client_index);
         int bytes_received = receive_message(server->clients[client_index].socket, &msg);
         if (bytes_received <= 0) {
             print_error("Client disconnected or error occurred");
             break;
         }
-        int result = process_message(server, client_index, &msg);
-        if (result == 1) should_disconnect = 1;
+        capture_frame(server->capture, conn_id, &msg);
+        if (msg_decode(&msg, MSG_FROM_CLIENT) != 0) {
+            stats_record_frame(&server->stats, 0, 0);
+            print_error("Unknown message type received");
+            continue;
+        }
+        unsigned long long nth = stats_record_frame(&server->stats, msg.type, 1);
+        /* a sample of the room's own traffic is traced next to the clients' probes */
+        if (msg.type == MSG_TYPE_CHAT && nth % TRACE_SAMPLE_CHAT == 0) msg.flags |= MSG_FLAG_TRACE;
+        if (msg.flags & MSG_FLAG_TRACE) msg.trace[TRACE_SERVER_RECV] = monotonic_ns();
+        if (msg.type == MSG_TYPE_FILE_DATA || !server->workers) {
+            /* a chunk's payload follows on the socket, so it is read here,
+             * after everything this client sent before it has been handled */
+            worker_pool_drain(server->workers, client_index);
+            should_disconnect = process_message(server, client_index, &msg) == 1;
+        } else {
+            worker_pool_submit(server->workers, client_index, &msg);
+            should_disconnect = msg.type == MSG_TYPE_LEAVE;
+        }
     }
+    worker_pool_drain(server->workers, client_index);
+    capture_event(server->capture, conn_id, CAPTURE_CLOSE);
     remove_client(server, client_index);
     pthread_exit(NULL);
 }
 
+static int start_reader(ServerState* server, int client_index) {
+    client_thread_data_t* thread_data = malloc(sizeof(client_thread_data_t));
+    if (!thread_data) {
+        print_error("Failed to allocate memory for thread data");
+        remove_client(server, client_index);
+        return -1;
+    }
+    thread_data->server = server;
+    thread_data->client_index = client_index;
+    if (pthread_create(&server->clients[client_index].thread_id, NULL, handle_client, thread_data) != 0) {
+        print_error("Failed to create client thread");
+        remove_client(server, client_index);
+        free(thread_data);
+        return -1;
+    }
+    pthread_detach(server->clients[client_index].thread_id);
+    return 0;
+}
+
+/* Search only sees frames broadcast by this process; give it the room
+ * history a predecessor handed over. */
+static void index_history(ServerState* server) {
+    uint64_t oldest = 0, latest = 0;
+    MessageInfo frame;
+    if (!server->search) return;
+    history_bounds(&server->history, &oldest, &latest);
+    for (uint64_t seq = oldest; seq <= latest; seq++) {
+        if (history_get(&server->history, seq, &frame) && frame.type == MSG_TYPE_CHAT) search_index_message(server->search, &frame);
+    }
+}
+
+static void print_roster(Roster* roster) {
+    char page[MAX_MSG_LEN];
+    int cursor = 0, total = 0;
+    printf(CYAN "=== Online users ===" RESET "\n");
+    for (;;) {
+        int n = roster_page(roster, cursor, WHO_PAGE_MAX, page, sizeof(page), &total);
+        if (n <= 0) break;
+        printf("%s", page);
+        cursor += n;
+    }
+    printf(GRAY "(%d online)" RESET "\n", total);
+}
+
+static void print_server_stats(ServerState* server) {
+    stats_print(&server->stats);
+    if (server->bus) {
+        unsigned long long overruns = 0, dropped = 0;
+        shm_bus_stats(server->bus, &overruns, &dropped);
+        printf("Shared-memory bus: " YELLOW "%llu" RESET " overruns, " YELLOW "%llu" RESET " frames dropped\n", overruns, dropped);
+    }
+    worker_pool_print_stats(server->workers);
+    outbox_print_stats(server);
+    search_print_stats(server->search);
+    transfer_print_stats(server->transfers);
+    capture_print_stats(server->capture);
+    multicast_print_stats(server->multicast);
+    admission_print_stats(server->admission);
+}
+
 void* server_input_thread(void* arg) {
     ServerState* server = arg;
     char buffer[MAX_MSG_LEN];
@@ -448,19 +1259,25 @@ void* server_input_thread(void* arg) {
 
         if (strcmp(buffer, "/quit") == 0) {
             print_system_message("Shutting down server...");
-            server_cleanup(server);
-            exit(0);
+            /* the accept loop tears down what it is still using */
+            __atomic_store_n(&server->stopping, 1, __ATOMIC_RELAXED);
+            shutdown(server->server_socket, SHUTDOWN_BOTH);
+            return NULL;
         }
         if (strcmp(buffer, "/help") == 0) {
             print_server_help();
         }
+        if (strcmp(buffer, "/who") == 0) {
+            print_roster(&server->roster);
+            continue;
+        }
+        if (strcmp(buffer, "/stats") == 0) {
+            print_server_stats(server);
+            continue;
+        }
         if (parse_private_message(buffer, target, message) == 0) {
-            MessageInfo msg = (MessageInfo){0};
-            msg.type = MSG_TYPE_PRIVATE;
-            safe_strcpy(msg.nickname, "Server", sizeof(msg.nickname));
-            safe_strcpy(msg.target_nickname, target, sizeof(msg.target_nickname));
-            safe_strcpy(msg.message, message, sizeof(msg.message));
-            msg.timestamp = time(NULL);
+            MessageInfo msg;
+            msg_encode(&msg, MSG_TYPE_PRIVATE, "Server", target, message);
 
             if (server_send_private_message(server, &msg) != 0) {
                 char why[160];
@@ -468,7 +1285,7 @@ void* server_input_thread(void* arg) {
                 pthread_mutex_lock(&server->clients_mutex);
                 for (int i = 0; i < MAX_CLIENTS; i++) {
                     if (server->clients[i].active) {
-                        system_msg_to_socket(server->clients[i].socket, why);
+                        system_msg_to_client(server, i, why);
                     }
                 }
                 pthread_mutex_unlock(&server->clients_mutex);
@@ -476,11 +1293,8 @@ void* server_input_thread(void* arg) {
             continue;
         }
 
-        MessageInfo msg = (MessageInfo){0};
-        msg.type = MSG_TYPE_SYSTEM;
-        safe_strcpy(msg.nickname, "Server", sizeof(msg.nickname));
-        safe_strcpy(msg.message, buffer, sizeof(msg.message));
-        msg.timestamp = time(NULL);
+        MessageInfo msg;
+        msg_encode(&msg, MSG_TYPE_SYSTEM, "Server", NULL, buffer);
         broadcast_message(server, &msg, -1);
     }
 
@@ -490,46 +1304,155 @@ void* server_input_thread(void* arg) {
 
 int main(int argc, char* argv[]) {
     int port = DEFAULT_PORT;
-    ServerState server;
-    if (argc > 1) port = atoi(argv[1]);
+    const char* bus_name = NULL;
+    const char* capture_path = NULL;
+    const char* multicast_group = NULL;
+    const char* multicast_iface = NULL;
+    const char* local_path = NULL;
+    const char* handoff_path = NULL;
+    Takeover* takeover = NULL;
+    int trusted_uid = -1;
+    int compress = 0;
+    AdmissionLimits limits = {ADMISSION_PER_IP, ADMISSION_MAX_QUEUED, ADMISSION_MAX_LAG_MS, ADMISSION_MAX_RSS_MB};
+    int workers = 0;
+    /* not on main's stack: a reader still finishing at exit may look at it */
+    static ServerState server;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bus") == 0 && i + 1 < argc) bus_name = argv[++i];
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) capture_path = argv[++i];
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--multicast") == 0 && i + 1 < argc) multicast_group = argv[++i];
+        else if (strcmp(argv[i], "--multicast-if") == 0 && i + 1 < argc) multicast_iface = argv[++i];
+        else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) local_path = argv[++i];
+        else if (strcmp(argv[i], "--unix-trust") == 0 && i + 1 < argc) trusted_uid = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--compress") == 0) compress = 1;
+        else if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc) handoff_path = argv[++i];
+        else if (strcmp(argv[i], "--max-per-ip") == 0 && i + 1 < argc) limits.per_ip = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--shed-queue") == 0 && i + 1 < argc) limits.max_queued = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--shed-lag") == 0 && i + 1 < argc) limits.max_lag_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--shed-rss") == 0 && i + 1 < argc) limits.max_rss_mb = atoi(argv[++i]);
+        else port = atoi(argv[i]);
+    }
     print_system_message("Starting chat server...");
-    printf("Port: " BOLD_CYAN "%d" RESET "\n", port);
-    if (server_init(&server, port) != 0) {
+    if (handoff_path && handoff_request(handoff_path, &takeover) < 0) {
         return 1;
     }
+    if (takeover) {
+        if (server_adopt(&server, takeover) != 0) {
+            return 1;
+        }
+        printf("Took over " YELLOW "%d" RESET " connections\n", server.client_count);
+    } else {
+        printf("Port: " BOLD_CYAN "%d" RESET "\n", port);
+        if (server_init(&server, port, local_path) != 0) {
+            return 1;
+        }
+    }
+    server.compress = compress;
+    if (compress) printf("Compressing frames for clients that ask (dictionary v" BOLD_CYAN "%d" RESET ")\n", COMPRESS_DICT_VERSION);
+    if (server.local_socket != INVALID_SOCKET) {
+        server.trusted_uid = trusted_uid;
+        printf("Local socket: " BOLD_CYAN "%s" RESET "\n", server.local_path);
+        if (trusted_uid >= 0) printf("Trusting local bots with UID " BOLD_CYAN "%d" RESET "\n", trusted_uid);
+    }
+    if (bus_name) {
+        server.bus = shm_bus_open(bus_name);
+        if (!server.bus) {
+            server_cleanup(&server);
+            return 1;
+        }
+        if (pthread_create(&server.bus_tid, NULL, bus_reader_thread, &server) != 0) {
+            print_error("Failed to create shared-memory bus thread");
+            server_cleanup(&server);
+            return 1;
+        }
+        server.bus_running = 1;
+        printf("Shared-memory bus: " BOLD_CYAN "%s" RESET "\n", bus_name);
+    }
+    if (capture_path) {
+        server.capture = capture_open(capture_path);
+        if (!server.capture) {
+            server_cleanup(&server);
+            return 1;
+        }
+        printf("Capturing inbound traffic to " BOLD_CYAN "%s" RESET "\n", capture_path);
+    }
+    if (multicast_group) {
+        server.multicast = multicast_open(multicast_group, multicast_iface);
+        if (!server.multicast) {
+            server_cleanup(&server);
+            return 1;
+        }
+        printf("Room traffic multicast to " BOLD_CYAN "%s" RESET "\n", multicast_group);
+    }
+    if (workers <= 0) workers = default_worker_count();
+    server.workers = worker_pool_start(&server, workers, run_client_task);
+    if (server.workers) printf("Worker threads: " BOLD_CYAN "%d" RESET "\n", workers > WORKER_POOL_MAX ? WORKER_POOL_MAX : workers);
+    else print_error("Failed to start worker pool, handling messages on connection threads");
+    server.search = search_start(&server);
+    if (!server.search) print_error("Failed to start search index, /search is disabled");
+    server.transfers = transfer_start(&server);
+    if (!server.transfers) print_error("Failed to start file transfers, /send is disabled");
+    server.admission = admission_open(&server, &limits);
+    if (!server.admission) {
+        if (takeover) handoff_abandon(takeover);
+        server_cleanup(&server);
+        return 1;
+    }
+    if (takeover) {
+        index_history(&server);
+        handoff_complete(takeover);
+    }
+    if (handoff_path) {
+        server.handoff = handoff_listen(&server, handoff_path);
+        if (server.handoff) printf("Hot restart: " BOLD_CYAN "%s" RESET "\n", handoff_path);
+        else print_error("Failed to listen for a successor, hot restart is disabled");
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (server.clients[i].active && server.clients[i].adopted) (void)start_reader(&server, i);
+    }
     print_success("Server started successfully");
     print_system_message("Waiting for client connections...");
+    start_presence(&server);
+    if (pthread_create(&server.sweeper_tid, NULL, session_sweeper_thread, &server) == 0) {
+        server.sweeper_running = 1;
+    } else {
+        print_error("Failed to create session sweeper thread");
+    }
     pthread_t input_tid;
     if (pthread_create(&input_tid, NULL, server_input_thread, &server) == 0) {
         pthread_detach(input_tid);
     } else {
         print_error("Failed to create server input thread");
     }
-    while (1) {
-        struct sockaddr_in client_addr;
-        SOCKET client_socket = accept_connection(server.server_socket, &client_addr);
-        if (client_socket == INVALID_SOCKET) continue;
-        int client_index = add_client(&server, client_socket, client_addr);
-        if (client_index == -1) {
-            print_error("Maximum number of clients reached");
-            CLOSE_SOCKET(client_socket);
-            continue;
-        }
-        client_thread_data_t* thread_data = malloc(sizeof(client_thread_data_t));
-        if (!thread_data) {
-            print_error("Failed to allocate memory for thread data");
-            remove_client(&server, client_index);
-            continue;
+    while (!__atomic_load_n(&server.stopping, __ATOMIC_RELAXED)) {
+        if (handoff_pending(server.handoff)) handoff_park(server.handoff);
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(server.server_socket, &readable);
+        SOCKET highest = server.server_socket;
+        if (server.local_socket != INVALID_SOCKET) {
+            FD_SET(server.local_socket, &readable);
+            if (server.local_socket > highest) highest = server.local_socket;
         }
-        thread_data->server = &server;
-        thread_data->client_index = client_index;
-        if (pthread_create(&server.clients[client_index].thread_id, NULL, handle_client, thread_data) != 0) {
-            print_error("Failed to create client thread");
-            remove_client(&server, client_index);
-            free(thread_data);
-            continue;
+        /* wake up now and then to park for a hot restart or to stop */
+        struct timeval tv = {0, HANDOFF_POLL_MS * 1000};
+        if (select((int)highest + 1, &readable, NULL, NULL, &tv) <= 0) continue;
+        for (int local = 0; local < 2; local++) {
+            SOCKET listener = local ? server.local_socket : server.server_socket;
+            if (listener == INVALID_SOCKET || !FD_ISSET(listener, &readable)) continue;
+            AdmittedConn batch[ADMISSION_BATCH];
+            int admitted = admission_accept(server.admission, listener, local, batch, ADMISSION_BATCH);
+            for (int i = 0; i < admitted; i++) {
+                int client_index = add_client(&server, batch[i].socket, batch[i].address);
+                if (client_index < 0) {
+                    admission_refuse(server.admission, batch[i].socket, REFUSE_FULL);
+                    continue;
+                }
+                if (local) identify_local_peer(&server, client_index);
+                (void)start_reader(&server, client_index);
+            }
         }
-        pthread_detach(server.clients[client_index].thread_id);
     }
     server_cleanup(&server);
     return 0;
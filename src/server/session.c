@@ -0,0 +1,148 @@
+#include "../../include/common.h"
+
+/*
+ * Resumable sessions. A session is attached while its connection is alive
+ * and held for SESSION_GRACE_SECONDS after the connection drops without a
+ * LEAVE, keeping the nickname reserved and the user in the roster so a quick
+ * reconnect is invisible to everyone else.
+ */
+
+static void safe_strcpy(char* dst, const char* src, size_t cap) {
+    if (!dst || !cap) return;
+    if (!src) { dst[0] = '\0'; return; }
+    strncpy(dst, src, cap - 1);
+    dst[cap - 1] = '\0';
+}
+
+static void generate_token(char* out) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char raw[SESSION_TOKEN_LEN / 2];
+    size_t got = 0;
+#ifndef _WIN32
+    FILE* urandom = fopen("/dev/urandom", "rb");
+    if (urandom) {
+        got = fread(raw, 1, sizeof(raw), urandom);
+        fclose(urandom);
+    }
+#endif
+    if (got != sizeof(raw)) {
+        static int seeded = 0;
+        if (!seeded) {
+            srand((unsigned)time(NULL) ^ (unsigned)clock());
+            seeded = 1;
+        }
+        for (size_t i = 0; i < sizeof(raw); i++) raw[i] = (unsigned char)(rand() & 0xff);
+    }
+    for (size_t i = 0; i < sizeof(raw); i++) {
+        out[2 * i] = hex[raw[i] >> 4];
+        out[2 * i + 1] = hex[raw[i] & 0x0f];
+    }
+    out[SESSION_TOKEN_LEN] = '\0';
+}
+
+static Session* session_by_id(SessionTable* table, int client_id) {
+    for (int i = 0; i < SESSION_MAX; i++) {
+        if (table->sessions[i].in_use && table->sessions[i].client_id == client_id) return &table->sessions[i];
+    }
+    return NULL;
+}
+
+int session_table_init(SessionTable* table) {
+    memset(table, 0, sizeof(*table));
+    return pthread_mutex_init(&table->mutex, NULL);
+}
+
+void session_table_destroy(SessionTable* table) {
+    pthread_mutex_destroy(&table->mutex);
+}
+
+int session_issue(SessionTable* table, int client_id, const char* nickname, char* token_out) {
+    pthread_mutex_lock(&table->mutex);
+    Session* s = session_by_id(table, client_id);
+    for (int i = 0; !s && i < SESSION_MAX; i++) {
+        if (!table->sessions[i].in_use) s = &table->sessions[i];
+    }
+    if (!s) {
+        pthread_mutex_unlock(&table->mutex);
+        return -1;
+    }
+    if (!s->in_use) generate_token(s->token);
+    s->in_use = 1;
+    s->held = 0;
+    s->client_id = client_id;
+    safe_strcpy(s->nickname, nickname, sizeof(s->nickname));
+    safe_strcpy(token_out, s->token, SESSION_TOKEN_LEN + 1);
+    pthread_mutex_unlock(&table->mutex);
+    return 0;
+}
+
+void session_rename(SessionTable* table, int client_id, const char* nickname) {
+    pthread_mutex_lock(&table->mutex);
+    Session* s = session_by_id(table, client_id);
+    if (s) safe_strcpy(s->nickname, nickname, sizeof(s->nickname));
+    pthread_mutex_unlock(&table->mutex);
+}
+
+int session_hold(SessionTable* table, int client_id, time_t now) {
+    pthread_mutex_lock(&table->mutex);
+    Session* s = session_by_id(table, client_id);
+    if (s) {
+        s->held = 1;
+        s->expires = now + SESSION_GRACE_SECONDS;
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return s != NULL;
+}
+
+void session_drop(SessionTable* table, int client_id) {
+    pthread_mutex_lock(&table->mutex);
+    Session* s = session_by_id(table, client_id);
+    if (s) memset(s, 0, sizeof(*s));
+    pthread_mutex_unlock(&table->mutex);
+}
+
+/* On success *out is the session as it was before resuming; out->held == 0
+ * means the old connection is still attached and must be detached. */
+int session_resume(SessionTable* table, const char* token, Session* out) {
+    int found = 0;
+    pthread_mutex_lock(&table->mutex);
+    for (int i = 0; i < SESSION_MAX; i++) {
+        Session* s = &table->sessions[i];
+        if (s->in_use && strncmp(s->token, token, SESSION_TOKEN_LEN) == 0) {
+            *out = *s;
+            s->held = 0;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return found;
+}
+
+int session_nick_held(SessionTable* table, const char* nickname, int except_client_id) {
+    int held = 0;
+    pthread_mutex_lock(&table->mutex);
+    for (int i = 0; i < SESSION_MAX; i++) {
+        Session* s = &table->sessions[i];
+        if (s->in_use && s->held && s->client_id != except_client_id && strcmp(s->nickname, nickname) == 0) {
+            held = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return held;
+}
+
+int session_expire(SessionTable* table, time_t now, Session* out, int cap) {
+    int n = 0;
+    pthread_mutex_lock(&table->mutex);
+    for (int i = 0; i < SESSION_MAX && n < cap; i++) {
+        Session* s = &table->sessions[i];
+        if (s->in_use && s->held && s->expires <= now) {
+            out[n++] = *s;
+            memset(s, 0, sizeof(*s));
+        }
+    }
+    pthread_mutex_unlock(&table->mutex);
+    return n;
+}
@@ -0,0 +1,306 @@
+#include "../../include/common.h"
+
+#ifndef _WIN32
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * Multi-producer broadcast ring shared by co-located server processes.
+ * Frame n lives in ring[n % slots]; its seq word is 2n+1 while the producer
+ * is writing and 2n+2 once committed, so readers can detect both in-flight
+ * writes and being lapped (overrun) without any lock.
+ *
+ * Every process using the segment holds a shared flock on it. Its creator
+ * takes the lock exclusively right after creating the name and drops to
+ * shared once the header is written; until the magic is set, others wait.
+ * Whoever can take the lock exclusively on the way out is the last user
+ * and unlinks the name. A finished segment with another layout, left by a
+ * different build, is replaced the same way once nobody holds it.
+ */
+
+#define SHM_BUS_MAGIC 0x0053554254414843ULL
+
+typedef struct {
+    uint64_t seq;
+    int32_t origin;
+    MessageInfo frame;
+} ShmBusSlot;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t slots;
+    uint32_t frame_size;
+    uint64_t head;
+    uint32_t wake;
+    uint32_t waiters;
+    ShmBusSlot ring[];
+} ShmBusHeader;
+
+struct ShmBus {
+    ShmBusHeader* hdr;
+    size_t map_size;
+    int fd;
+    char path[64];
+    int stopping;
+    uint64_t next;
+    int32_t self;
+    unsigned long long overruns;
+    unsigned long long dropped;
+};
+
+static void bus_sleep_ms(int ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+static void bus_wait(ShmBusHeader* hdr, uint32_t seen, int timeout_ms) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    syscall(SYS_futex, &hdr->wake, FUTEX_WAIT, seen, &ts, NULL, 0);
+#else
+    (void)seen;
+    bus_sleep_ms(timeout_ms < 1 ? timeout_ms : 1);
+#endif
+}
+
+static void bus_wake(ShmBusHeader* hdr) {
+#ifdef __linux__
+    syscall(SYS_futex, &hdr->wake, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#else
+    (void)hdr;
+#endif
+}
+
+static void bus_resync(ShmBus* bus) {
+    uint64_t head = __atomic_load_n(&bus->hdr->head, __ATOMIC_ACQUIRE);
+    if (head > bus->next) bus->dropped += head - bus->next;
+    bus->overruns++;
+    bus->next = head;
+}
+
+enum { BUS_FAILED, BUS_REOPEN, BUS_REPLACE };
+
+/* A segment is finished once its magic is set. Before that it is being
+ * created: its creator may not even hold the lock yet, so ours is dropped
+ * while we wait for it. An unfinished segment is never unlinked. */
+static ShmBusHeader* bus_attach(const char* path, int fd, size_t map_size, int* action) {
+    *action = BUS_FAILED;
+    for (int tries = 0; tries < 1000; tries++) {
+        struct stat st;
+        if (tries > 0) {
+            (void)flock(fd, LOCK_UN);
+            bus_sleep_ms(1);
+        }
+        if (flock(fd, LOCK_SH) != 0 || fstat(fd, &st) != 0) return NULL;
+        /* the last user unlinked it between our open and our lock; the
+         * name may already belong to a newer segment */
+        if (st.st_nlink == 0) {
+            *action = BUS_REOPEN;
+            return NULL;
+        }
+        if ((size_t)st.st_size < sizeof(ShmBusHeader)) continue;
+        ShmBusHeader* hdr = mmap(NULL, sizeof(ShmBusHeader), PROT_READ, MAP_SHARED, fd, 0);
+        if (hdr == MAP_FAILED) return NULL;
+        int finished = __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == SHM_BUS_MAGIC;
+        int compatible = finished && (size_t)st.st_size == map_size && hdr->slots == SHM_BUS_SLOTS &&
+                         hdr->frame_size == sizeof(MessageInfo);
+        munmap(hdr, sizeof(ShmBusHeader));
+        if (!finished) continue;
+        if (compatible) {
+            void* base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            return base == MAP_FAILED ? NULL : base;
+        }
+        /* another layout, from a build with a different MessageInfo or ring */
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            print_error("Replacing a shared-memory bus left by an incompatible server");
+            *action = BUS_REPLACE;
+        } else {
+            print_error("Shared-memory bus is in use by an incompatible server");
+        }
+        return NULL;
+    }
+    print_error("Shared-memory bus was never finished by the server creating it");
+    printf("If no server is using it, remove " YELLOW "/dev/shm%s" RESET "\n", path);
+    return NULL;
+}
+
+ShmBus* shm_bus_open(const char* name) {
+    ShmBus* bus = calloc(1, sizeof(ShmBus));
+    if (!bus) return NULL;
+    snprintf(bus->path, sizeof(bus->path), "%s%s", name[0] == '/' ? "" : "/", name);
+    size_t map_size = sizeof(ShmBusHeader) + (size_t)SHM_BUS_SLOTS * sizeof(ShmBusSlot);
+
+    ShmBusHeader* hdr = NULL;
+    for (int attempt = 0; !hdr && attempt < 3; attempt++) {
+        int fd = shm_open(bus->path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            if (flock(fd, LOCK_EX) != 0 || ftruncate(fd, (off_t)map_size) != 0) {
+                print_error("Failed to size shared-memory bus");
+                shm_unlink(bus->path);
+                close(fd);
+                break;
+            }
+            void* base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (base == MAP_FAILED) {
+                shm_unlink(bus->path);
+                close(fd);
+                break;
+            }
+            hdr = base;
+            hdr->slots = SHM_BUS_SLOTS;
+            hdr->frame_size = (uint32_t)sizeof(MessageInfo);
+            __atomic_store_n(&hdr->magic, SHM_BUS_MAGIC, __ATOMIC_RELEASE);
+            (void)flock(fd, LOCK_SH);
+            bus->fd = fd;
+            break;
+        }
+        if (errno != EEXIST) break;
+        fd = shm_open(bus->path, O_RDWR, 0600);
+        if (fd < 0) {
+            if (errno == ENOENT) continue;
+            break;
+        }
+        int action;
+        hdr = bus_attach(bus->path, fd, map_size, &action);
+        if (hdr) {
+            bus->fd = fd;
+            break;
+        }
+        if (action == BUS_REPLACE) shm_unlink(bus->path);
+        close(fd);
+        if (action == BUS_FAILED) {
+            free(bus);
+            return NULL;
+        }
+    }
+    if (!hdr) {
+        print_error("Failed to open shared-memory bus");
+        free(bus);
+        return NULL;
+    }
+    bus->hdr = hdr;
+    bus->map_size = map_size;
+    bus->self = (int32_t)getpid();
+    bus->next = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    return bus;
+}
+
+/* Makes a reader blocked in shm_bus_next return -1. */
+void shm_bus_stop(ShmBus* bus) {
+    if (!bus) return;
+    __atomic_store_n(&bus->stopping, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&bus->hdr->wake, 1, __ATOMIC_SEQ_CST);
+    bus_wake(bus->hdr);
+}
+
+/* No reader may be running. The last process to leave removes the name. */
+void shm_bus_close(ShmBus* bus) {
+    if (!bus) return;
+    munmap(bus->hdr, bus->map_size);
+    if (flock(bus->fd, LOCK_EX | LOCK_NB) == 0) shm_unlink(bus->path);
+    close(bus->fd);
+    free(bus);
+}
+
+int shm_bus_publish(ShmBus* bus, const MessageInfo* msg) {
+    ShmBusHeader* hdr = bus->hdr;
+    uint64_t n = __atomic_fetch_add(&hdr->head, 1, __ATOMIC_ACQ_REL);
+    ShmBusSlot* slot = &hdr->ring[n % hdr->slots];
+    __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->origin = bus->self;
+    memcpy(&slot->frame, msg, sizeof(*msg));
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&hdr->wake, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST) > 0) bus_wake(hdr);
+    return 0;
+}
+
+int shm_bus_next(ShmBus* bus, MessageInfo* out, int timeout_ms) {
+    ShmBusHeader* hdr = bus->hdr;
+    for (;;) {
+        if (__atomic_load_n(&bus->stopping, __ATOMIC_SEQ_CST)) return -1;
+        uint64_t n = bus->next;
+        ShmBusSlot* slot = &hdr->ring[n % hdr->slots];
+        uint64_t s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (s1 == 2 * n + 2) {
+            int32_t origin = slot->origin;
+            memcpy(out, &slot->frame, sizeof(*out));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != s1) {
+                bus_resync(bus);
+                continue;
+            }
+            bus->next = n + 1;
+            if (origin == bus->self) continue;
+            return 1;
+        }
+        if (s1 > 2 * n + 2) {
+            bus_resync(bus);
+            continue;
+        }
+        uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+        if (head - n > hdr->slots) {
+            bus_resync(bus);
+            continue;
+        }
+        if (timeout_ms <= 0) return 0;
+
+        uint32_t seen = __atomic_load_n(&hdr->wake, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != s1) continue;
+        __atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+        bus_wait(hdr, seen, timeout_ms);
+        __atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+        timeout_ms = 0;
+    }
+}
+
+void shm_bus_stats(const ShmBus* bus, unsigned long long* overruns, unsigned long long* dropped) {
+    if (overruns) *overruns = bus ? bus->overruns : 0;
+    if (dropped) *dropped = bus ? bus->dropped : 0;
+}
+
+#else
+
+ShmBus* shm_bus_open(const char* name) {
+    (void)name;
+    print_error("Shared-memory bus is not supported on this platform");
+    return NULL;
+}
+
+void shm_bus_stop(ShmBus* bus) {
+    (void)bus;
+}
+
+void shm_bus_close(ShmBus* bus) {
+    (void)bus;
+}
+
+int shm_bus_publish(ShmBus* bus, const MessageInfo* msg) {
+    (void)bus; (void)msg;
+    return -1;
+}
+
+int shm_bus_next(ShmBus* bus, MessageInfo* out, int timeout_ms) {
+    (void)bus; (void)out; (void)timeout_ms;
+    return -1;
+}
+
+void shm_bus_stats(const ShmBus* bus, unsigned long long* overruns, unsigned long long* dropped) {
+    (void)bus;
+    if (overruns) *overruns = 0;
+    if (dropped) *dropped = 0;
+}
+
+#endif
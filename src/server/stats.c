@@ -0,0 +1,126 @@
+#include "../../include/common.h"
+
+/*
+ * Latency histograms use power-of-two buckets: bucket i counts samples in
+ * [2^i, 2^(i+1)) ns. Recording is lock-free so it can sit on the hot path;
+ * readers may see a sample in count before it shows up in its bucket.
+ */
+
+static const char* stage_names[STAGE_COUNT] = {
+    "process (recv -> enqueue)",
+    "fan-out (enqueue -> flush)",
+    "residence (recv -> flush)"
+};
+
+static int bucket_for(uint64_t ns) {
+    int b = 0;
+    while (ns > 1 && b < LATENCY_BUCKETS - 1) {
+        ns >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void stats_record_latency(ServerStats* stats, int stage, uint64_t ns) {
+    LatencyHistogram* hist = &stats->stages[stage];
+    __atomic_add_fetch(&hist->buckets[bucket_for(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* Called once per traced frame, when it has been queued for its recipients. */
+void stats_record_trace(ServerStats* stats, const MessageInfo* msg) {
+    uint64_t recv = msg->trace[TRACE_SERVER_RECV];
+    uint64_t enqueue = msg->trace[TRACE_SERVER_ENQUEUE];
+    if (!(msg->flags & MSG_FLAG_TRACE) || !recv || enqueue < recv) return;
+    stats_record_latency(stats, STAGE_PROCESS, enqueue - recv);
+}
+
+/* Called once per copy of a traced frame, when a writer has handed it to the
+ * kernel; a broadcast to n recipients adds n fan-out samples. */
+void stats_record_flush(ServerStats* stats, const uint64_t* trace, uint64_t flushed) {
+    uint64_t recv = trace[TRACE_SERVER_RECV];
+    uint64_t enqueue = trace[TRACE_SERVER_ENQUEUE];
+    if (!recv || enqueue < recv || flushed < enqueue) return;
+    stats_record_latency(stats, STAGE_FANOUT, flushed - enqueue);
+    stats_record_latency(stats, STAGE_RESIDENCE, flushed - recv);
+}
+
+uint64_t stats_percentile(const LatencyHistogram* hist, double p) {
+    unsigned long long total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) total += hist->buckets[i];
+    if (total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(p * (double)total);
+    if (rank >= total) rank = total - 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) return (2ULL << i) < hist->max_ns ? (2ULL << i) : hist->max_ns;
+    }
+    return hist->max_ns;
+}
+
+void stats_record_sanitize(ServerStats* stats, size_t bytes, uint64_t ns, int rewritten) {
+    __atomic_add_fetch(&stats->sanitize_frames, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->sanitize_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->sanitize_ns, ns, __ATOMIC_RELAXED);
+    if (rewritten) __atomic_add_fetch(&stats->sanitize_rewritten, 1, __ATOMIC_RELAXED);
+}
+
+void stats_record_filtered(ServerStats* stats, int reason) {
+    __atomic_add_fetch(&stats->filtered[reason], 1, __ATOMIC_RELAXED);
+}
+
+/* Returns how many frames of this type have been accepted so far. */
+unsigned long long stats_record_frame(ServerStats* stats, int type, int accepted) {
+    if (accepted) return __atomic_add_fetch(&stats->frames_in[type], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->frames_rejected, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* kind is the packed kind, or 0 when the frame had to go plain. */
+void stats_record_pack(ServerStats* stats, int kind, size_t len, uint64_t ns) {
+    if (kind == WIRE_LZ) __atomic_add_fetch(&stats->packed_lz, 1, __ATOMIC_RELAXED);
+    else if (kind == WIRE_ZERO_RUN) __atomic_add_fetch(&stats->packed_zero_run, 1, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&stats->packed_plain, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->packed_bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->packed_ns, ns, __ATOMIC_RELAXED);
+}
+
+void stats_print(const ServerStats* stats) {
+    printf(CYAN "=== Traced frame latency (us) ===" RESET "\n");
+    printf("%-28s %8s %8s %8s %8s %8s\n", "stage", "count", "p50", "p90", "p99", "max");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const LatencyHistogram* hist = &stats->stages[i];
+        printf("%-28s %8llu %8.1f %8.1f %8.1f %8.1f\n", stage_names[i], hist->count,
+               stats_percentile(hist, 0.50) / 1000.0, stats_percentile(hist, 0.90) / 1000.0,
+               stats_percentile(hist, 0.99) / 1000.0, hist->max_ns / 1000.0);
+    }
+    printf(CYAN "=== Sanitizer (%s) ===" RESET "\n", sanitize_kernel_name());
+    printf("frames %llu, rewritten %llu, bytes %llu, %.3f GB/s\n", stats->sanitize_frames,
+           stats->sanitize_rewritten, stats->sanitize_bytes,
+           stats->sanitize_ns ? (double)stats->sanitize_bytes / (double)stats->sanitize_ns : 0.0);
+    unsigned long long saved = 0;
+    for (int i = FILTER_PASS + 1; i < FILTER_REASONS; i++) saved += stats->filtered[i];
+    printf(CYAN "=== Delivery filters ===" RESET "\n");
+    printf("sends saved %llu (%.1f KB not queued): ignored %llu, muted %llu, no mention %llu\n", saved,
+           (double)saved * sizeof(MessageInfo) / 1024.0, stats->filtered[FILTER_IGNORED],
+           stats->filtered[FILTER_MUTED], stats->filtered[FILTER_UNMENTIONED]);
+    printf(CYAN "=== Inbound frames ===" RESET "\n");
+    for (int type = 1; type < MSG_TYPE_COUNT; type++) {
+        if (stats->frames_in[type]) printf("%-20s %10llu\n", msg_type_name(type), stats->frames_in[type]);
+    }
+    printf("%-20s %10llu\n", "rejected", stats->frames_rejected);
+    unsigned long long packed = stats->packed_lz + stats->packed_zero_run;
+    unsigned long long encoded = packed + stats->packed_plain;
+    printf(CYAN "=== Compression ===" RESET "\n");
+    printf("frames packed %llu (LZ %llu, zero-run only %llu), left plain %llu, queued packed %llu times\n", packed,
+           stats->packed_lz, stats->packed_zero_run, stats->packed_plain, stats->packed_sends);
+    printf("ratio %.1f:1 (%.1f KB -> %.1f KB), %.2f us per frame\n",
+           stats->packed_bytes ? (double)packed * sizeof(MessageInfo) / (double)stats->packed_bytes : 0.0,
+           (double)packed * sizeof(MessageInfo) / 1024.0, stats->packed_bytes / 1024.0,
+           encoded ? stats->packed_ns / 1000.0 / (double)encoded : 0.0);
+}
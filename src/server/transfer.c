@@ -0,0 +1,630 @@
+#include "../../include/common.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
+
+/*
+ * File transfers. The sender streams FILE_DATA chunks (a header frame whose
+ * count is the number of raw bytes that follow it) and the server spools
+ * them to an anonymous temp file, granting one more chunk of credit per
+ * chunk stored. A single forwarder thread then walks every transfer and
+ * hands each recipient at most one chunk per pass, so a large file is
+ * interleaved with chat instead of monopolising a connection. Recipients
+ * acknowledge chunks the same way, which keeps at most FILE_WINDOW_CHUNKS
+ * in flight to each of them. A recipient whose socket is full is passed
+ * over until it drains, so one slow reader cannot stall the others, and
+ * offers are refused once FILE_SPOOL_MAX_BYTES of files are on disk.
+ *
+ * On Linux the payload is spliced from the sender's socket into the spool
+ * and sent on to recipients with sendfile, so it never passes through user
+ * space. Their sends are still bounded by a deadline: a send timeout is set
+ * on the socket while the payload goes out.
+ */
+
+typedef struct {
+    int client_index;
+    int client_id;
+    int credit;
+    int done;
+    uint64_t sent;
+} TransferPeer;
+
+typedef struct {
+    int id;
+    int sender_index;
+    int sender_id;
+    char from[MAX_NICK_LEN];
+    char target[MAX_NICK_LEN];
+    char name[FILE_NAME_MAX];
+    uint64_t size;
+    uint64_t spooled;
+    int complete;
+    int aborted;
+    FILE* spool;
+#ifdef __linux__
+    int pipe_fds[2];
+#endif
+    TransferPeer peers[MAX_CLIENTS];
+    int peer_count;
+} Transfer;
+
+typedef enum {
+    FORWARD_CHUNK = 1,
+    FORWARD_END
+} forward_kind_t;
+
+typedef struct {
+    int kind;
+    Transfer* transfer;
+    TransferPeer* peer;
+    int id;
+    int client_index;
+    int client_id;
+    uint64_t offset;
+    uint32_t len;
+    int status;
+} ForwardJob;
+
+struct FileTransfers {
+    ServerState* server;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Transfer slots[FILE_MAX_TRANSFERS];
+    int next_id;
+    int stopping;
+    uint64_t reserved;
+    unsigned long long started;
+    unsigned long long completed;
+    unsigned long long aborted;
+    unsigned long long refused;
+    unsigned long long stalled;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+};
+
+static void safe_strcpy(char* dst, const char* src, size_t cap) {
+    if (!dst || !cap) return;
+    if (!src) { dst[0] = '\0'; return; }
+    strncpy(dst, src, cap - 1);
+    dst[cap - 1] = '\0';
+}
+
+static const char* base_name(const char* path) {
+    const char* base = path;
+    for (const char* p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') base = p + 1;
+    }
+    return base;
+}
+
+static Transfer* find_transfer(FileTransfers* ft, int id) {
+    for (int i = 0; i < FILE_MAX_TRANSFERS; i++) {
+        if (ft->slots[i].id == id && id > 0) return &ft->slots[i];
+    }
+    return NULL;
+}
+
+static TransferPeer* find_peer(Transfer* t, int client_id) {
+    for (int i = 0; i < t->peer_count; i++) {
+        if (t->peers[i].client_id == client_id) return &t->peers[i];
+    }
+    return NULL;
+}
+
+/* Called with ft->mutex held. */
+static void release_transfer(FileTransfers* ft, Transfer* t) {
+    ft->reserved -= t->size;
+    if (t->spool) fclose(t->spool);
+#ifdef __linux__
+    if (t->pipe_fds[0] >= 0) close(t->pipe_fds[0]);
+    if (t->pipe_fds[1] >= 0) close(t->pipe_fds[1]);
+#endif
+    memset(t, 0, sizeof(*t));
+}
+
+/* Answers the sender: cursor -1 rejects an offer, length 0 accepts it, and
+ * later acks carry the number of bytes stored so far; credit -1 ends a
+ * transfer the server does not know. */
+static void reply_ack(ServerState* server, int client_index, int id, int credit, uint64_t stored, const char* text) {
+    MessageInfo ack;
+    msg_encode(&ack, MSG_TYPE_FILE_ACK, "Server", NULL, text);
+    ack.cursor = id;
+    ack.count = credit;
+    ack.length = stored;
+    (void)send_to_client(server, client_index, &ack);
+}
+
+void transfer_offer(FileTransfers* ft, int client_index, const MessageInfo* msg) {
+    ServerState* server = ft->server;
+    const char* name = base_name(msg->message);
+    if (!name[0]) {
+        reply_ack(server, client_index, -1, 0, 0, "File name is empty");
+        return;
+    }
+    if (msg->length == 0 || msg->length > FILE_MAX_BYTES) {
+        reply_ack(server, client_index, -1, 0, 0, "File is empty or too large");
+        return;
+    }
+
+    pthread_mutex_lock(&ft->mutex);
+    if (ft->reserved + msg->length > FILE_SPOOL_MAX_BYTES) {
+        ft->refused++;
+        pthread_mutex_unlock(&ft->mutex);
+        reply_ack(server, client_index, -1, 0, 0, "Server is storing too many files, try again later");
+        return;
+    }
+    Transfer* t = NULL;
+    for (int i = 0; i < FILE_MAX_TRANSFERS && !t; i++) {
+        if (ft->slots[i].id == 0) t = &ft->slots[i];
+    }
+    if (!t) {
+        pthread_mutex_unlock(&ft->mutex);
+        reply_ack(server, client_index, -1, 0, 0, "Too many transfers in progress, try again later");
+        return;
+    }
+    t->spool = tmpfile();
+#ifdef __linux__
+    t->pipe_fds[0] = t->pipe_fds[1] = -1;
+    if (t->spool && pipe(t->pipe_fds) != 0) t->pipe_fds[0] = t->pipe_fds[1] = -1;
+    if (t->pipe_fds[0] < 0 && t->spool) {
+        fclose(t->spool);
+        t->spool = NULL;
+    }
+#endif
+    if (!t->spool) {
+        memset(t, 0, sizeof(*t));
+        pthread_mutex_unlock(&ft->mutex);
+        print_error("Failed to create file transfer spool");
+        reply_ack(server, client_index, -1, 0, 0, "Server could not store the file");
+        return;
+    }
+
+    pthread_mutex_lock(&server->clients_mutex);
+    Client* sender = &server->clients[client_index];
+    t->sender_index = client_index;
+    t->sender_id = sender->client_id;
+    safe_strcpy(t->from, sender->nickname, sizeof(t->from));
+    safe_strcpy(t->target, msg->target_nickname, sizeof(t->target));
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        Client* c = &server->clients[i];
+        if (i == client_index || !c->active || strcmp(c->nickname, "Anonymous") == 0) continue;
+        if (t->target[0] && strcmp(c->nickname, t->target) != 0) continue;
+        TransferPeer* peer = &t->peers[t->peer_count++];
+        peer->client_index = i;
+        peer->client_id = c->client_id;
+        peer->credit = FILE_WINDOW_CHUNKS;
+    }
+    pthread_mutex_unlock(&server->clients_mutex);
+
+    if (t->peer_count == 0) {
+        release_transfer(ft, t);
+        pthread_mutex_unlock(&ft->mutex);
+        reply_ack(server, client_index, -1, 0, 0, msg->target_nickname[0] ? "User not found or offline" : "Nobody else is in the room");
+        return;
+    }
+    if (++ft->next_id <= 0) ft->next_id = 1;
+    t->id = ft->next_id;
+    safe_strcpy(t->name, name, sizeof(t->name));
+    t->size = msg->length;
+    ft->reserved += t->size;
+    ft->started++;
+
+    MessageInfo offer;
+    msg_encode(&offer, MSG_TYPE_FILE_OFFER, t->from, t->target, t->name);
+    offer.cursor = t->id;
+    offer.length = t->size;
+    TransferPeer peers[MAX_CLIENTS];
+    int peer_count = t->peer_count;
+    memcpy(peers, t->peers, sizeof(peers));
+    int id = t->id;
+    pthread_mutex_unlock(&ft->mutex);
+
+    for (int i = 0; i < peer_count; i++) {
+        pthread_mutex_lock(&server->clients_mutex);
+        if (server->clients[peers[i].client_index].client_id == peers[i].client_id) {
+            (void)send_to_client(server, peers[i].client_index, &offer);
+        }
+        pthread_mutex_unlock(&server->clients_mutex);
+    }
+    reply_ack(server, client_index, id, FILE_WINDOW_CHUNKS, 0, offer.message);
+    print_system_message("File transfer started");
+    printf("From " CYAN "%s" RESET " to " CYAN "%s" RESET ": %s (%llu bytes)\n", offer.nickname, offer.target_nickname[0] ? offer.target_nickname : "room", offer.message, (unsigned long long)offer.length);
+}
+
+static int discard_payload(SOCKET sock, uint32_t len) {
+    char buf[4096];
+    while (len > 0) {
+        int n = recv(sock, buf, len < sizeof(buf) ? (int)len : (int)sizeof(buf), 0);
+        if (n <= 0) return -1;
+        len -= (uint32_t)n;
+    }
+    return 0;
+}
+
+static int spool_payload(FileTransfers* ft, Transfer* t, SOCKET sock, uint64_t offset, uint32_t len) {
+#ifdef __linux__
+    (void)ft;
+    loff_t out = (loff_t)offset;
+    int fd = fileno(t->spool);
+    while (len > 0) {
+        ssize_t in_pipe = splice(sock, NULL, t->pipe_fds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe <= 0) return -1;
+        len -= (uint32_t)in_pipe;
+        while (in_pipe > 0) {
+            ssize_t n = splice(t->pipe_fds[0], NULL, fd, &out, (size_t)in_pipe, SPLICE_F_MOVE);
+            if (n <= 0) return -1;
+            in_pipe -= n;
+        }
+    }
+    return 0;
+#else
+    char buf[FILE_CHUNK_SIZE];
+    uint32_t got = 0;
+    while (got < len) {
+        int n = recv(sock, buf + got, (int)(len - got), 0);
+        if (n <= 0) return -1;
+        got += (uint32_t)n;
+    }
+    pthread_mutex_lock(&ft->mutex);
+    int rc = (fseek(t->spool, (long)offset, SEEK_SET) == 0 && fwrite(buf, 1, len, t->spool) == len && fflush(t->spool) == 0) ? 0 : -1;
+    pthread_mutex_unlock(&ft->mutex);
+    return rc;
+#endif
+}
+
+/*
+ * Reads the raw payload that follows a FILE_DATA header. Returns -1 when the
+ * stream can no longer be trusted and the connection must be dropped.
+ */
+int transfer_receive_chunk(FileTransfers* ft, int client_index, const MessageInfo* msg) {
+    ServerState* server = ft->server;
+    SOCKET sock = server->clients[client_index].socket;
+    if (msg->count <= 0 || msg->count > FILE_CHUNK_SIZE) {
+        print_error("Invalid file chunk length, dropping client");
+        return -1;
+    }
+    uint32_t len = (uint32_t)msg->count;
+
+    pthread_mutex_lock(&ft->mutex);
+    Transfer* t = find_transfer(ft, msg->cursor);
+    int ours = t && !t->aborted && !t->complete && t->sender_id == server->clients[client_index].client_id;
+    uint64_t offset = ours ? t->spooled : 0;
+    if (ours && offset + len > t->size) ours = 0;
+    int known = t != NULL;
+    pthread_mutex_unlock(&ft->mutex);
+    /* e.g. begun before a hot restart; the new process has no spool for it */
+    if (!known) reply_ack(server, client_index, msg->cursor, -1, 0, "Transfer is unknown to the server, send the file again");
+    if (!ours) return discard_payload(sock, len);
+
+    if (spool_payload(ft, t, sock, offset, len) != 0) {
+        print_error("Failed to spool file chunk");
+        return -1;
+    }
+    pthread_mutex_lock(&ft->mutex);
+    t->spooled += len;
+    ft->bytes_in += len;
+    int id = t->id;
+    uint64_t stored = t->spooled;
+    pthread_cond_signal(&ft->cond);
+    pthread_mutex_unlock(&ft->mutex);
+    reply_ack(server, client_index, id, 1, stored, "");
+    return 0;
+}
+
+void transfer_ack(FileTransfers* ft, int client_index, const MessageInfo* msg) {
+    int client_id = ft->server->clients[client_index].client_id;
+    pthread_mutex_lock(&ft->mutex);
+    Transfer* t = find_transfer(ft, msg->cursor);
+    TransferPeer* peer = t ? find_peer(t, client_id) : NULL;
+    if (peer && !peer->done && msg->count > 0 && peer->credit + msg->count <= FILE_WINDOW_CHUNKS) {
+        peer->credit += msg->count;
+        pthread_cond_signal(&ft->cond);
+    }
+    pthread_mutex_unlock(&ft->mutex);
+}
+
+void transfer_finish(FileTransfers* ft, int client_index, const MessageInfo* msg) {
+    int client_id = ft->server->clients[client_index].client_id;
+    pthread_mutex_lock(&ft->mutex);
+    Transfer* t = find_transfer(ft, msg->cursor);
+    if (t && t->sender_id == client_id && !t->aborted) {
+        if (t->spooled == t->size && msg->count >= 0) t->complete = 1;
+        else t->aborted = 1;
+        pthread_cond_signal(&ft->cond);
+    }
+    pthread_mutex_unlock(&ft->mutex);
+}
+
+#ifndef __linux__
+static int spool_read(FileTransfers* ft, Transfer* t, char* buf, uint64_t offset, uint32_t len) {
+    pthread_mutex_lock(&ft->mutex);
+    int ok = fseek(t->spool, (long)offset, SEEK_SET) == 0 && fread(buf, 1, len, t->spool) == len;
+    pthread_mutex_unlock(&ft->mutex);
+    return ok ? 0 : -1;
+}
+#endif
+
+/* Waits until sock takes more bytes; 0 once deadline (monotonic) passes. */
+static int wait_writable(SOCKET sock, uint64_t deadline) {
+    uint64_t now = monotonic_ns();
+    uint64_t left_us = deadline > now ? (deadline - now) / 1000 : 0;
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(sock, &writable);
+    struct timeval tv = {(long)(left_us / 1000000), (long)(left_us % 1000000)};
+    return select((int)sock + 1, NULL, &writable, NULL, &tv) > 0;
+}
+
+static int send_until(SOCKET sock, const char* buf, size_t len, uint64_t deadline) {
+    while (len > 0) {
+        if (!wait_writable(sock, deadline)) return -1;
+#ifdef _WIN32
+        int n = send(sock, buf, (int)len, 0);
+#else
+        int n = (int)send(sock, buf, len, MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+#endif
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+/* Sends len bytes of the spool from offset. O_NONBLOCK would also make the
+ * reader's recv fail, so each sendfile is bounded by SO_SNDTIMEO instead,
+ * which only sends see; the caller holds send_mutex, so no other send is
+ * subject to it. The socket's own timeout is put back afterwards. */
+static int sendfile_until(SOCKET sock, int spool_fd, uint64_t offset, uint32_t len, uint64_t deadline) {
+    struct timeval saved;
+    socklen_t saved_len = (socklen_t)sizeof(saved);
+    if (getsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &saved, &saved_len) != 0) return -1;
+    off_t pos = (off_t)offset;
+    int rc = 0;
+    while (len > 0) {
+        uint64_t now = monotonic_ns();
+        if (now >= deadline) {
+            rc = -1;
+            break;
+        }
+        /* a zero timeout would mean none at all */
+        uint64_t left_us = (deadline - now) / 1000 + 1;
+        struct timeval tv = {(long)(left_us / 1000000), (long)(left_us % 1000000)};
+        if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+            rc = -1;
+            break;
+        }
+        ssize_t n = sendfile(sock, spool_fd, &pos, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            rc = -1;
+            break;
+        }
+        len -= (uint32_t)n;
+    }
+    (void)setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &saved, sizeof(saved));
+    return rc;
+}
+#endif
+
+/*
+ * Sends one job to its recipient. The recipient's send_mutex is taken
+ * before clients_mutex is released, so the socket cannot be closed under
+ * us and no other frame can land between the header and the payload.
+ * Queued control frames (the offer) are flushed first so the chunk cannot
+ * overtake them.
+ *
+ * Returns 1 without sending if the recipient is not ready for more. Once
+ * the header is out the job must finish within FILE_SEND_TIMEOUT_MS, or
+ * the connection is shut down; a frame cannot be resumed halfway.
+ */
+static int forward(FileTransfers* ft, const ForwardJob* job) {
+    ServerState* server = ft->server;
+#ifndef __linux__
+    char payload[FILE_CHUNK_SIZE];
+    if (job->kind == FORWARD_CHUNK && spool_read(ft, job->transfer, payload, job->offset, job->len) != 0) return -1;
+#endif
+    if (outbox_sync(server->clients[job->client_index].outbox, 0) != 0) return 1;
+    pthread_mutex_lock(&server->clients_mutex);
+    Client* c = &server->clients[job->client_index];
+    if (!c->active || c->client_id != job->client_id) {
+        pthread_mutex_unlock(&server->clients_mutex);
+        return -1;
+    }
+    pthread_mutex_lock(&c->send_mutex);
+    SOCKET sock = c->socket;
+    pthread_mutex_unlock(&server->clients_mutex);
+    if (!wait_writable(sock, 0)) {
+        pthread_mutex_unlock(&c->send_mutex);
+        return 1;
+    }
+
+    MessageInfo header;
+    msg_encode(&header, job->kind == FORWARD_CHUNK ? MSG_TYPE_FILE_DATA : MSG_TYPE_FILE_END, job->transfer->from, NULL, NULL);
+    header.cursor = job->id;
+    header.count = job->kind == FORWARD_CHUNK ? (int)job->len : job->status;
+    header.length = job->offset;
+    uint64_t deadline = monotonic_ns() + (uint64_t)FILE_SEND_TIMEOUT_MS * 1000000ULL;
+    int rc = send_until(sock, (const char*)&header, sizeof(header), deadline);
+#ifdef __linux__
+    if (rc == 0 && job->kind == FORWARD_CHUNK) rc = sendfile_until(sock, fileno(job->transfer->spool), job->offset, job->len, deadline);
+#else
+    if (rc == 0 && job->kind == FORWARD_CHUNK) rc = send_until(sock, payload, job->len, deadline);
+#endif
+    if (rc != 0) shutdown(sock, SHUTDOWN_BOTH);
+    pthread_mutex_unlock(&c->send_mutex);
+    return rc;
+}
+
+static int client_alive(ServerState* server, int client_index, int client_id) {
+    pthread_mutex_lock(&server->clients_mutex);
+    int alive = server->clients[client_index].active && server->clients[client_index].client_id == client_id;
+    pthread_mutex_unlock(&server->clients_mutex);
+    return alive;
+}
+
+/* Picks at most one job per recipient of every transfer, frees transfers
+ * that have nothing left to deliver. Runs with ft->mutex held. */
+static int collect_jobs(FileTransfers* ft, ForwardJob* jobs, int cap) {
+    int n = 0;
+    for (int i = 0; i < FILE_MAX_TRANSFERS; i++) {
+        Transfer* t = &ft->slots[i];
+        if (t->id == 0) continue;
+        if (!t->complete && !t->aborted && !client_alive(ft->server, t->sender_index, t->sender_id)) {
+            t->aborted = 1;
+        }
+        int pending = 0;
+        for (int p = 0; p < t->peer_count; p++) {
+            TransferPeer* peer = &t->peers[p];
+            if (peer->done) continue;
+            if (!client_alive(ft->server, peer->client_index, peer->client_id)) {
+                peer->done = 1;
+                continue;
+            }
+            pending++;
+            if (n == cap) continue;
+            ForwardJob* job = &jobs[n];
+            memset(job, 0, sizeof(*job));
+            job->transfer = t;
+            job->peer = peer;
+            job->id = t->id;
+            job->client_index = peer->client_index;
+            job->client_id = peer->client_id;
+            job->offset = peer->sent;
+            if (t->aborted || (t->complete && peer->sent == t->size)) {
+                job->kind = FORWARD_END;
+                job->status = t->aborted ? -1 : 0;
+                peer->done = 1;
+                n++;
+            } else if (peer->sent < t->spooled && peer->credit > 0) {
+                uint64_t left = t->spooled - peer->sent;
+                job->kind = FORWARD_CHUNK;
+                job->len = left < FILE_CHUNK_SIZE ? (uint32_t)left : FILE_CHUNK_SIZE;
+                peer->credit--;
+                peer->sent += job->len;
+                n++;
+            }
+        }
+        if (pending == 0 && (t->complete || t->aborted)) {
+            if (t->complete) ft->completed++;
+            else ft->aborted++;
+            print_system_message(t->complete ? "File transfer finished" : "File transfer aborted");
+            printf("From " CYAN "%s" RESET ": %s\n", t->from, t->name);
+            release_transfer(ft, t);
+        }
+    }
+    return n;
+}
+
+static void* forwarder_thread(void* arg) {
+    FileTransfers* ft = arg;
+    ForwardJob jobs[FILE_MAX_TRANSFERS];
+    for (;;) {
+        pthread_mutex_lock(&ft->mutex);
+        if (ft->stopping) {
+            pthread_mutex_unlock(&ft->mutex);
+            break;
+        }
+        int n = collect_jobs(ft, jobs, FILE_MAX_TRANSFERS);
+        if (n == 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&ft->cond, &ft->mutex, &deadline);
+            pthread_mutex_unlock(&ft->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&ft->mutex);
+
+        int progress = 0;
+        for (int i = 0; i < n; i++) {
+            ForwardJob* job = &jobs[i];
+            int rc = forward(ft, job);
+            pthread_mutex_lock(&ft->mutex);
+            if (rc > 0) {
+                /* hand the job back; collect_jobs offers it again */
+                ft->stalled++;
+                if (job->kind == FORWARD_CHUNK) {
+                    job->peer->sent -= job->len;
+                    job->peer->credit++;
+                } else {
+                    job->peer->done = 0;
+                }
+            } else if (rc < 0) {
+                job->peer->done = 1;
+            } else if (job->kind == FORWARD_CHUNK) {
+                ft->bytes_out += job->len;
+            }
+            if (rc <= 0) progress = 1;
+            pthread_mutex_unlock(&ft->mutex);
+        }
+        if (!progress) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += FILE_RETRY_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_mutex_lock(&ft->mutex);
+            pthread_cond_timedwait(&ft->cond, &ft->mutex, &deadline);
+            pthread_mutex_unlock(&ft->mutex);
+        }
+    }
+    return NULL;
+}
+
+FileTransfers* transfer_start(ServerState* server) {
+    FileTransfers* ft = calloc(1, sizeof(FileTransfers));
+    if (!ft) return NULL;
+    ft->server = server;
+    if (pthread_mutex_init(&ft->mutex, NULL) != 0) goto fail_mutex;
+    if (pthread_cond_init(&ft->cond, NULL) != 0) goto fail_cond;
+    if (pthread_create(&ft->thread, NULL, forwarder_thread, ft) != 0) goto fail_thread;
+    return ft;
+fail_thread:
+    pthread_cond_destroy(&ft->cond);
+fail_cond:
+    pthread_mutex_destroy(&ft->mutex);
+fail_mutex:
+    free(ft);
+    return NULL;
+}
+
+/* Stops the forwarder between passes, which is at most
+ * FILE_SEND_TIMEOUT_MS away; for a hot restart. */
+void transfer_pause(FileTransfers* ft) {
+    if (!ft) return;
+    pthread_mutex_lock(&ft->mutex);
+    ft->stopping = 1;
+    pthread_cond_broadcast(&ft->cond);
+    pthread_mutex_unlock(&ft->mutex);
+    pthread_join(ft->thread, NULL);
+}
+
+void transfer_resume(FileTransfers* ft) {
+    if (!ft) return;
+    pthread_mutex_lock(&ft->mutex);
+    ft->stopping = 0;
+    pthread_mutex_unlock(&ft->mutex);
+    if (pthread_create(&ft->thread, NULL, forwarder_thread, ft) != 0) print_error("Failed to restart the file forwarder");
+}
+
+void transfer_print_stats(FileTransfers* ft) {
+    if (!ft) return;
+    pthread_mutex_lock(&ft->mutex);
+    int active = 0;
+    for (int i = 0; i < FILE_MAX_TRANSFERS; i++) {
+        if (ft->slots[i].id) active++;
+    }
+    printf(CYAN "=== File transfers ===" RESET "\n");
+    printf("started %llu, completed %llu, aborted %llu, active %d\n", ft->started, ft->completed, ft->aborted, active);
+    printf("spooled %llu bytes, forwarded %llu bytes\n", ft->bytes_in, ft->bytes_out);
+    printf("spool %llu of %llu bytes reserved, %llu offers refused, %llu sends deferred\n", (unsigned long long)ft->reserved,
+           (unsigned long long)FILE_SPOOL_MAX_BYTES, ft->refused, ft->stalled);
+    pthread_mutex_unlock(&ft->mutex);
+}
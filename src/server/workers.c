@@ -0,0 +1,277 @@
+#include "../../include/common.h"
+
+/*
+ * Message processing pool. Connection threads only read and decode frames
+ * and hand them here. Each connection slot owns a strand: a FIFO of its
+ * pending frames that at most one worker drains at a time. So one client's
+ * frames are handled in arrival order, while different clients run in
+ * parallel.
+ *
+ * A strand with work is pushed onto the deque of its home worker, chosen by
+ * slot. A worker pops its own deque from the bottom. When that is empty it
+ * steals the oldest strand from the top of another worker's deque, so a
+ * slow handler (history replay, WHO pages) only occupies one worker while
+ * the others pick up everyone else. A strand runs at most
+ * WORKER_STRAND_BATCH frames before it is requeued behind the others.
+ */
+
+typedef struct {
+    MessageInfo frames[WORKER_STRAND_DEPTH];
+    int head;
+    int count;
+    int scheduled; /* on a deque or being run; never 0 while count > 0 */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned long long stalls;
+} Strand;
+
+/* Every strand is on at most one deque, so MAX_CLIENTS entries suffice. */
+typedef struct {
+    WorkerPool* pool;
+    int id;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int items[MAX_CLIENTS];
+    int top;
+    int count;
+    unsigned long long frames;
+    unsigned long long runs;
+    unsigned long long steals;
+} Worker;
+
+struct WorkerPool {
+    ServerState* server;
+    worker_task_fn task;
+    int workers;
+    Worker worker[WORKER_POOL_MAX];
+    Strand strands[MAX_CLIENTS];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int ready; /* strands on deques that no worker has claimed yet */
+    int stopping;
+};
+
+static void deque_push(Worker* w, int strand, int at_top) {
+    pthread_mutex_lock(&w->mutex);
+    if (at_top) {
+        w->top = (w->top + MAX_CLIENTS - 1) % MAX_CLIENTS;
+        w->items[w->top] = strand;
+    } else {
+        w->items[(w->top + w->count) % MAX_CLIENTS] = strand;
+    }
+    w->count++;
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static int deque_pop_bottom(Worker* w) {
+    int strand = -1;
+    pthread_mutex_lock(&w->mutex);
+    if (w->count > 0) {
+        w->count--;
+        strand = w->items[(w->top + w->count) % MAX_CLIENTS];
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return strand;
+}
+
+static int deque_steal_top(Worker* w) {
+    int strand = -1;
+    pthread_mutex_lock(&w->mutex);
+    if (w->count > 0) {
+        strand = w->items[w->top];
+        w->top = (w->top + 1) % MAX_CLIENTS;
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return strand;
+}
+
+static void schedule_strand(WorkerPool* pool, int worker, int strand, int at_top) {
+    deque_push(&pool->worker[worker], strand, at_top);
+    pthread_mutex_lock(&pool->mutex);
+    pool->ready++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void run_strand(WorkerPool* pool, Worker* w, int index) {
+    Strand* s = &pool->strands[index];
+    MessageInfo msg;
+    int ran = 0;
+    for (;;) {
+        pthread_mutex_lock(&s->mutex);
+        if (s->count == 0) {
+            s->scheduled = 0;
+            pthread_cond_broadcast(&s->cond);
+            pthread_mutex_unlock(&s->mutex);
+            break;
+        }
+        if (ran == WORKER_STRAND_BATCH) {
+            pthread_mutex_unlock(&s->mutex);
+            schedule_strand(pool, w->id, index, 1);
+            break;
+        }
+        msg = s->frames[s->head];
+        s->head = (s->head + 1) % WORKER_STRAND_DEPTH;
+        s->count--;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+        pool->task(pool->server, index, &msg);
+        ran++;
+    }
+    pthread_mutex_lock(&w->mutex);
+    w->frames += (unsigned long long)ran;
+    w->runs++;
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static void* worker_thread(void* arg) {
+    Worker* w = arg;
+    WorkerPool* pool = w->pool;
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->ready == 0 && !pool->stopping) pthread_cond_wait(&pool->cond, &pool->mutex);
+        /* queued work is still run after a stop */
+        if (pool->ready == 0) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        pool->ready--;
+        pthread_mutex_unlock(&pool->mutex);
+
+        /* the claim guarantees a strand is on some deque until we take one */
+        int strand = deque_pop_bottom(w);
+        while (strand < 0) {
+            for (int k = 1; strand < 0 && k < pool->workers; k++) {
+                strand = deque_steal_top(&pool->worker[(w->id + k) % pool->workers]);
+            }
+            if (strand >= 0) {
+                pthread_mutex_lock(&w->mutex);
+                w->steals++;
+                pthread_mutex_unlock(&w->mutex);
+            } else {
+                strand = deque_pop_bottom(w);
+            }
+        }
+        run_strand(pool, w, strand);
+    }
+    return NULL;
+}
+
+WorkerPool* worker_pool_start(ServerState* server, int workers, worker_task_fn task) {
+    WorkerPool* pool = calloc(1, sizeof(WorkerPool));
+    if (!pool) return NULL;
+    if (workers < 1) workers = 1;
+    if (workers > WORKER_POOL_MAX) workers = WORKER_POOL_MAX;
+    pool->server = server;
+    pool->task = task;
+    pool->workers = workers;
+    int strands = 0, locks = 0, started = 0;
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) goto fail_mutex;
+    if (pthread_cond_init(&pool->cond, NULL) != 0) goto fail_cond;
+    for (; strands < MAX_CLIENTS; strands++) {
+        if (pthread_mutex_init(&pool->strands[strands].mutex, NULL) != 0) goto fail_strands;
+        if (pthread_cond_init(&pool->strands[strands].cond, NULL) != 0) {
+            pthread_mutex_destroy(&pool->strands[strands].mutex);
+            goto fail_strands;
+        }
+    }
+    for (; locks < workers; locks++) {
+        pool->worker[locks].pool = pool;
+        pool->worker[locks].id = locks;
+        if (pthread_mutex_init(&pool->worker[locks].mutex, NULL) != 0) goto fail_workers;
+    }
+    for (; started < workers; started++) {
+        if (pthread_create(&pool->worker[started].thread, NULL, worker_thread, &pool->worker[started]) != 0) break;
+    }
+    if (started == 0) goto fail_workers;
+    pool->workers = started; /* nothing is queued yet, so shrinking is safe */
+    return pool;
+fail_workers:
+    while (locks-- > 0) pthread_mutex_destroy(&pool->worker[locks].mutex);
+fail_strands:
+    while (strands-- > 0) {
+        pthread_cond_destroy(&pool->strands[strands].cond);
+        pthread_mutex_destroy(&pool->strands[strands].mutex);
+    }
+    pthread_cond_destroy(&pool->cond);
+fail_cond:
+    pthread_mutex_destroy(&pool->mutex);
+fail_mutex:
+    free(pool);
+    return NULL;
+}
+
+/* Runs what is already queued, then joins the workers and frees the pool.
+ * No reader may submit any more. */
+void worker_pool_stop(WorkerPool* pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->workers; i++) {
+        pthread_join(pool->worker[i].thread, NULL);
+        pthread_mutex_destroy(&pool->worker[i].mutex);
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        pthread_cond_destroy(&pool->strands[i].cond);
+        pthread_mutex_destroy(&pool->strands[i].mutex);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/* Blocks the calling reader, and only it, while its strand is full. */
+void worker_pool_submit(WorkerPool* pool, int client_index, const MessageInfo* msg) {
+    Strand* s = &pool->strands[client_index];
+    pthread_mutex_lock(&s->mutex);
+    if (s->count == WORKER_STRAND_DEPTH) s->stalls++;
+    while (s->count == WORKER_STRAND_DEPTH) pthread_cond_wait(&s->cond, &s->mutex);
+    s->frames[(s->head + s->count) % WORKER_STRAND_DEPTH] = *msg;
+    s->count++;
+    int idle = !s->scheduled;
+    s->scheduled = 1;
+    pthread_mutex_unlock(&s->mutex);
+    if (idle) schedule_strand(pool, client_index % pool->workers, client_index, 0);
+}
+
+/* Waits until every frame submitted for client_index has been handled. */
+void worker_pool_drain(WorkerPool* pool, int client_index) {
+    if (!pool) return;
+    Strand* s = &pool->strands[client_index];
+    pthread_mutex_lock(&s->mutex);
+    while (s->scheduled) pthread_cond_wait(&s->cond, &s->mutex);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/* Frames read but not handled yet, over all connections. */
+int worker_pool_backlog(WorkerPool* pool) {
+    int n = 0;
+    if (!pool) return 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        pthread_mutex_lock(&pool->strands[i].mutex);
+        n += pool->strands[i].count;
+        pthread_mutex_unlock(&pool->strands[i].mutex);
+    }
+    return n;
+}
+
+void worker_pool_print_stats(WorkerPool* pool) {
+    if (!pool) return;
+    unsigned long long stalls = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        pthread_mutex_lock(&pool->strands[i].mutex);
+        stalls += pool->strands[i].stalls;
+        pthread_mutex_unlock(&pool->strands[i].mutex);
+    }
+    printf(CYAN "=== Workers ===" RESET "\n");
+    for (int i = 0; i < pool->workers; i++) {
+        Worker* w = &pool->worker[i];
+        pthread_mutex_lock(&w->mutex);
+        printf("worker %d: frames %llu, strand runs %llu, stolen %llu\n", i, w->frames, w->runs, w->steals);
+        pthread_mutex_unlock(&w->mutex);
+    }
+    printf("reads stalled on a full strand: %llu\n", stalls);
+}
@@ -0,0 +1,390 @@
+#include "../../include/common.h"
+
+/*
+ * Replays a capture written by `server --capture` against a running server.
+ * Every captured connection gets its own socket, opened and closed at the
+ * recorded offsets, and frames are re-sent at their recorded offsets divided
+ * by the speed factor (0 sends as fast as possible). Replies are read and
+ * discarded by a drain thread so the server never blocks on a replay
+ * connection. FILE_DATA payloads are not captured; zero bytes of the same
+ * length are sent in their place.
+ *
+ * The drain thread still splits replies into frames, to report how well
+ * packed ones compressed and what unpacking them costs. --compress on|off
+ * overrides whether the recorded JOIN and RESUME frames ask for packing.
+ */
+
+#define REPLAY_MAX_CONNS 1024
+
+/* half-close on a recorded disconnect so replies already queued still drain */
+#ifdef _WIN32
+    #define SHUTDOWN_SEND SD_SEND
+#else
+    #define SHUTDOWN_SEND SHUT_WR
+#endif
+
+typedef struct {
+    uint32_t conn_id;
+    SOCKET sock;
+    int open;
+    unsigned char frame[sizeof(MessageInfo)];
+    size_t have;
+    size_t skip;
+} ReplayConn;
+
+typedef struct {
+    ReplayConn conns[REPLAY_MAX_CONNS];
+    int count;
+    pthread_mutex_t mutex;
+    int done;
+    unsigned long long bytes_received;
+    unsigned long long replies;
+    unsigned long long replies_packed;
+    unsigned long long reply_bytes;
+    unsigned long long unpack_failed;
+    uint64_t unpack_ns;
+} Replay;
+
+int initialize_network(void) {
+#ifdef _WIN32
+    WSADATA wsa_data;
+    return WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#else
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+#endif
+}
+
+void cleanup_network(void) {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+int create_socket(void) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        print_error("Failed to create socket");
+        return -1;
+    }
+    return sock;
+}
+
+int connect_to_server(SOCKET sock, const char* ip, int port) {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0) {
+        print_error("Invalid address");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+        print_error("Failed to connect to server");
+        return -1;
+    }
+    return 0;
+}
+
+static int send_all(SOCKET sock, const char* buf, size_t len) {
+    while (len > 0) {
+        int n = send(sock, buf, (int)len, 0);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int send_message(SOCKET sock, const MessageInfo* msg) {
+    return send_all(sock, (const char*)msg, sizeof(MessageInfo)) == 0 ? (int)sizeof(MessageInfo) : SOCKET_ERROR;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    uint64_t now = monotonic_ns();
+    if (deadline_ns <= now) return;
+    uint64_t wait = deadline_ns - now;
+#ifdef _WIN32
+    Sleep((DWORD)(wait / 1000000ULL));
+#else
+    struct timespec ts;
+    ts.tv_sec = (time_t)(wait / 1000000000ULL);
+    ts.tv_nsec = (long)(wait % 1000000000ULL);
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static ReplayConn* find_conn(Replay* replay, uint32_t conn_id) {
+    for (int i = 0; i < replay->count; i++) {
+        if (replay->conns[i].conn_id == conn_id && replay->conns[i].open) return &replay->conns[i];
+    }
+    return NULL;
+}
+
+/* Called with replay->mutex held. A reply is a plain frame, possibly
+ * followed by a file payload, or a packed one; see common.h. */
+static void parse_replies(Replay* replay, ReplayConn* conn, const unsigned char* p, size_t n) {
+    while (n > 0) {
+        if (conn->skip) {
+            size_t k = n < conn->skip ? n : conn->skip;
+            conn->skip -= k;
+            p += k;
+            n -= k;
+            continue;
+        }
+        size_t want = WIRE_HEADER_SIZE;
+        if (conn->have >= WIRE_HEADER_SIZE) {
+            int packed = wire_packed_length(conn->frame);
+            want = packed < 0 ? sizeof(MessageInfo) : WIRE_HEADER_SIZE + (size_t)packed;
+        }
+        size_t k = want - conn->have < n ? want - conn->have : n;
+        memcpy(conn->frame + conn->have, p, k);
+        conn->have += k;
+        p += k;
+        n -= k;
+        if (conn->have < want || want == WIRE_HEADER_SIZE) continue;
+        MessageInfo msg;
+        if (want == sizeof(MessageInfo) && wire_packed_length(conn->frame) < 0) {
+            memcpy(&msg, conn->frame, sizeof(msg));
+        } else {
+            uint64_t start = monotonic_ns();
+            int rc = wire_unpack(conn->frame, conn->frame + WIRE_HEADER_SIZE, want - WIRE_HEADER_SIZE, &msg);
+            replay->unpack_ns += monotonic_ns() - start;
+            replay->replies_packed++;
+            if (rc != 0) replay->unpack_failed++;
+        }
+        replay->replies++;
+        replay->reply_bytes += want;
+        conn->have = 0;
+        if (msg.type == MSG_TYPE_FILE_DATA && msg.count > 0 && msg.count <= FILE_CHUNK_SIZE) conn->skip = (size_t)msg.count;
+    }
+}
+
+/* Owns closing: the replay loop only shuts sockets down, so a descriptor
+ * can never be closed while it is in the select set. */
+static void* drain_thread(void* arg) {
+    Replay* replay = arg;
+    char buf[64 * 1024];
+    for (;;) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        SOCKET max_fd = 0;
+        int watched = 0;
+        pthread_mutex_lock(&replay->mutex);
+        int done = replay->done;
+        for (int i = 0; i < replay->count && watched < FD_SETSIZE; i++) {
+            if (!replay->conns[i].open) continue;
+            FD_SET(replay->conns[i].sock, &fds);
+            if (replay->conns[i].sock > max_fd) max_fd = replay->conns[i].sock;
+            watched++;
+        }
+        pthread_mutex_unlock(&replay->mutex);
+        if (done && watched == 0) break;
+
+        struct timeval tv = {0, 50 * 1000};
+        if (watched == 0 || select((int)max_fd + 1, &fds, NULL, NULL, &tv) <= 0) {
+            if (watched == 0) sleep_until(monotonic_ns() + 50000000ULL);
+            continue;
+        }
+        pthread_mutex_lock(&replay->mutex);
+        for (int i = 0; i < replay->count; i++) {
+            ReplayConn* conn = &replay->conns[i];
+            if (!conn->open || !FD_ISSET(conn->sock, &fds)) continue;
+            int n = recv(conn->sock, buf, sizeof(buf), 0);
+            if (n > 0) {
+                replay->bytes_received += (unsigned long long)n;
+                parse_replies(replay, conn, (const unsigned char*)buf, (size_t)n);
+            } else {
+                CLOSE_SOCKET(conn->sock);
+                conn->open = 0;
+            }
+        }
+        pthread_mutex_unlock(&replay->mutex);
+    }
+    return NULL;
+}
+
+static void open_conn(Replay* replay, uint32_t conn_id, const char* ip, int port) {
+    SOCKET sock = create_socket();
+    if (sock == INVALID_SOCKET) return;
+    if (connect_to_server(sock, ip, port) != 0) {
+        CLOSE_SOCKET(sock);
+        return;
+    }
+    pthread_mutex_lock(&replay->mutex);
+    int slot = -1;
+    for (int i = 0; i < replay->count && slot < 0; i++) {
+        if (!replay->conns[i].open) slot = i;
+    }
+    if (slot < 0 && replay->count < REPLAY_MAX_CONNS) slot = replay->count++;
+    if (slot >= 0) {
+        replay->conns[slot].conn_id = conn_id;
+        replay->conns[slot].sock = sock;
+        replay->conns[slot].open = 1;
+        replay->conns[slot].have = 0;
+        replay->conns[slot].skip = 0;
+    }
+    pthread_mutex_unlock(&replay->mutex);
+    if (slot < 0) {
+        print_error("Too many concurrent replay connections");
+        CLOSE_SOCKET(sock);
+    }
+}
+
+static void shutdown_conn(Replay* replay, uint32_t conn_id) {
+    pthread_mutex_lock(&replay->mutex);
+    ReplayConn* conn = find_conn(replay, conn_id);
+    if (conn) shutdown(conn->sock, SHUTDOWN_SEND);
+    pthread_mutex_unlock(&replay->mutex);
+}
+
+static int send_frame(Replay* replay, uint32_t conn_id, const MessageInfo* msg) {
+    static const char zeros[FILE_CHUNK_SIZE];
+    pthread_mutex_lock(&replay->mutex);
+    ReplayConn* conn = find_conn(replay, conn_id);
+    SOCKET sock = conn ? conn->sock : INVALID_SOCKET;
+    pthread_mutex_unlock(&replay->mutex);
+    if (sock == INVALID_SOCKET) return -1;
+    if (send_message(sock, msg) == SOCKET_ERROR) return -1;
+    if (msg->type == MSG_TYPE_FILE_DATA && msg->count > 0 && msg->count <= FILE_CHUNK_SIZE) {
+        return send_all(sock, zeros, (size_t)msg->count);
+    }
+    return 0;
+}
+
+static void print_usage(const char* prog) {
+    printf("Usage: %s <capture file> [server_ip] [port] [--speed N] [--compress on|off]\n", prog);
+    printf("  --speed N         replay N times faster than recorded (default 1, 0 = no pacing)\n");
+    printf("  --compress on|off ask for packed replies or not, whatever the capture says\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* path = NULL;
+    char server_ip[64] = SERVER_IP;
+    int port = DEFAULT_PORT;
+    double speed = 1.0;
+    int compress = -1;
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) speed = atof(argv[++i]);
+        else if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc) compress = strcmp(argv[++i], "off") != 0;
+        else if (positional == 0 && ++positional) path = argv[i];
+        else if (positional == 1 && ++positional) snprintf(server_ip, sizeof(server_ip), "%s", argv[i]);
+        else port = atoi(argv[i]);
+    }
+    if (!path || speed < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        print_error("Cannot open capture file");
+        return 1;
+    }
+    CaptureFileHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+        print_error("Not a capture file");
+        fclose(fp);
+        return 1;
+    }
+    if (header.version != CAPTURE_VERSION || header.frame_size != sizeof(MessageInfo)) {
+        print_error("Capture was written by an incompatible server build");
+        fclose(fp);
+        return 1;
+    }
+    if (initialize_network() != 0) {
+        print_error(FAILED_INIT_MESSAGE);
+        fclose(fp);
+        return 1;
+    }
+
+    Replay* replay = calloc(1, sizeof(Replay));
+    if (!replay || pthread_mutex_init(&replay->mutex, NULL) != 0) {
+        print_error("Failed to initialize replay");
+        fclose(fp);
+        return 1;
+    }
+    pthread_t drain_tid;
+    if (pthread_create(&drain_tid, NULL, drain_thread, replay) != 0) {
+        print_error("Failed to create drain thread");
+        fclose(fp);
+        return 1;
+    }
+
+    print_system_message("Replaying capture");
+    printf("Server: " BOLD_CYAN "%s:%d" RESET ", speed " BOLD_CYAN "%.2fx" RESET "\n", server_ip, port, speed);
+
+    unsigned long long records = 0, frames = 0, failed = 0, connections = 0;
+    uint64_t recorded_ns = 0, lag_total = 0, lag_max = 0;
+    uint64_t start = monotonic_ns();
+    unsigned char body[2 * sizeof(MessageInfo)];
+    CaptureRecord rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (rec.len > sizeof(body) || (rec.len && fread(body, 1, rec.len, fp) != rec.len)) {
+            print_error("Capture file is truncated");
+            break;
+        }
+        records++;
+        recorded_ns = rec.ts_ns;
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)((double)rec.ts_ns / speed);
+            sleep_until(due);
+            uint64_t lag = monotonic_ns() - due;
+            lag_total += lag;
+            if (lag > lag_max) lag_max = lag;
+        }
+        if (rec.kind == CAPTURE_OPEN) {
+            open_conn(replay, rec.conn_id, server_ip, port);
+            connections++;
+        } else if (rec.kind == CAPTURE_CLOSE) {
+            shutdown_conn(replay, rec.conn_id);
+        } else if (rec.kind == CAPTURE_FRAME) {
+            MessageInfo msg;
+            int decoded = capture_decode(body, rec.len, (unsigned char*)&msg, sizeof(msg)) == sizeof(msg);
+            if (decoded && compress >= 0 && (msg.type == MSG_TYPE_JOIN || msg.type == MSG_TYPE_RESUME)) {
+                if (compress) {
+                    msg.flags |= MSG_FLAG_COMPRESS;
+                    msg.cursor = COMPRESS_DICT_VERSION;
+                } else {
+                    msg.flags &= ~(uint32_t)MSG_FLAG_COMPRESS;
+                }
+            }
+            if (!decoded || send_frame(replay, rec.conn_id, &msg) != 0) {
+                failed++;
+            } else {
+                frames++;
+            }
+        }
+    }
+    fclose(fp);
+    uint64_t elapsed = monotonic_ns() - start;
+
+    sleep_until(monotonic_ns() + 500000000ULL);
+    pthread_mutex_lock(&replay->mutex);
+    for (int i = 0; i < replay->count; i++) {
+        if (replay->conns[i].open) shutdown(replay->conns[i].sock, SHUTDOWN_BOTH);
+    }
+    replay->done = 1;
+    pthread_mutex_unlock(&replay->mutex);
+    pthread_join(drain_tid, NULL);
+
+    printf(CYAN "=== Replay ===" RESET "\n");
+    printf("records %llu, connections %llu, frames sent %llu, frames failed %llu\n", records, connections, frames, failed);
+    printf("recorded %.3f s, replayed %.3f s, %.0f frames/s\n", recorded_ns / 1e9, elapsed / 1e9,
+           elapsed ? frames / (elapsed / 1e9) : 0.0);
+    if (speed > 0 && records) {
+        printf("schedule lag: mean %.1f us, max %.1f us\n", lag_total / 1000.0 / (double)records, lag_max / 1000.0);
+    }
+    printf("received %llu bytes of replies\n", replay->bytes_received);
+    printf("replies %llu, packed %llu (%llu corrupt), %.1f bytes per frame, ratio %.1f:1, unpack mean %.2f us\n",
+           replay->replies, replay->replies_packed, replay->unpack_failed,
+           replay->replies ? (double)replay->reply_bytes / (double)replay->replies : 0.0,
+           replay->reply_bytes ? (double)replay->replies * sizeof(MessageInfo) / (double)replay->reply_bytes : 0.0,
+           replay->replies_packed ? replay->unpack_ns / 1000.0 / (double)replay->replies_packed : 0.0);
+
+    pthread_mutex_destroy(&replay->mutex);
+    free(replay);
+    cleanup_network();
+    return failed ? 2 : 0;
+}